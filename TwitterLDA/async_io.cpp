@@ -0,0 +1,543 @@
+#include "async_io.h"
+#include "utility.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_URING
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+const size_t async_io::chunk_size;
+const size_t async_io::depth;
+async_io::io_mode async_io::_default_mode = async_io::io_mode::sync;
+
+async_io::async_io()
+{
+	for (size_t i = 0; i < depth; ++i)
+	{
+		_requests[i].data = nullptr;
+		_requests[i].position = 0;
+		_requests[i].size = 0;
+		_requests[i].count = 0;
+		_requests[i].write = false;
+		_requests[i].busy = false;
+	}
+}
+
+async_io::~async_io()
+{
+}
+
+void async_io::set_default_mode(io_mode mode)
+{
+	_default_mode = mode;
+}
+
+async_io::io_mode async_io::default_mode()
+{
+	return _default_mode;
+}
+
+bool async_io::parse_mode(const char *name, io_mode *mode)
+{
+	if (strcmp(name, "sync") == 0) *mode = io_mode::sync;
+	else if (strcmp(name, "thread") == 0) *mode = io_mode::thread;
+	else if (strcmp(name, "uring") == 0) *mode = io_mode::uring;
+	else return false;
+	return true;
+}
+
+// Each worker thread emulates pread/pwrite with its own file handle
+class thread_io : public async_io
+{
+public:
+	thread_io(const char *path, bool write)
+	{
+		_path = path;
+		_write = write;
+		_exit = false;
+		for (size_t i = 0; i < depth; ++i) _threads[i] = std::thread(&thread_io::_worker, this);
+	}
+
+	~thread_io()
+	{
+		for (size_t i = 0; i < depth; ++i) wait(i);
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_exit = true;
+			_job_cv.notify_all();
+		}
+		for (size_t i = 0; i < depth; ++i) _threads[i].join();
+	}
+
+	void submit(size_t slot, char *data, long long position, size_t size, bool write)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		request &r = _requests[slot];
+		r.data = data;
+		r.position = position;
+		r.size = size;
+		r.count = 0;
+		r.write = write;
+		r.busy = true;
+		_jobs.push_back(slot);
+		_job_cv.notify_one();
+	}
+
+	size_t wait(size_t slot)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_requests[slot].busy) _done_cv.wait(lock);
+		return _requests[slot].count;
+	}
+
+private:
+	std::string _path;
+	bool _write;
+	bool _exit;
+	std::thread _threads[depth];
+	std::mutex _mutex;
+	std::condition_variable _job_cv, _done_cv;
+	std::deque<size_t> _jobs;
+
+	void _worker()
+	{
+		FILE *fp = fopen(_path.c_str(), _write ? "r+b" : "rb");
+		while (true)
+		{
+			size_t slot;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (_jobs.empty() && !_exit) _job_cv.wait(lock);
+				if (_jobs.empty()) break;
+				slot = _jobs.front();
+				_jobs.pop_front();
+			}
+
+			request r = _requests[slot];
+			size_t count = 0;
+			if (fp != nullptr && utility::seek_file(fp, r.position))
+			{
+				if (r.write)
+				{
+					count = utility::fwrite(r.data, r.size, fp);
+					fflush(fp);
+				}
+				else
+				{
+					count = utility::fread(r.data, r.size, fp);
+				}
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_requests[slot].count = count;
+				_requests[slot].busy = false;
+				_done_cv.notify_all();
+			}
+		}
+		if (fp != nullptr) fclose(fp);
+	}
+};
+
+#ifdef ASYNC_IO_URING
+// Raw io_uring without liburing, one submission per request
+class uring_io : public async_io
+{
+public:
+	uring_io(const char *path, bool write)
+	{
+		_ring_fd = -1;
+		_fd = open(path, write ? O_WRONLY : O_RDONLY);
+		if (_fd < 0) return;
+
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		_ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+		if (_ring_fd < 0) return;
+
+		_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap) _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+		_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+		_sq_ptr = (char*)mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+		_cq_ptr = single_mmap ? _sq_ptr : (char*)mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+		_sqes = (io_uring_sqe*)mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+		if (_sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED || (void*)_sqes == MAP_FAILED)
+		{
+			close(_ring_fd);
+			_ring_fd = -1;
+			return;
+		}
+
+		_sq_tail = (unsigned*)(_sq_ptr + params.sq_off.tail);
+		_sq_mask = (unsigned*)(_sq_ptr + params.sq_off.ring_mask);
+		_sq_array = (unsigned*)(_sq_ptr + params.sq_off.array);
+		_cq_head = (unsigned*)(_cq_ptr + params.cq_off.head);
+		_cq_tail = (unsigned*)(_cq_ptr + params.cq_off.tail);
+		_cq_mask = (unsigned*)(_cq_ptr + params.cq_off.ring_mask);
+		_cqes = (io_uring_cqe*)(_cq_ptr + params.cq_off.cqes);
+	}
+
+	~uring_io()
+	{
+		if (_ring_fd >= 0)
+		{
+			for (size_t i = 0; i < depth; ++i) wait(i);
+			munmap(_sqes, _sqes_size);
+			if (_cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+			munmap(_sq_ptr, _sq_size);
+			close(_ring_fd);
+		}
+		if (_fd >= 0) close(_fd);
+	}
+
+	bool is_valid() const
+	{
+		return _ring_fd >= 0;
+	}
+
+	void submit(size_t slot, char *data, long long position, size_t size, bool write)
+	{
+		request &r = _requests[slot];
+		r.data = data;
+		r.position = position;
+		r.size = size;
+		r.count = 0;
+		r.write = write;
+		r.busy = true;
+		_submit(slot);
+	}
+
+	size_t wait(size_t slot)
+	{
+		while (_requests[slot].busy)
+		{
+			if (!_reap()) syscall(__NR_io_uring_enter, _ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+		return _requests[slot].count;
+	}
+
+private:
+	int _fd, _ring_fd;
+	char *_sq_ptr, *_cq_ptr;
+	size_t _sq_size, _cq_size, _sqes_size;
+	unsigned *_sq_tail, *_sq_mask, *_sq_array;
+	unsigned *_cq_head, *_cq_tail, *_cq_mask;
+	io_uring_sqe *_sqes;
+	io_uring_cqe *_cqes;
+	iovec _iovecs[depth];
+
+	void _submit(size_t slot)
+	{
+		// continue from what has been transferred, in case of short transfer
+		request &r = _requests[slot];
+		_iovecs[slot].iov_base = r.data + r.count;
+		_iovecs[slot].iov_len = r.size - r.count;
+
+		unsigned tail = *_sq_tail;
+		unsigned index = tail & *_sq_mask;
+		io_uring_sqe *sqe = &_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = _fd;
+		sqe->addr = (unsigned long long)&_iovecs[slot];
+		sqe->len = 1;
+		sqe->off = r.position + r.count;
+		sqe->user_data = slot;
+		_sq_array[index] = index;
+		__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		syscall(__NR_io_uring_enter, _ring_fd, 1, 0, 0, nullptr, 0);
+	}
+
+	bool _reap()
+	{
+		bool reaped = false;
+		unsigned head = *_cq_head;
+		while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+		{
+			io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+			request &r = _requests[cqe->user_data];
+			++head;
+			__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+			reaped = true;
+
+			if (cqe->res > 0) r.count += cqe->res;
+			if (cqe->res > 0 && r.count < r.size)
+			{
+				_submit((size_t)cqe->user_data);
+			}
+			else
+			{
+				if (cqe->res < 0) printf("I/O error %d\n", -cqe->res);
+				r.busy = false;
+			}
+		}
+		return reaped;
+	}
+};
+#endif
+
+async_io *async_io::create(const char *path, bool write, io_mode mode)
+{
+	if (mode == io_mode::sync) return nullptr;
+#ifdef ASYNC_IO_URING
+	if (mode == io_mode::uring)
+	{
+		uring_io *io = new uring_io(path, write);
+		if (io->is_valid()) return io;
+		delete io;
+	}
+#endif
+	return new thread_io(path, write);
+}
+
+async_reader::async_reader(async_io *io, long long file_size)
+{
+	_io = io;
+	_file_size = file_size;
+	for (size_t i = 0; i < async_io::depth; ++i)
+	{
+		_chunks[i] = new char[async_io::chunk_size];
+		_pending[i] = false;
+		_counts[i] = 0;
+		_sizes[i] = 0;
+	}
+	_slot = 0;
+	_offset = 0;
+	_next_position = 0;
+	_started = false;
+	_eof = false;
+}
+
+async_reader::~async_reader()
+{
+	_drain();
+	delete _io;
+	for (size_t i = 0; i < async_io::depth; ++i) delete[] _chunks[i];
+}
+
+void async_reader::seek(long long position)
+{
+	_drain();
+	_slot = 0;
+	_offset = 0;
+	_next_position = position;
+	_started = false;
+	_eof = false;
+}
+
+size_t async_reader::read(char *data, size_t size)
+{
+	// requests start at first read, so that seeking right after opening costs nothing
+	if (!_started)
+	{
+		for (size_t i = 0; i < async_io::depth; ++i) _submit(i);
+		_started = true;
+	}
+
+	size_t total = 0;
+	while (size > 0 && !_eof)
+	{
+		if (_pending[_slot])
+		{
+			_counts[_slot] = _io->wait(_slot);
+			_pending[_slot] = false;
+		}
+
+		size_t more = std::min(size, _counts[_slot] - _offset);
+		memcpy(data, _chunks[_slot] + _offset, more);
+		data += more;
+		size -= more;
+		total += more;
+		_offset += more;
+
+		if (_offset == _counts[_slot])
+		{
+			// short chunk means end of file
+			if (_counts[_slot] < _sizes[_slot] || _sizes[_slot] == 0)
+			{
+				_eof = true;
+				break;
+			}
+			_offset = 0;
+			_submit(_slot);
+			_slot = (_slot + 1) % async_io::depth;
+		}
+	}
+	return total;
+}
+
+void async_reader::_submit(size_t slot)
+{
+	_counts[slot] = 0;
+	_sizes[slot] = (size_t)std::max(0LL, std::min((long long)async_io::chunk_size, _file_size - _next_position));
+	if (_sizes[slot] == 0) return;
+	_io->submit(slot, _chunks[slot], _next_position, _sizes[slot], false);
+	_pending[slot] = true;
+	_next_position += _sizes[slot];
+}
+
+void async_reader::_drain()
+{
+	for (size_t i = 0; i < async_io::depth; ++i)
+	{
+		if (_pending[i]) _io->wait(i);
+		_pending[i] = false;
+	}
+}
+
+file_writer::file_writer(const char *path, bool in_place, async_io::io_mode mode)
+{
+	_path = utility::new_string(path, "");
+	_fp = fopen(path, in_place ? "r+b" : "wb");
+	_io = nullptr;
+	_slot = 0;
+	_offset = 0;
+	_position = 0;
+	for (size_t i = 0; i < async_io::depth; ++i) _chunks[i] = nullptr;
+	if (_fp == nullptr || mode == async_io::io_mode::sync) return;
+
+	// the file is created, background requests write through their own handles
+	fclose(_fp);
+	_fp = nullptr;
+	_io = async_io::create(path, true, mode);
+	for (size_t i = 0; i < async_io::depth; ++i) _chunks[i] = new char[async_io::chunk_size];
+}
+
+file_writer::~file_writer()
+{
+	close();
+	delete[] _path;
+}
+
+bool file_writer::is_open() const
+{
+	return _fp != nullptr || _io != nullptr;
+}
+
+size_t file_writer::write(const char *data, size_t size)
+{
+	if (_fp != nullptr)
+	{
+		size_t count = utility::fwrite(data, size, _fp);
+		_position += count;
+		return count;
+	}
+	if (_io == nullptr) return 0;
+
+	size_t total = size;
+	while (size > 0)
+	{
+		size_t more = std::min(size, async_io::chunk_size - _offset);
+		memcpy(_chunks[_slot] + _offset, data, more);
+		_offset += more;
+		_position += more;
+		data += more;
+		size -= more;
+		if (_offset == async_io::chunk_size) _flush();
+	}
+	return total;
+}
+
+size_t file_writer::write_at(long long position, const char *data, size_t size)
+{
+	if (_fp != nullptr)
+	{
+		utility::seek_file(_fp, position);
+		size_t count = utility::fwrite(data, size, _fp);
+		utility::seek_file(_fp, _position);
+		return count;
+	}
+	if (_io == nullptr) return 0;
+
+	_flush();
+	size_t total = size;
+	while (size > 0)
+	{
+		size_t more = std::min(size, async_io::chunk_size);
+		memcpy(_chunks[_slot], data, more);
+		_io->submit(_slot, _chunks[_slot], position, more, true);
+		_next_slot();
+		position += more;
+		data += more;
+		size -= more;
+	}
+	return total;
+}
+
+void file_writer::seek(long long position)
+{
+	// sequential writes continue at position, used to append to files opened in place
+	if (_fp != nullptr)
+	{
+		utility::seek_file(_fp, position);
+		_position = position;
+		return;
+	}
+	if (_io == nullptr) return;
+
+	_flush();
+	_position = position;
+}
+
+bool file_writer::sync()
+{
+	if (_fp != nullptr) return utility::sync_file(_fp);
+	if (_io == nullptr) return false;
+
+	_flush();
+	for (size_t i = 0; i < async_io::depth; ++i) _io->wait(i);
+	return utility::sync_file(_path);
+}
+
+void file_writer::close()
+{
+	if (_fp != nullptr)
+	{
+		fclose(_fp);
+		_fp = nullptr;
+	}
+	if (_io != nullptr)
+	{
+		_flush();
+		delete _io;
+		_io = nullptr;
+		for (size_t i = 0; i < async_io::depth; ++i)
+		{
+			delete[] _chunks[i];
+			_chunks[i] = nullptr;
+		}
+	}
+}
+
+void file_writer::_flush()
+{
+	if (_offset == 0) return;
+	_io->submit(_slot, _chunks[_slot], _position - _offset, _offset, true);
+	_offset = 0;
+	_next_slot();
+}
+
+void file_writer::_next_slot()
+{
+	// wait for the request previously submitted from the next chunk
+	_slot = (_slot + 1) % async_io::depth;
+	_io->wait(_slot);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdio>
+
+// Positional reads and writes on one file, with a fixed number of request slots in flight
+class async_io
+{
+public:
+	enum io_mode
+	{
+		sync, thread, uring
+	};
+
+	static const size_t chunk_size = 4 << 20;
+	static const size_t depth = 4;
+
+	static async_io *create(const char *path, bool write, io_mode mode);
+	static void set_default_mode(io_mode mode);
+	static io_mode default_mode();
+	static bool parse_mode(const char *name, io_mode *mode);
+
+	async_io();
+	virtual ~async_io();
+
+	// slot must not be in flight
+	virtual void submit(size_t slot, char *data, long long position, size_t size, bool write) = 0;
+
+	// block until the request in slot completes, returns number of bytes transferred
+	virtual size_t wait(size_t slot) = 0;
+
+protected:
+	struct request
+	{
+		char *data;
+		long long position;
+		size_t size;
+		size_t count;
+		bool write;
+		bool busy;
+	};
+
+	request _requests[depth];
+
+	static io_mode _default_mode;
+};
+
+// Sequential reads with a ring of chunks in flight ahead of the consumer
+class async_reader
+{
+public:
+	async_reader(async_io *io, long long file_size);
+	~async_reader();
+
+	size_t read(char *data, size_t size);
+	void seek(long long position);
+
+private:
+	async_io *_io;
+	long long _file_size;
+	char *_chunks[async_io::depth];
+	size_t _counts[async_io::depth];
+	size_t _sizes[async_io::depth];
+	bool _pending[async_io::depth];
+	size_t _slot;
+	size_t _offset;
+	long long _next_position;
+	bool _started;
+	bool _eof;
+
+	void _submit(size_t slot);
+	void _drain();
+};
+
+// Sequential and positional writes, either blocking or handed to background requests
+class file_writer
+{
+public:
+	file_writer(const char *path, bool in_place = false, async_io::io_mode mode = async_io::default_mode());
+	~file_writer();
+
+	bool is_open() const;
+	size_t write(const char *data, size_t size);
+	size_t write_at(long long position, const char *data, size_t size);
+	void seek(long long position);
+	bool sync(); // waits for background requests and flushes the file to disk
+	void close();
+
+private:
+	char *_path;
+	FILE *_fp;
+	async_io *_io;
+	char *_chunks[async_io::depth];
+	size_t _slot;
+	size_t _offset;
+	long long _position;
+
+	void _flush();
+	void _next_slot();
+};
@@ -0,0 +1,1256 @@
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include "buffer_builder.h"
+#include "file_reader.h"
+#include "tweet_index.h"
+#include "async_io.h"
+#include "parallel.h"
+#include "utility.h"
+
+static char default_user[] = "*";
+
+// user field before the first tab, lines without a tab belong to the default user, returns the text after it
+static const char *split_user(const char *data, size_t size, const char **user, size_t *user_size)
+{
+	const char *tab = (const char*)memchr(data, '\t', size);
+	if (tab == nullptr)
+	{
+		*user = default_user;
+		*user_size = sizeof(default_user) - 1;
+		return data;
+	}
+	*user = data;
+	*user_size = (size_t)(tab - data);
+	return tab + 1;
+}
+
+// copy of a token span terminated for lookups in maps keyed by strings
+static char *make_key(std::vector<char> &key, const char *data, size_t size)
+{
+	key.resize(size + 1);
+	memcpy(key.data(), data, size);
+	key[size] = '\0';
+	return key.data();
+}
+
+// output files of one buffer shard
+struct buffer_shard
+{
+	file_writer *buffer_writer, *tweet_id_writer;
+	long long buffer_size, tweet_id_size, tweet_count, user_record_count;
+	int prev_user_id;
+	std::vector<tweet_index_item> index_items;
+};
+
+// key values of the summary file written with the buffer
+struct buffer_summary
+{
+	int word_num, user_num;
+	long long valid_tweet_num, total_tweet_num;
+	long long text_size; // -1 for buffers written before appending was supported
+	unsigned long long text_hash; // fingerprint of the text the buffer was first built from, 0 if unknown
+	int shard_num, hash_num;
+	bool sorted; // tweets are grouped by user instead of in line order
+};
+
+// counted line with thread local provisional ids, written by the single pass
+class provisional_file_reader : public file_reader
+{
+public:
+	provisional_file_reader(const char *path) : file_reader(path, 16 << 20)
+	{
+	}
+
+	size_t segment(char *data, size_t size)
+	{
+		utility::read_buffer buffer(data, size);
+		int thread, line_size, user, count;
+		if (buffer.read_varint(&thread) == 0 || buffer.read_varint(&line_size) == 0) return 0;
+		if (buffer.read_varint(&user) == 0 || buffer.read_varint(&count) == 0) return 0;
+		for (int i = 0; i < count; ++i)
+		{
+			int word;
+			if (buffer.read_varint(&word) == 0) return 0;
+		}
+		return buffer.offset();
+	}
+};
+
+static void open_shards(std::vector<buffer_shard> &shards, const char *buffer_path, const char *tweet_id_path, int shard_num, tweet_file_reader::format_version buffer_version, bool weighted)
+{
+	shards.resize((size_t)std::max(shard_num, 1));
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		char *shard_buffer_path = utility::shard_path(buffer_path, shard_num, (int)i);
+		char *shard_tweet_id_path = utility::shard_path(tweet_id_path, shard_num, (int)i);
+		shards[i].buffer_writer = new file_writer(shard_buffer_path);
+		shards[i].tweet_id_writer = new file_writer(shard_tweet_id_path);
+		shards[i].buffer_size = tweet_file_reader::write_header(*shards[i].buffer_writer, buffer_version, weighted);
+		shards[i].tweet_id_size = 0;
+		shards[i].tweet_count = 0;
+		shards[i].user_record_count = 0;
+		shards[i].prev_user_id = -1;
+		delete[] shard_buffer_path;
+		delete[] shard_tweet_id_path;
+	}
+}
+
+static void close_shards(std::vector<buffer_shard> &shards, const char *tweet_index_path, int shard_num)
+{
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		buffer_shard &shard = shards[i];
+		delete shard.buffer_writer;
+		delete shard.tweet_id_writer;
+
+		std::vector<tweet_index_item> &index_items = shard.index_items;
+		if (!index_items.empty()) index_items.back().tweet_count = (int)(shard.tweet_count - index_items.back().tweet);
+		char *shard_tweet_index_path = utility::shard_path(tweet_index_path, shard_num, (int)i);
+		tweet_index::save(shard_tweet_index_path, index_items);
+		delete[] shard_tweet_index_path;
+	}
+}
+
+static void save_summary(const char *summary_path, int word_num, int user_num, long long valid_tweet_count, long long total_tweet_count, long long text_size, unsigned long long text_hash, int shard_num, int hash_num, bool sorted)
+{
+	FILE *fp_summary = fopen(summary_path, "w");
+	fprintf(fp_summary, "word_num=%d\n", word_num);
+	fprintf(fp_summary, "user_num=%d\n", user_num);
+	fprintf(fp_summary, "valid_tweet_num=%lld\n", valid_tweet_count);
+	fprintf(fp_summary, "total_tweet_num=%lld\n", total_tweet_count);
+	fprintf(fp_summary, "text_size=%lld\n", text_size);
+	if (text_hash != 0) fprintf(fp_summary, "text_hash=%llu\n", text_hash);
+	if (shard_num > 0) fprintf(fp_summary, "shard_num=%d\n", shard_num);
+	if (hash_num > 0) fprintf(fp_summary, "hash_num=%d\n", hash_num);
+	if (sorted) fprintf(fp_summary, "sorted=1\n");
+	fclose(fp_summary);
+}
+
+static bool load_summary(const char *summary_path, buffer_summary &summary)
+{
+	FILE *fp = fopen(summary_path, "r");
+	if (fp == nullptr) return false;
+	fclose(fp);
+
+	summary.word_num = summary.user_num = 0;
+	summary.valid_tweet_num = summary.total_tweet_num = 0;
+	summary.text_size = -1;
+	summary.text_hash = 0;
+	summary.shard_num = summary.hash_num = 0;
+	summary.sorted = false;
+	text_file_reader reader(summary_path);
+	while (true)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		char *ptr = strchr(item.data, '=');
+		if (ptr == nullptr) continue;
+		*ptr++ = '\0';
+		if (strcmp(item.data, "word_num") == 0) sscanf(ptr, "%d", &summary.word_num);
+		if (strcmp(item.data, "user_num") == 0) sscanf(ptr, "%d", &summary.user_num);
+		if (strcmp(item.data, "valid_tweet_num") == 0) sscanf(ptr, "%lld", &summary.valid_tweet_num);
+		if (strcmp(item.data, "total_tweet_num") == 0) sscanf(ptr, "%lld", &summary.total_tweet_num);
+		if (strcmp(item.data, "text_size") == 0) sscanf(ptr, "%lld", &summary.text_size);
+		if (strcmp(item.data, "text_hash") == 0) sscanf(ptr, "%llu", &summary.text_hash);
+		if (strcmp(item.data, "shard_num") == 0) sscanf(ptr, "%d", &summary.shard_num);
+		if (strcmp(item.data, "hash_num") == 0) sscanf(ptr, "%d", &summary.hash_num);
+		if (strcmp(item.data, "sorted") == 0) summary.sorted = atoi(ptr) != 0;
+	}
+	return true;
+}
+
+// user or word file, one token and its count per line
+static bool load_counts(const char *path, utility::string_pool &pool, std::vector<char*> &tokens, std::vector<int> &counts)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == nullptr) return false;
+	fclose(fp);
+
+	text_file_reader reader(path);
+	while (true)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		char *ptr = strrchr(item.data, '\t');
+		int count = 0;
+		if (ptr != nullptr)
+		{
+			*ptr++ = '\0';
+			count = atoi(ptr);
+		}
+		tokens.push_back(pool.add(item.data));
+		counts.push_back(count);
+	}
+	return true;
+}
+
+static void save_counts(const char *path, const std::vector<char*> &tokens, const std::vector<int> &counts)
+{
+	FILE *fp = fopen(path, "w");
+	for (size_t i = 0; i < tokens.size(); ++i) fprintf(fp, "%s\t%d\n", tokens[i], counts[i]);
+	fclose(fp);
+}
+
+// reopens shard files in place after their last tweet, runs of the last index block are recounted
+static bool reopen_shards(std::vector<buffer_shard> &shards, std::vector<buffer_extent> &extents, const char *buffer_path, const char *tweet_id_path, const char *tweet_index_path, int shard_num, tweet_file_reader::format_version *buffer_version, bool *weighted)
+{
+	shards.resize((size_t)std::max(shard_num, 1));
+	extents.resize(shards.size());
+	for (size_t i = 0; i < shards.size(); ++i) shards[i].buffer_writer = shards[i].tweet_id_writer = nullptr;
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		char *shard_buffer_path = utility::shard_path(buffer_path, shard_num, (int)i);
+		char *shard_tweet_id_path = utility::shard_path(tweet_id_path, shard_num, (int)i);
+		char *shard_tweet_index_path = utility::shard_path(tweet_index_path, shard_num, (int)i);
+		buffer_shard &shard = shards[i];
+
+		tweet_index index;
+		FILE *fp_buffer = fopen(shard_buffer_path, "rb");
+		FILE *fp_tweet_id = fopen(shard_tweet_id_path, "rb");
+		bool found = fp_buffer != nullptr && fp_tweet_id != nullptr && index.load(shard_tweet_index_path);
+		if (found)
+		{
+			shard.tweet_id_size = utility::file_size(fp_tweet_id);
+			shard.tweet_count = 0;
+			shard.user_record_count = 0;
+			shard.prev_user_id = -1;
+			for (size_t j = 0; j < index.size(); ++j) shard.index_items.push_back(index.item(j));
+
+			tweet_file_reader reader(shard_buffer_path);
+			*buffer_version = reader.version();
+			*weighted = reader.weighted();
+			shard.buffer_size = reader.size();
+			if (!index.empty())
+			{
+				const tweet_index_item &item = index.item(index.size() - 1);
+				shard.tweet_count = item.tweet;
+				shard.user_record_count = item.user_record;
+				reader.seek(item.tweet_offset);
+				std::vector<int> words;
+				while (true)
+				{
+					file_item tweet_item = reader.get_item(false);
+					if (tweet_item.size == 0) break;
+					utility::read_buffer tweet_buffer(tweet_item.data, tweet_item.size);
+					int user;
+					tweet_file_reader::read_tweet(tweet_buffer, reader.version(), &user, words, reader.weighted());
+					if (user != shard.prev_user_id)
+					{
+						++shard.user_record_count;
+						shard.prev_user_id = user;
+					}
+					++shard.tweet_count;
+				}
+			}
+
+			shard.buffer_writer = new file_writer(shard_buffer_path, true);
+			shard.tweet_id_writer = new file_writer(shard_tweet_id_path, true);
+			shard.buffer_writer->seek(shard.buffer_size);
+			shard.tweet_id_writer->seek(shard.tweet_id_size);
+
+			buffer_extent &extent = extents[i];
+			extent.tweet_count = shard.tweet_count;
+			extent.user_record_count = shard.user_record_count;
+			extent.buffer_size = shard.buffer_size;
+			extent.last_user = shard.prev_user_id;
+		}
+		else
+		{
+			printf("Buffer shard %s not found\n", shard_buffer_path);
+		}
+		if (fp_buffer != nullptr) fclose(fp_buffer);
+		if (fp_tweet_id != nullptr) fclose(fp_tweet_id);
+		delete[] shard_buffer_path;
+		delete[] shard_tweet_id_path;
+		delete[] shard_tweet_index_path;
+		if (!found) return false;
+	}
+	return true;
+}
+
+// a weighted tweet is followed by its weight, and its ids are those of the identical tweets it stands for
+static void append_tweet(buffer_shard &shard, utility::write_buffer &tweet_id_buffer, int user_id, const char *data, size_t size, const long long *tweet_ids, int weight, bool weighted, long long text_offset)
+{
+	long long tweet_id = tweet_ids[0];
+	std::vector<tweet_index_item> &index_items = shard.index_items;
+	if (user_id != shard.prev_user_id)
+	{
+		// start a new index block at user boundary once the current block is full
+		if (index_items.empty() || shard.tweet_count - index_items.back().tweet >= tweet_index::block_size)
+		{
+			if (!index_items.empty()) index_items.back().tweet_count = (int)(shard.tweet_count - index_items.back().tweet);
+			tweet_index_item index_item;
+			index_item.tweet = shard.tweet_count;
+			index_item.tweet_id = tweet_id;
+			index_item.user_record = shard.user_record_count;
+			index_item.tweet_offset = shard.buffer_size;
+			index_item.tweet_id_offset = shard.tweet_id_size;
+			index_item.text_offset = text_offset;
+			index_item.user = user_id;
+			index_item.tweet_count = 0;
+			index_items.push_back(index_item);
+		}
+		++shard.user_record_count;
+		shard.prev_user_id = user_id;
+	}
+
+	shard.buffer_writer->write(data, size);
+	shard.buffer_size += size;
+	if (weighted)
+	{
+		tweet_id_buffer.clear();
+		tweet_id_buffer.write_varint(weight);
+		shard.buffer_writer->write(tweet_id_buffer.buffer(), tweet_id_buffer.size());
+		shard.buffer_size += tweet_id_buffer.size();
+	}
+
+	tweet_id_buffer.clear();
+	if (weighted) tweet_id_buffer.write_varint(weight);
+	tweet_id_buffer.write_varint(tweet_id);
+	for (int i = 1; i < weight; ++i) tweet_id_buffer.write_varint(tweet_ids[i] - tweet_ids[i - 1]);
+	shard.tweet_id_writer->write(tweet_id_buffer.buffer(), tweet_id_buffer.size());
+	shard.tweet_id_size += tweet_id_buffer.size();
+
+	++shard.tweet_count;
+}
+
+buffer_builder::buffer_builder(size_t thread_num) : parallel(thread_num)
+{
+	_sketching = false;
+	_counting = false;
+	_provisional = false;
+	_min_user_freq = _min_word_freq = 0;
+	_line_base = 0;
+	_text_base = 0;
+	_sorter = nullptr;
+	_user_counts = new token_count_map[thread_num];
+	_word_counts = new token_count_map[thread_num];
+	_token_pools = new utility::string_pool[thread_num];
+	_hash_num = 0;
+	_top_word_num = 0;
+	_hashed_word_counts = new std::vector<int>[thread_num];
+	_bucket_votes = new std::vector<bucket_vote>[thread_num];
+	_tweet_buffers = new utility::write_buffer[thread_num];
+	_buffer_version = tweet_file_reader::format_version::varint;
+	_weighted = false;
+}
+
+buffer_builder::~buffer_builder()
+{
+	_clear_counts();
+	_clear_sketches();
+	_clear_hashed();
+	delete[] _user_counts;
+	delete[] _word_counts;
+	delete[] _token_pools;
+	delete[] _tweet_buffers;
+	delete[] _hashed_word_counts;
+	delete[] _bucket_votes;
+	delete _sorter;
+}
+
+void buffer_builder::build(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, tweet_file_reader::format_version buffer_version, int shard_num, int pass_num, size_t sketch_size, int hash_num, const char *top_word_path, size_t sort_size, bool dedup)
+{
+	// identical tweets are found among the tweets of a user, which sorting brings together
+	_weighted = dedup;
+	if (dedup && sort_size == 0) sort_size = 16 << 20;
+
+	if (hash_num > 0)
+	{
+		_build_hashed(input_path, buffer_path, user_path, word_path, word_index_path, tweet_id_path, tweet_index_path, summary_path, stopword_path, buffer_version, shard_num, hash_num, top_word_path, sort_size);
+		return;
+	}
+
+	text_file_reader reader(input_path);
+
+	// sketches take an extra pass, and are of no use when every token is kept
+	if (sketch_size > 0 && (min_user_freq > 1 || min_word_freq > 1))
+	{
+		printf("Sketching frequencies...\n");
+
+		// half of the budget for each of users and words, split among threads
+		size_t memory_size = sketch_size / 2 / _thread_num;
+		for (size_t i = 0; i < _thread_num; ++i)
+		{
+			_user_sketches.push_back(new count_sketch(memory_size));
+			_word_sketches.push_back(new count_sketch(memory_size));
+		}
+
+		_sketching = true;
+		while (_read_batch(reader)) parallel::_update();
+		_sketching = false;
+		reader.reset();
+
+		for (size_t i = 1; i < _thread_num; ++i)
+		{
+			_user_sketches[0]->merge(*_user_sketches[i]);
+			_word_sketches[0]->merge(*_word_sketches[i]);
+		}
+		_min_user_freq = min_user_freq;
+		_min_word_freq = min_word_freq;
+	}
+
+	printf("Building mappings...\n");
+
+	// in a single pass, lines are kept with provisional ids and remapped once the mappings are final
+	char *provisional_path = nullptr;
+	file_writer *provisional_writer = nullptr;
+	if (pass_num == 1)
+	{
+		provisional_path = new char[strlen(buffer_path) + 32];
+		sprintf(provisional_path, "%s.provisional.bin", buffer_path);
+		provisional_writer = new file_writer(provisional_path);
+	}
+
+	_counting = true;
+	_provisional = (provisional_writer != nullptr);
+	_line_base = 0;
+	while (_read_batch(reader))
+	{
+		parallel::_update();
+		_line_base += _line_ptrs.size();
+		if (provisional_writer != nullptr)
+		{
+			for (size_t id = 0; id < _thread_num; ++id) provisional_writer->write(_tweet_buffers[id].buffer(), _tweet_buffers[id].size());
+		}
+	}
+	if (provisional_writer != nullptr)
+	{
+		delete provisional_writer;
+		reader.close();
+	}
+
+	_clear_sketches();
+
+	std::vector<char *> users, words;
+	std::vector<int> user_counts, word_counts;
+	bool users_contiguous;
+	_merge_counts(_user_counts, users, user_counts, &users_contiguous);
+	_merge_counts(_word_counts, words, word_counts);
+
+	// a user has one parameter record per run of its tweets, so users split into several runs are grouped by sorting
+	if (!users_contiguous && sort_size == 0)
+	{
+		printf("Tweets of a user are not contiguous, sorting tweets by user\n");
+		sort_size = 16 << 20;
+	}
+
+	// words are inserted in order of first occurrence, the same as counting in one pass
+	token_id_map &user_ids = _user_ids, &word_ids = _word_ids;
+	for (size_t i = 0; i < words.size(); ++i) word_ids.insert(std::make_pair(words[i], i));
+
+	std::vector<int> user_indexes;
+	for (size_t i = 0; i < users.size(); ++i) user_indexes.push_back((int)i);
+	std::sort(user_indexes.begin(), user_indexes.end(), utility::index_comparer<std::vector<int>>(user_counts, true));
+	user_ids.clear();
+	std::vector<const char*> user_list, word_list;
+	FILE *fp_user = fopen(user_path, "w");
+	for (size_t i = 0; i < user_indexes.size(); ++i)
+	{
+		size_t j = user_indexes[i];
+		if (user_counts[j] < min_user_freq) break;
+		user_ids.insert(std::make_pair(users[j], i));
+		user_list.push_back(users[j]);
+		fprintf(fp_user, "%s\t%d\n", users[j], user_counts[j]);
+	}
+	fclose(fp_user);
+	_user_index.build(user_list);
+
+	printf("%d users\n", (int)user_ids.size());
+
+	if (stopword_path != nullptr)
+	{
+		text_file_reader stopword_reader(stopword_path);
+		while (true)
+		{
+			file_item item = stopword_reader.get_item(false);
+			if (item.size == 0) break;
+			auto word_itor = word_ids.find(item.data);
+			if (word_itor != word_ids.end()) word_ids.erase(word_itor);
+		}
+	}
+
+	std::vector<int> word_indexes;
+	for (auto word_itor : word_ids) word_indexes.push_back((int)word_itor.second);
+	std::sort(word_indexes.begin(), word_indexes.end(), utility::index_comparer<std::vector<int>>(word_counts, true));
+	word_ids.clear();
+	FILE *fp_word = fopen(word_path, "w");
+	for (size_t i = 0; i < word_indexes.size(); ++i)
+	{
+		size_t j = word_indexes[i];
+		if (word_counts[j] < min_word_freq) break;
+		word_ids.insert(std::make_pair(words[j], i));
+		word_list.push_back(words[j]);
+		fprintf(fp_word, "%s\t%d\n", words[j], word_counts[j]);
+	}
+	fclose(fp_word);
+	_word_index.build(word_list);
+	_word_index.save(word_index_path);
+
+	printf("%d words\n", (int)word_ids.size());
+	printf("Building buffer...\n");
+
+	// users are dealt to shards round robin in order of frequency, so shards get similar loads
+	std::vector<buffer_shard> shards;
+	open_shards(shards, buffer_path, tweet_id_path, shard_num, buffer_version, _weighted);
+	_begin_sort(buffer_path, sort_size);
+
+	_counting = false;
+	_provisional = false;
+	_buffer_version = buffer_version;
+
+	long long valid_tweet_count = 0, total_tweet_count = 0;
+	utility::write_buffer tweet_id_buffer;
+	if (provisional_path != nullptr)
+	{
+		std::vector<int> *user_maps = new std::vector<int>[_thread_num];
+		std::vector<int> *word_maps = new std::vector<int>[_thread_num];
+		_map_provisional_ids(_user_counts, user_ids, user_maps);
+		_map_provisional_ids(_word_counts, word_ids, word_maps);
+
+		provisional_file_reader provisional_reader(provisional_path);
+		utility::write_buffer tweet_buffer;
+		std::vector<int> word_buffer;
+		long long text_offset = 0;
+		while (true)
+		{
+			file_item item = provisional_reader.get_item(false);
+			if (item.size == 0) break;
+			utility::read_buffer buffer(item.data, item.size);
+			int thread = 0, line_size = 0, user = 0, count = 0;
+			bool is_valid = buffer.read_varint(&thread) != 0 && buffer.read_varint(&line_size) != 0 && buffer.read_varint(&user) != 0 && buffer.read_varint(&count) != 0;
+			is_valid = is_valid && thread >= 0 && (size_t)thread < _thread_num && user >= 0 && (size_t)user < user_maps[thread].size();
+
+			word_buffer.clear();
+			for (int i = 0; is_valid && i < count; ++i)
+			{
+				int word = 0;
+				is_valid = buffer.read_varint(&word) != 0 && word >= 0 && (size_t)word < word_maps[thread].size();
+				if (!is_valid) break;
+				int word_id = word_maps[thread][word];
+				if (word_id >= 0) word_buffer.push_back(word_id);
+			}
+			if (!is_valid)
+			{
+				printf("Corrupt provisional file %s\n", provisional_path);
+				break;
+			}
+
+			long long line_offset = text_offset;
+			text_offset += line_size;
+			++total_tweet_count;
+			int user_id = user_maps[thread][user];
+			if (user_id < 0 || word_buffer.empty()) continue;
+
+			tweet_buffer.clear();
+			size_t size = tweet_file_reader::write_tweet(tweet_buffer, buffer_version, user_id, word_buffer);
+			_add_tweet(shards, tweet_id_buffer, user_id, tweet_buffer.buffer(), size, total_tweet_count - 1, line_offset);
+			++valid_tweet_count;
+		}
+		provisional_reader.close();
+		remove(provisional_path);
+
+		delete[] user_maps;
+		delete[] word_maps;
+		delete[] provisional_path;
+	}
+	else
+	{
+		reader.reset();
+		while (_read_batch(reader))
+		{
+			_tweet_users.resize(_line_ptrs.size());
+			_tweet_sizes.resize(_line_ptrs.size());
+			parallel::_update();
+			_append_batch(shards, tweet_id_buffer, &valid_tweet_count, &total_tweet_count);
+		}
+	}
+
+	_end_sort(shards, tweet_id_buffer);
+	close_shards(shards, tweet_index_path, shard_num);
+
+	printf("%lld / %lld tweets\n", valid_tweet_count, total_tweet_count);
+
+	// the end sentinel of the last batch read is the size of the text
+	save_summary(summary_path, (int)word_ids.size(), (int)user_ids.size(), valid_tweet_count, total_tweet_count, _text_offsets.back(), text_file_reader::fingerprint(input_path), shard_num, 0, sort_size > 0);
+
+	// merged tokens are owned by the thread pools
+	user_ids.clear();
+	word_ids.clear();
+	_user_index.clear();
+	_word_index.clear();
+	_clear_counts();
+}
+
+int buffer_builder::append(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, bool extend, std::vector<buffer_extent> &extents)
+{
+	buffer_summary summary;
+	if (!load_summary(summary_path, summary))
+	{
+		printf("Buffer summary %s not found\n", summary_path);
+		return -1;
+	}
+	if (summary.text_size < 0)
+	{
+		printf("Buffer summary has no text size, rebuild the buffer to append to it\n");
+		return -1;
+	}
+
+	std::vector<char*> users, words;
+	std::vector<int> user_counts, word_counts;
+	if (!load_counts(user_path, _hashed_tokens, users, user_counts) || !load_counts(word_path, _hashed_tokens, words, word_counts) || (int)users.size() != summary.user_num || (int)words.size() != summary.word_num)
+	{
+		printf("User or word file not match buffer summary\n");
+		_clear_hashed();
+		return -1;
+	}
+
+	// bucket lines of hashed mode follow the exact words, their ids are fixed
+	_hash_num = summary.hash_num;
+	_top_word_num = summary.word_num - summary.hash_num;
+	for (size_t i = 0; i < users.size(); ++i) _user_ids.insert(std::make_pair(users[i], i));
+	for (int i = 0; i < _top_word_num; ++i) _word_ids.insert(std::make_pair(words[i], i));
+	_load_stopwords(stopword_path);
+
+	text_file_reader reader(input_path);
+	if (_hash_num == 0)
+	{
+		printf("Counting appended text...\n");
+
+		_counting = true;
+		_line_base = 0;
+		while (_read_batch(reader))
+		{
+			parallel::_update();
+			_line_base += _line_ptrs.size();
+		}
+		_counting = false;
+		reader.reset();
+
+		std::vector<char*> new_users, new_words;
+		std::vector<int> new_user_counts, new_word_counts;
+		_merge_counts(_user_counts, new_users, new_user_counts);
+		_merge_counts(_word_counts, new_words, new_word_counts);
+		_add_counts(_user_ids, new_users, new_user_counts, extend, min_user_freq, nullptr, users, user_counts);
+		_add_counts(_word_ids, new_words, new_word_counts, extend, min_word_freq, &_stopwords, words, word_counts);
+	}
+	else
+	{
+		int word_num = _top_word_num + _hash_num;
+		for (size_t i = 0; i < _thread_num; ++i)
+		{
+			_hashed_word_counts[i].assign(word_num, 0);
+			bucket_vote vote = { nullptr, 0 };
+			_bucket_votes[i].assign(_hash_num, vote);
+		}
+	}
+
+	std::vector<const char*> user_list(users.begin(), users.end());
+	std::vector<const char*> word_list(words.begin(), words.begin() + (words.size() - _hash_num));
+	_user_index.build(user_list);
+	_word_index.build(word_list);
+	_word_index.save(word_index_path);
+
+	printf("Appending to buffer...\n");
+
+	std::vector<buffer_shard> shards;
+	if (!reopen_shards(shards, extents, buffer_path, tweet_id_path, tweet_index_path, summary.shard_num, &_buffer_version, &_weighted))
+	{
+		for (size_t i = 0; i < shards.size(); ++i)
+		{
+			delete shards[i].buffer_writer;
+			delete shards[i].tweet_id_writer;
+		}
+		_user_ids.clear();
+		_word_ids.clear();
+		_user_index.clear();
+		_word_index.clear();
+		_clear_counts();
+		_clear_hashed();
+		return -1;
+	}
+
+	// line numbers and text offsets continue after the text the buffer was built from
+	_text_base = summary.text_size;
+	long long valid_tweet_count = summary.valid_tweet_num, total_tweet_count = summary.total_tweet_num;
+	utility::write_buffer tweet_id_buffer;
+	while (_read_batch(reader))
+	{
+		_tweet_users.resize(_line_ptrs.size());
+		_tweet_sizes.resize(_line_ptrs.size());
+		if (_hash_num > 0) _number_users(users, user_counts, extend);
+		parallel::_update();
+		_append_batch(shards, tweet_id_buffer, &valid_tweet_count, &total_tweet_count);
+	}
+	_text_base = 0;
+
+	close_shards(shards, tweet_index_path, summary.shard_num);
+
+	if (_hash_num > 0)
+	{
+		for (size_t i = 0; i < _thread_num; ++i)
+		{
+			for (size_t j = 0; j < words.size(); ++j) word_counts[j] += _hashed_word_counts[i][j];
+		}
+	}
+	save_counts(user_path, users, user_counts);
+	save_counts(word_path, words, word_counts);
+
+	printf("%d users, %d new\n", (int)users.size(), (int)users.size() - summary.user_num);
+	printf("%d words, %d new\n", (int)words.size(), (int)words.size() - summary.word_num);
+	printf("%lld / %lld tweets appended\n", valid_tweet_count - summary.valid_tweet_num, total_tweet_count - summary.total_tweet_num);
+
+	save_summary(summary_path, (int)words.size(), (int)users.size(), valid_tweet_count, total_tweet_count, _text_offsets.back(), summary.text_hash, summary.shard_num, summary.hash_num, summary.sorted);
+
+	int word_num = (int)words.size();
+	_user_ids.clear();
+	_word_ids.clear();
+	_user_index.clear();
+	_word_index.clear();
+	_clear_counts();
+	_clear_hashed();
+	return word_num;
+}
+
+void buffer_builder::_build_hashed(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, tweet_file_reader::format_version buffer_version, int shard_num, int hash_num, const char *top_word_path, size_t sort_size)
+{
+	printf("Building hashed buffer...\n");
+
+	// exact top words take the first ids, an earlier word file can be given as is
+	if (top_word_path != nullptr)
+	{
+		text_file_reader top_word_reader(top_word_path);
+		while (true)
+		{
+			file_item item = top_word_reader.get_item(false);
+			if (item.size == 0) break;
+			char *ptr = strchr(item.data, '\t');
+			if (ptr != nullptr) *ptr = '\0';
+			if (item.data[0] == '\0' || _word_ids.find(item.data) != _word_ids.end()) continue;
+			char *word = _hashed_tokens.add(item.data);
+			_word_ids.insert(std::make_pair(word, _word_ids.size()));
+		}
+	}
+	_load_stopwords(stopword_path);
+
+	std::vector<const char*> word_list(_word_ids.size(), nullptr);
+	for (auto word_itor : _word_ids) word_list[word_itor.second] = word_itor.first;
+	_word_index.build(word_list);
+	_word_index.save(word_index_path);
+
+	_hash_num = hash_num;
+	_top_word_num = (int)_word_ids.size();
+	int word_num = _top_word_num + hash_num;
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		_hashed_word_counts[i].assign(word_num, 0);
+		bucket_vote vote = { nullptr, 0 };
+		_bucket_votes[i].assign(hash_num, vote);
+	}
+
+	std::vector<buffer_shard> shards;
+	open_shards(shards, buffer_path, tweet_id_path, shard_num, buffer_version, _weighted);
+	_begin_sort(buffer_path, sort_size);
+
+	// users can not be ranked without a counting pass, they are numbered in order of first occurrence
+	text_file_reader reader(input_path);
+	_buffer_version = buffer_version;
+	std::vector<char*> users;
+	std::vector<int> user_counts;
+	long long valid_tweet_count = 0, total_tweet_count = 0;
+	utility::write_buffer tweet_id_buffer;
+	while (_read_batch(reader))
+	{
+		_tweet_users.resize(_line_ptrs.size());
+		_tweet_sizes.resize(_line_ptrs.size());
+		_number_users(users, user_counts, true);
+		parallel::_update();
+		_append_batch(shards, tweet_id_buffer, &valid_tweet_count, &total_tweet_count);
+	}
+
+	_end_sort(shards, tweet_id_buffer);
+
+	// users are numbered as they come in a single pass, so split users are only found once the tweets are written
+	long long user_record_count = 0;
+	for (size_t i = 0; i < shards.size(); ++i) user_record_count += shards[i].user_record_count;
+	if (sort_size == 0 && user_record_count > (long long)users.size()) printf("Tweets of a user are not contiguous, each run of them is modeled as a separate user, build with --sort to group them\n");
+	close_shards(shards, tweet_index_path, shard_num);
+
+	FILE *fp_user = fopen(user_path, "w");
+	for (size_t i = 0; i < users.size(); ++i) fprintf(fp_user, "%s\t%d\n", users[i], user_counts[i]);
+	fclose(fp_user);
+
+	// buckets are labeled by the token that won most votes among threads
+	std::vector<int> word_counts(word_num, 0);
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		for (int j = 0; j < word_num; ++j) word_counts[j] += _hashed_word_counts[i][j];
+	}
+	FILE *fp_word = fopen(word_path, "w");
+	for (int i = 0; i < _top_word_num; ++i) fprintf(fp_word, "%s\t%d\n", _word_index.word(i), word_counts[i]);
+	for (int i = 0; i < hash_num; ++i)
+	{
+		const bucket_vote *best = nullptr;
+		for (size_t j = 0; j < _thread_num; ++j)
+		{
+			const bucket_vote &vote = _bucket_votes[j][i];
+			if (vote.token != nullptr && (best == nullptr || vote.votes > best->votes)) best = &vote;
+		}
+		if (best != nullptr) fprintf(fp_word, "#%d:%s\t%d\n", i, best->token, word_counts[_top_word_num + i]);
+		else fprintf(fp_word, "#%d\t%d\n", i, word_counts[_top_word_num + i]);
+	}
+	fclose(fp_word);
+
+	printf("%d users\n", (int)users.size());
+	printf("%d exact words, %d hashed words\n", _top_word_num, hash_num);
+	printf("%lld / %lld tweets\n", valid_tweet_count, total_tweet_count);
+
+	save_summary(summary_path, word_num, (int)users.size(), valid_tweet_count, total_tweet_count, _text_offsets.back(), text_file_reader::fingerprint(input_path), shard_num, hash_num, sort_size > 0);
+
+	_user_ids.clear();
+	_word_ids.clear();
+	_word_index.clear();
+	_clear_hashed();
+}
+
+void buffer_builder::_load_stopwords(const char *stopword_path)
+{
+	if (stopword_path == nullptr) return;
+	text_file_reader stopword_reader(stopword_path);
+	while (true)
+	{
+		file_item item = stopword_reader.get_item(false);
+		if (item.size == 0) break;
+		if (_stopwords.find(item.data) != _stopwords.end()) continue;
+		char *word = _hashed_tokens.add(item.data);
+		_stopwords.insert(std::make_pair(word, 0));
+	}
+}
+
+void buffer_builder::_number_users(std::vector<char*> &users, std::vector<int> &user_counts, bool extend)
+{
+	// new users get the next ids, or their lines are dropped when the users are fixed
+	std::vector<char> key;
+	for (size_t i = 0; i < _line_ptrs.size(); ++i)
+	{
+		const char *user_str;
+		size_t user_size;
+		split_user(_line_ptrs[i], _line_sizes[i], &user_str, &user_size);
+		auto user_iterator = _user_ids.find(make_key(key, user_str, user_size));
+		if (user_iterator == _user_ids.end() && extend)
+		{
+			char *user = _hashed_tokens.add(key.data());
+			users.push_back(user);
+			user_counts.push_back(0);
+			user_iterator = _user_ids.insert(std::make_pair(user, _user_ids.size())).first;
+		}
+		_tweet_users[i] = (user_iterator != _user_ids.end()) ? (int)user_iterator->second : -1;
+		if (_tweet_users[i] >= 0) ++user_counts[_tweet_users[i]];
+	}
+}
+
+void buffer_builder::_append_batch(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer, long long *valid_tweet_count, long long *total_tweet_count)
+{
+	// append encoded tweets in line order
+	for (size_t id = 0; id < _thread_num; ++id)
+	{
+		size_t start = id * _line_ptrs.size() / _thread_num;
+		size_t end = (id + 1) * _line_ptrs.size() / _thread_num;
+		const char *tweet_data = _tweet_buffers[id].buffer();
+		for (size_t i = start; i < end; ++i)
+		{
+			++*total_tweet_count;
+			int user_id = _tweet_users[i];
+			if (user_id < 0) continue;
+
+			_add_tweet(shards, tweet_id_buffer, user_id, tweet_data, _tweet_sizes[i], *total_tweet_count - 1, _text_offsets[i]);
+			tweet_data += _tweet_sizes[i];
+			++*valid_tweet_count;
+		}
+	}
+}
+
+void buffer_builder::_add_counts(token_id_map &ids, const std::vector<char*> &new_tokens, const std::vector<int> &new_counts, bool extend, int min_freq, const token_id_map *excluded, std::vector<char*> &tokens, std::vector<int> &counts)
+{
+	// known tokens keep their ids, new ones reaching the threshold take the next ids in order of frequency
+	std::vector<int> indexes;
+	for (size_t i = 0; i < new_tokens.size(); ++i)
+	{
+		auto itor = ids.find(new_tokens[i]);
+		if (itor != ids.end())
+		{
+			counts[itor->second] += new_counts[i];
+		}
+		else if (extend && new_counts[i] >= min_freq && (excluded == nullptr || excluded->find(new_tokens[i]) == excluded->end()))
+		{
+			indexes.push_back((int)i);
+		}
+	}
+	std::sort(indexes.begin(), indexes.end(), utility::index_comparer<const std::vector<int>>(new_counts, true));
+	for (size_t i = 0; i < indexes.size(); ++i)
+	{
+		char *token = new_tokens[indexes[i]];
+		ids.insert(std::make_pair(token, tokens.size()));
+		tokens.push_back(token);
+		counts.push_back(new_counts[indexes[i]]);
+	}
+}
+
+void buffer_builder::_add_tweet(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer, int user_id, const char *data, size_t size, long long tweet_id, long long text_offset)
+{
+	if (_sorter == nullptr)
+	{
+		append_tweet(shards[user_id % shards.size()], tweet_id_buffer, user_id, data, size, &tweet_id, 1, _weighted, text_offset);
+		return;
+	}
+
+	// tweets of a user stay in line order, as tweet ids break ties
+	_sort_buffer.clear();
+	_sort_buffer.write_varint(text_offset);
+	_sort_buffer.write_bytes(data, size);
+	_sorter->add(user_id, tweet_id, _sort_buffer.buffer(), _sort_buffer.size());
+}
+
+void buffer_builder::_begin_sort(const char *buffer_path, size_t sort_size)
+{
+	if (sort_size == 0) return;
+	char *temp_path = new char[strlen(buffer_path) + 32];
+	sprintf(temp_path, "%s.sort", buffer_path);
+	_sorter = new external_sorter(temp_path, sort_size);
+	delete[] temp_path;
+}
+
+void buffer_builder::_end_sort(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer)
+{
+	if (_sorter == nullptr) return;
+
+	printf("Writing buffer sorted by user...\n");
+	long long user_id, tweet_id, prev_user_id = -1, unique_count = 0;
+	file_item item;
+	while (true)
+	{
+		bool more = _sorter->next(&user_id, &tweet_id, &item);
+		if (_weighted && (!more || user_id != prev_user_id))
+		{
+			// tweets of the previous user are complete, each distinct one is written once with the ids of its copies
+			for (size_t i = 0; i < _unique_tweets.size(); ++i)
+			{
+				const unique_tweet &tweet = _unique_tweets[i];
+				append_tweet(shards[prev_user_id % shards.size()], tweet_id_buffer, (int)prev_user_id, _unique_data.buffer() + tweet.offset, tweet.size, tweet.tweet_ids.data(), (int)tweet.tweet_ids.size(), true, tweet.text_offset);
+			}
+			unique_count += _unique_tweets.size();
+			_unique_tweets.clear();
+			_unique_data.clear();
+			_fingerprints.clear();
+			prev_user_id = user_id;
+		}
+		if (!more) break;
+
+		utility::read_buffer buffer(item.data, item.size);
+		long long text_offset = 0;
+		buffer.read_varint(&text_offset);
+		const char *data = item.data + buffer.offset();
+		size_t size = item.size - buffer.offset();
+		if (!_weighted)
+		{
+			append_tweet(shards[user_id % shards.size()], tweet_id_buffer, (int)user_id, data, size, &tweet_id, 1, false, text_offset);
+			continue;
+		}
+
+		// encoded tweets of the same user are identical when their words are, fingerprints are confirmed by comparing bytes
+		unsigned long long fingerprint = utility::hash_bytes(data, size);
+		auto range = _fingerprints.equal_range(fingerprint);
+		auto fingerprint_itor = range.first;
+		for (; fingerprint_itor != range.second; ++fingerprint_itor)
+		{
+			const unique_tweet &tweet = _unique_tweets[fingerprint_itor->second];
+			if (tweet.size == size && memcmp(_unique_data.buffer() + tweet.offset, data, size) == 0) break;
+		}
+		if (fingerprint_itor != range.second)
+		{
+			_unique_tweets[fingerprint_itor->second].tweet_ids.push_back(tweet_id);
+			continue;
+		}
+		_fingerprints.insert(std::make_pair(fingerprint, _unique_tweets.size()));
+		_unique_tweets.push_back(unique_tweet());
+		unique_tweet &tweet = _unique_tweets.back();
+		tweet.offset = _unique_data.size();
+		tweet.size = size;
+		tweet.text_offset = text_offset;
+		tweet.tweet_ids.push_back(tweet_id);
+		_unique_data.write_bytes(data, size);
+	}
+	if (_weighted) printf("%lld distinct tweets\n", unique_count);
+	delete _sorter;
+	_sorter = nullptr;
+}
+
+void buffer_builder::_clear_hashed()
+{
+	_hashed_tokens.clear();
+	_stopwords.clear();
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		for (size_t j = 0; j < _bucket_votes[i].size(); ++j) delete[] _bucket_votes[i][j].token;
+		_bucket_votes[i].clear();
+		_hashed_word_counts[i].clear();
+	}
+	_hash_num = 0;
+	_top_word_num = 0;
+}
+
+void buffer_builder::_vote(bucket_vote &vote, char *token)
+{
+	// majority vote, the majority token of the bucket always wins
+	if (vote.token != nullptr && strcmp(vote.token, token) == 0)
+	{
+		++vote.votes;
+	}
+	else if (vote.votes == 0)
+	{
+		delete[] vote.token;
+		vote.token = utility::new_string(token);
+		vote.votes = 1;
+	}
+	else
+	{
+		--vote.votes;
+	}
+}
+
+bool buffer_builder::_first_less(const std::pair<char*, token_count> &a, const std::pair<char*, token_count> &b)
+{
+	if (a.second.first_line != b.second.first_line) return a.second.first_line < b.second.first_line;
+	return a.second.first_token < b.second.first_token;
+}
+
+bool buffer_builder::_read_batch(text_file_reader &reader)
+{
+	_line_ptrs.clear();
+	_line_sizes.clear();
+	_text_offsets.clear();
+	reader.trim();
+	while (true)
+	{
+		long long text_offset = reader.position();
+		file_item item = reader.get_item(!_line_ptrs.empty());
+		if (item.size == 0) break;
+		_line_ptrs.push_back(item.data);
+		_line_sizes.push_back(item.size);
+		_text_offsets.push_back(_text_base + text_offset);
+	}
+	_text_offsets.push_back(_text_base + reader.position()); // end of the last line
+	return !_line_ptrs.empty();
+}
+
+void buffer_builder::_merge_counts(token_count_map *counts, std::vector<char*> &tokens, std::vector<int> &token_counts, bool *contiguous)
+{
+	token_count_map merged;
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		for (auto itor : counts[i])
+		{
+			auto merged_itor = merged.find(itor.first);
+			if (merged_itor == merged.end())
+			{
+				merged.insert(itor);
+				continue;
+			}
+			token_count &count = merged_itor->second;
+			count.count += itor.second.count;
+			count.last_line = std::max(count.last_line, itor.second.last_line);
+			if (_first_less(itor, *merged_itor))
+			{
+				count.first_line = itor.second.first_line;
+				count.first_token = itor.second.first_token;
+			}
+		}
+	}
+
+	// number tokens in order of first occurrence, independent of thread count
+	std::vector<std::pair<char*, token_count>> items(merged.begin(), merged.end());
+	std::sort(items.begin(), items.end(), _first_less);
+	tokens.clear();
+	token_counts.clear();
+	if (contiguous != nullptr) *contiguous = true;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		tokens.push_back(items[i].first);
+		token_counts.push_back(items[i].second.count);
+		if (contiguous != nullptr && items[i].second.last_line - items[i].second.first_line + 1 != items[i].second.count) *contiguous = false;
+	}
+}
+
+void buffer_builder::_map_provisional_ids(token_count_map *counts, token_id_map &ids, std::vector<int> *maps)
+{
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		maps[i].assign(counts[i].size() + 1, -1);
+		for (auto itor : counts[i])
+		{
+			auto id_itor = ids.find(itor.first);
+			if (id_itor != ids.end()) maps[i][itor.second.id] = (int)id_itor->second;
+		}
+	}
+}
+
+void buffer_builder::_clear_counts()
+{
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		_user_counts[i].clear();
+		_word_counts[i].clear();
+		_token_pools[i].clear();
+	}
+}
+
+void buffer_builder::_clear_sketches()
+{
+	for (size_t i = 0; i < _user_sketches.size(); ++i) delete _user_sketches[i];
+	for (size_t i = 0; i < _word_sketches.size(); ++i) delete _word_sketches[i];
+	_user_sketches.clear();
+	_word_sketches.clear();
+}
+
+void buffer_builder::_update(size_t id)
+{
+	size_t start = id * _line_ptrs.size() / _thread_num;
+	size_t end = (id + 1) * _line_ptrs.size() / _thread_num;
+	if (_sketching)
+	{
+		_sketch(start, end, *_user_sketches[id], *_word_sketches[id]);
+	}
+	else if (_counting)
+	{
+		_tweet_buffers[id].clear();
+		_count(id, start, end, _user_counts[id], _word_counts[id]);
+	}
+	else
+	{
+		_tweet_buffers[id].clear();
+		_encode(id, start, end, _tweet_buffers[id]);
+	}
+}
+
+void buffer_builder::_sketch(size_t start, size_t end, count_sketch &user_sketch, count_sketch &word_sketch)
+{
+	utility::tokenizer tokenizer;
+	for (size_t i = start; i < end; ++i)
+	{
+		const char *user_str, *token;
+		size_t user_size, size;
+		const char *text = split_user(_line_ptrs[i], _line_sizes[i], &user_str, &user_size);
+		user_sketch.add(user_str, user_size);
+		tokenizer.reset(text, _line_ptrs[i] + _line_sizes[i] - text);
+		while (tokenizer.next(&token, &size)) word_sketch.add(token, size);
+	}
+}
+
+void buffer_builder::_count(size_t id, size_t start, size_t end, token_count_map &user_counts, token_count_map &word_counts)
+{
+	std::vector<int> word_buffer;
+	std::vector<char> key;
+	utility::tokenizer tokenizer;
+	for (size_t i = start; i < end; ++i)
+	{
+		long long line = _line_base + (long long)i;
+		const char *user_str, *token;
+		size_t user_size, size;
+		const char *text = split_user(_line_ptrs[i], _line_sizes[i], &user_str, &user_size);
+
+		// lines of a thread are in increasing order, so the first insertion is the first occurrence
+		// tokens the sketch rules out can never reach the thresholds, they are not counted at all
+		int user = 0;
+		if (_user_sketches.empty() || _user_sketches[0]->estimate(user_str, user_size) >= _min_user_freq)
+		{
+			auto user_iterator = user_counts.find(make_key(key, user_str, user_size));
+			if (user_iterator == user_counts.end())
+			{
+				token_count count = { (int)user_counts.size() + 1, 1, line, 0, line };
+				user_iterator = user_counts.insert(std::make_pair(_token_pools[id].add(key.data()), count)).first;
+			}
+			else
+			{
+				++user_iterator->second.count;
+				user_iterator->second.last_line = line;
+			}
+			user = user_iterator->second.id;
+		}
+
+		word_buffer.clear();
+		int position = 0;
+		tokenizer.reset(text, _line_ptrs[i] + _line_sizes[i] - text);
+		while (tokenizer.next(&token, &size))
+		{
+			if (_word_sketches.empty() || _word_sketches[0]->estimate(token, size) >= _min_word_freq)
+			{
+				auto word_iterator = word_counts.find(make_key(key, token, size));
+				if (word_iterator == word_counts.end())
+				{
+					token_count count = { (int)word_counts.size() + 1, 1, line, position, line };
+					word_iterator = word_counts.insert(std::make_pair(_token_pools[id].add(key.data()), count)).first;
+				}
+				else
+				{
+					++word_iterator->second.count;
+					word_iterator->second.last_line = line;
+				}
+				if (_provisional) word_buffer.push_back(word_iterator->second.id);
+			}
+			++position;
+		}
+
+		if (_provisional)
+		{
+			_tweet_buffers[id].write_varint((int)id);
+			_tweet_buffers[id].write_varint((int)(_text_offsets[i + 1] - _text_offsets[i]));
+			tweet_file_reader::write_tweet(_tweet_buffers[id], tweet_file_reader::format_version::varint, user, word_buffer);
+		}
+	}
+}
+
+void buffer_builder::_encode(size_t id, size_t start, size_t end, utility::write_buffer &tweet_buffer)
+{
+	std::vector<int> word_buffer;
+	std::vector<char> key;
+	utility::tokenizer tokenizer;
+	for (size_t i = start; i < end; ++i)
+	{
+		int user_id = _tweet_users[i]; // numbered by the main thread in hashed mode
+		_tweet_users[i] = -1;
+		const char *user_str, *token;
+		size_t user_size, size;
+		const char *text = split_user(_line_ptrs[i], _line_sizes[i], &user_str, &user_size);
+		if (_hash_num == 0) user_id = _user_index.find(user_str, user_size);
+		if (user_id < 0) continue;
+
+		word_buffer.clear();
+		tokenizer.reset(text, _line_ptrs[i] + _line_sizes[i] - text);
+		while (tokenizer.next(&token, &size))
+		{
+			int word = _word_index.find(token, size);
+			if (word >= 0)
+			{
+				word_buffer.push_back(word);
+				if (_hash_num > 0) ++_hashed_word_counts[id][word];
+			}
+			else if (_hash_num > 0 && _stopwords.find(make_key(key, token, size)) == _stopwords.end())
+			{
+				int bucket = (int)(utility::hash_bytes(token, size) % (unsigned long long)_hash_num);
+				word_buffer.push_back(_top_word_num + bucket);
+				++_hashed_word_counts[id][_top_word_num + bucket];
+				_vote(_bucket_votes[id][bucket], key.data());
+			}
+		}
+
+		if (word_buffer.empty()) continue;
+
+		_tweet_users[i] = user_id;
+		_tweet_sizes[i] = (int)tweet_file_reader::write_tweet(tweet_buffer, _buffer_version, user_id, word_buffer);
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "file_reader.h"
+#include "count_sketch.h"
+#include "external_sorter.h"
+#include "vocab_index.h"
+#include "parallel.h"
+#include "tweet_index.h"
+#include "utility.h"
+
+struct buffer_shard;
+
+// Converts text corpus to tweet buffer, tokenizing and encoding batches of lines with worker threads
+class buffer_builder : public parallel
+{
+public:
+	buffer_builder(size_t thread_num);
+	~buffer_builder();
+
+	void build(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, tweet_file_reader::format_version buffer_version, int shard_num, int pass_num = 2, size_t sketch_size = 0, int hash_num = 0, const char *top_word_path = nullptr, size_t sort_size = 0, bool dedup = false);
+
+	// encodes text following the text of an existing buffer, returns the new number of words or -1 on error
+	int append(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, bool extend, std::vector<buffer_extent> &extents);
+
+private:
+	struct token_count
+	{
+		int id; // provisional id, local to the thread, 0 for dropped tokens
+		int count;
+		long long first_line; // line of first occurrence
+		int first_token; // position in the line of first occurrence
+		long long last_line; // line of last occurrence
+	};
+
+	typedef std::unordered_map<char*, token_count, utility::string_hasher, utility::string_predicate> token_count_map;
+	typedef std::unordered_map<char*, size_t, utility::string_hasher, utility::string_predicate> token_id_map;
+
+	struct bucket_vote
+	{
+		char *token;
+		int votes;
+	};
+
+	struct unique_tweet
+	{
+		size_t offset; // of the encoded tweet in the data of the user
+		size_t size;
+		long long text_offset;
+		std::vector<long long> tweet_ids; // of the identical tweets, in line order
+	};
+
+	bool _sketching;
+	bool _counting;
+	bool _provisional;
+	long long _line_base;
+	long long _text_base; // text offset of the first line when appending
+	std::vector<char*> _line_ptrs;
+	std::vector<size_t> _line_sizes; // up to the line terminators, lines end at the first '\0'
+	std::vector<long long> _text_offsets;
+
+	// per thread sketches, merged before counting, only candidates reaching the thresholds are counted exactly
+	std::vector<count_sketch*> _user_sketches;
+	std::vector<count_sketch*> _word_sketches;
+	int _min_user_freq, _min_word_freq;
+
+	// per thread counts while building mappings, keys are owned by the thread pools
+	token_count_map *_user_counts;
+	token_count_map *_word_counts;
+	utility::string_pool *_token_pools;
+
+	// per line results while encoding, user is -1 for dropped lines
+	token_id_map _user_ids, _word_ids;
+	vocab_index _user_index, _word_index; // final ids, looked up while encoding
+	tweet_file_reader::format_version _buffer_version;
+	utility::write_buffer *_tweet_buffers; // also provisional tweets while counting in single pass
+	std::vector<int> _tweet_users;
+	std::vector<int> _tweet_sizes;
+
+	// hashed words take ids after the exact top words, per thread word counts and bucket labels
+	int _hash_num;
+	int _top_word_num;
+	token_id_map _stopwords;
+	utility::string_pool _hashed_tokens; // also loaded vocabulary when appending
+	std::vector<int> *_hashed_word_counts;
+	std::vector<bucket_vote> *_bucket_votes;
+
+	void _build_hashed(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, tweet_file_reader::format_version buffer_version, int shard_num, int hash_num, const char *top_word_path, size_t sort_size);
+	void _load_stopwords(const char *stopword_path);
+	void _number_users(std::vector<char*> &users, std::vector<int> &user_counts, bool extend);
+	void _append_batch(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer, long long *valid_tweet_count, long long *total_tweet_count);
+	void _clear_hashed();
+	static void _vote(bucket_vote &vote, char *token);
+
+	// encoded tweets are sorted by user before they are written when a sort budget is given
+	external_sorter *_sorter;
+	utility::write_buffer _sort_buffer;
+
+	// identical tweets of a user are collapsed into one weighted tweet while writing sorted tweets
+	bool _weighted;
+	std::vector<unique_tweet> _unique_tweets;
+	utility::write_buffer _unique_data;
+	std::unordered_multimap<unsigned long long, size_t> _fingerprints;
+
+	void _add_tweet(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer, int user_id, const char *data, size_t size, long long tweet_id, long long text_offset);
+	void _begin_sort(const char *buffer_path, size_t sort_size);
+	void _end_sort(std::vector<buffer_shard> &shards, utility::write_buffer &tweet_id_buffer);
+
+	bool _read_batch(text_file_reader &reader);
+	// contiguous is set false when the lines of a token are not one run, the lines between are of other tokens
+	void _merge_counts(token_count_map *counts, std::vector<char*> &tokens, std::vector<int> &token_counts, bool *contiguous = nullptr);
+	void _add_counts(token_id_map &ids, const std::vector<char*> &new_tokens, const std::vector<int> &new_counts, bool extend, int min_freq, const token_id_map *excluded, std::vector<char*> &tokens, std::vector<int> &counts);
+	void _map_provisional_ids(token_count_map *counts, token_id_map &ids, std::vector<int> *maps);
+	void _clear_counts();
+	static bool _first_less(const std::pair<char*, token_count> &a, const std::pair<char*, token_count> &b);
+
+	void _clear_sketches();
+
+	void _update(size_t id);
+	void _sketch(size_t start, size_t end, count_sketch &user_sketch, count_sketch &word_sketch);
+	void _count(size_t id, size_t start, size_t end, token_count_map &user_counts, token_count_map &word_counts);
+	void _encode(size_t id, size_t start, size_t end, utility::write_buffer &tweet_buffer);
+};
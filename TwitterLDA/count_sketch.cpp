@@ -0,0 +1,56 @@
+#include <algorithm>
+#include <cassert>
+#include "count_sketch.h"
+#include "utility.h"
+
+count_sketch::count_sketch(size_t memory_size)
+{
+	_width = std::max(memory_size / (depth * sizeof(unsigned int)), (size_t)1);
+	_counters.assign(_width * depth, 0);
+}
+
+void count_sketch::add(const char *token, size_t size)
+{
+	size_t positions[depth];
+	_positions(token, size, positions);
+	unsigned int value = _counters[positions[0]];
+	for (size_t i = 1; i < depth; ++i) value = std::min(value, _counters[positions[i]]);
+	if (value == 0xffffffffu) return;
+
+	// only the counters at the minimum can be below the true count after the update
+	++value;
+	for (size_t i = 0; i < depth; ++i)
+	{
+		if (_counters[positions[i]] < value) _counters[positions[i]] = value;
+	}
+}
+
+int count_sketch::estimate(const char *token, size_t size) const
+{
+	size_t positions[depth];
+	_positions(token, size, positions);
+	unsigned int value = _counters[positions[0]];
+	for (size_t i = 1; i < depth; ++i) value = std::min(value, _counters[positions[i]]);
+	return (int)std::min(value, 0x7fffffffu);
+}
+
+void count_sketch::merge(const count_sketch &other)
+{
+	assert(other._width == _width);
+	for (size_t i = 0; i < _counters.size(); ++i)
+	{
+		unsigned int sum = _counters[i] + other._counters[i];
+		_counters[i] = (sum < _counters[i]) ? 0xffffffffu : sum;
+	}
+}
+
+void count_sketch::_positions(const char *token, size_t size, size_t *positions) const
+{
+	// rows are derived by double hashing
+	unsigned long long hash = utility::hash_bytes(token, size);
+	unsigned long long hash1 = hash & 0xffffffffull, hash2 = (hash >> 32) | 1;
+	for (size_t i = 0; i < depth; ++i)
+	{
+		positions[i] = i * _width + (size_t)((hash1 + i * hash2) % _width);
+	}
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+
+// Count-Min sketch with conservative update, estimates never fall below true counts
+class count_sketch
+{
+public:
+	static const size_t depth = 4;
+
+	count_sketch(size_t memory_size);
+
+	void add(const char *token, size_t size);
+	int estimate(const char *token, size_t size) const;
+
+	// sketches must have the same width, the sum still never underestimates
+	void merge(const count_sketch &other);
+
+private:
+	size_t _width;
+	std::vector<unsigned int> _counters;
+
+	void _positions(const char *token, size_t size, size_t *positions) const;
+};
@@ -0,0 +1,254 @@
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include "evaluator.h"
+#include "model.h"
+#include "parallel.h"
+#include "utility.h"
+#include "file_reader.h"
+
+static const char default_user[] = "*";
+
+evaluator::evaluator(model &m, const char *word_path, const char *word_index_path, const char *user_path, size_t thread_num) : parallel(thread_num), _m(m)
+{
+	_encoding = false;
+	_folding = false;
+	_log_probs.resize(thread_num);
+	_word_counts.resize(thread_num);
+
+	// in hashed mode only the exact top words are indexed, the bucket lines after them are labels
+	_hash_num = m.hash_num();
+	_exact_word_num = m.word_num() - _hash_num;
+	if (_hash_num == 0 || _exact_word_num > 0)
+	{
+		if (word_index_path == nullptr || !_word_index.load(word_index_path)) _word_index.build(word_path, (_hash_num > 0) ? _exact_word_num : -1);
+	}
+	_user_index.build(user_path);
+	_user_slots.resize(_user_index.size(), -1);
+	_word_offsets.push_back(0);
+}
+
+evaluator::~evaluator()
+{
+}
+
+void evaluator::load(const char *input_path, size_t batch_size)
+{
+	text_file_reader reader(input_path, batch_size);
+	while (true)
+	{
+		_input_ptrs.clear();
+		_input_sizes.clear();
+		reader.trim();
+		while (true)
+		{
+			file_item item = reader.get_item(!_input_ptrs.empty());
+			if (item.size == 0) break;
+			_input_ptrs.push_back(item.data);
+			_input_sizes.push_back(item.size);
+		}
+		if (_input_ptrs.empty()) break;
+
+		_input_users.resize(_input_ptrs.size());
+		if (_input_words.size() < _input_ptrs.size()) _input_words.resize(_input_ptrs.size());
+		_encoding = true;
+		parallel::_update();
+		_encoding = false;
+
+		// slots are numbered in order of first held-out tweet, unseen users by name
+		for (size_t i = 0; i < _input_ptrs.size(); ++i)
+		{
+			const std::vector<int> &words = _input_words[i];
+			if (words.size() < 2) continue;
+
+			int user = _input_users[i];
+			int slot;
+			if (user >= 0)
+			{
+				slot = _user_slots[user];
+				if (slot < 0)
+				{
+					slot = _user_slots[user] = (int)_slot_users.size();
+					_slot_users.push_back(user);
+				}
+			}
+			else
+			{
+				char *tab = (char*)memchr(_input_ptrs[i], '\t', _input_sizes[i]);
+				char *name = (char*)default_user;
+				if (tab != nullptr)
+				{
+					*tab = '\0';
+					name = _input_ptrs[i];
+				}
+				auto slot_itor = _unseen_slots.find(name);
+				if (slot_itor == _unseen_slots.end())
+				{
+					slot_itor = _unseen_slots.insert(std::make_pair(_unseen_users.add(name), (int)_slot_users.size())).first;
+					_slot_users.push_back(-1);
+				}
+				slot = slot_itor->second;
+			}
+
+			_tweet_slots.push_back(slot);
+			_words.insert(_words.end(), words.begin(), words.end());
+			_word_offsets.push_back(_words.size());
+		}
+	}
+
+	_order.resize(_tweet_slots.size());
+	for (size_t i = 0; i < _order.size(); ++i) _order[i] = (int)i;
+	std::stable_sort(_order.begin(), _order.end(), utility::index_comparer<std::vector<int>>(_tweet_slots, false));
+
+	// thread ranges of the ordered tweets are moved forward to the first tweet of a user
+	_thread_starts.resize(_thread_num + 1);
+	for (size_t i = 0; i <= _thread_num; ++i)
+	{
+		size_t start = i * _order.size() / _thread_num;
+		while (start > 0 && start < _order.size() && _tweet_slots[_order[start]] == _tweet_slots[_order[start - 1]]) ++start;
+		_thread_starts[i] = start;
+	}
+
+	printf("%lld held-out tweets of %lld users, %lld unseen\n", (long long)_tweet_slots.size(), (long long)_slot_users.size(), (long long)_unseen_slots.size());
+	fflush(stdout);
+}
+
+double evaluator::perplexity(const char *user_param_path, bool fold_in)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	int topic_num = _m.topic_num();
+	_slot_topic_counts.assign(_slot_users.size() * topic_num, 0.0);
+
+	// a user may have a parameter record per run of its tweets in every shard
+	int *topic_counts = new int[topic_num];
+	int shard_num = _m.shard_num();
+	for (int shard = 0; shard < std::max(shard_num, 1); ++shard)
+	{
+		char *path = utility::shard_path(user_param_path, shard_num, shard);
+		user_param_file_reader reader(path, topic_num);
+		delete[] path;
+		while (true)
+		{
+			file_item item = reader.get_item(false);
+			if (item.size == 0) break;
+
+			utility::read_buffer buffer(item.data, item.size);
+			int user = -1;
+			if (buffer.read_varint(&user) == 0 || user < 0 || user >= (int)_user_slots.size() || _user_slots[user] < 0) continue;
+			std::fill(topic_counts, topic_counts + topic_num, 0);
+			buffer.read_sparse_array(topic_counts, topic_num);
+			double *slot_topic_counts = &_slot_topic_counts[_user_slots[user] * (size_t)topic_num];
+			for (int i = 0; i < topic_num; ++i) slot_topic_counts[i] += topic_counts[i];
+		}
+	}
+	delete[] topic_counts;
+
+	if (fold_in)
+	{
+		_folding = true;
+		parallel::_update();
+		_folding = false;
+	}
+	parallel::_update();
+
+	double log_prob = 0.0;
+	long long word_count = 0;
+	for (size_t i = 0; i < _thread_num; ++i)
+	{
+		log_prob += _log_probs[i];
+		word_count += _word_counts[i];
+	}
+
+	double result = exp(-log_prob / std::max(word_count, 1LL));
+	auto end_time = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+	printf("%.4f perplexity  %lld held-out words  %.1f sec\n", result, word_count, duration.count() * 0.001);
+	fflush(stdout);
+	return result;
+}
+
+void evaluator::_update(size_t id)
+{
+	if (_encoding)
+	{
+		size_t start = id * _input_ptrs.size() / _thread_num;
+		size_t end = (id + 1) * _input_ptrs.size() / _thread_num;
+		_encode(start, end);
+		return;
+	}
+
+	_evaluate(id);
+}
+
+void evaluator::_encode(size_t start, size_t end)
+{
+	utility::tokenizer tokenizer;
+	for (size_t i = start; i < end; ++i)
+	{
+		std::vector<int> &words = _input_words[i];
+		words.clear();
+		const char *text = _input_ptrs[i], *text_end = _input_ptrs[i] + _input_sizes[i];
+		const char *tab = (const char*)memchr(text, '\t', _input_sizes[i]);
+		_input_users[i] = (tab == nullptr) ? _user_index.find(default_user) : _user_index.find(text, tab - text);
+		if (tab != nullptr) text = tab + 1;
+		tokenizer.reset(text, text_end - text);
+		const char *token;
+		size_t size;
+		while (tokenizer.next(&token, &size))
+		{
+			int word = _word_index.find(token, size);
+			if (word >= 0) words.push_back(word);
+			else if (_hash_num > 0) words.push_back(_exact_word_num + (int)(utility::hash_bytes(token, size) % (unsigned long long)_hash_num));
+		}
+	}
+}
+
+void evaluator::_evaluate(size_t id)
+{
+	int topic_num = _m.topic_num();
+	double *topic_probs = new double[topic_num];
+	double *held_log_probs = new double[topic_num];
+	std::vector<double> fold_counts(topic_num, 0.0), no_counts(topic_num, 0.0);
+	std::vector<int> observed_words, held_words;
+	double log_prob = 0.0;
+	long long word_count = 0;
+
+	for (size_t i = _thread_starts[id]; i < _thread_starts[id + 1]; ++i)
+	{
+		int tweet = _order[i];
+		int slot = _tweet_slots[tweet];
+		if (_folding && _slot_users[slot] >= 0) continue;
+
+		observed_words.clear();
+		held_words.clear();
+		for (size_t j = _word_offsets[tweet]; j < _word_offsets[tweet + 1]; ++j)
+		{
+			if (((j - _word_offsets[tweet]) & 1) == 0) observed_words.push_back(_words[j]);
+			else held_words.push_back(_words[j]);
+		}
+
+		double *slot_topic_counts = &_slot_topic_counts[slot * (size_t)topic_num];
+		if (_folding)
+		{
+			// expected topic counts of the observed words, with the prior alone as user topics
+			_m.complete(observed_words, std::vector<int>(), no_counts.data(), topic_probs, held_log_probs);
+			for (int topic = 0; topic < topic_num; ++topic) fold_counts[topic] += topic_probs[topic];
+			bool is_last = (i + 1 == _thread_starts[id + 1]) || (_tweet_slots[_order[i + 1]] != slot);
+			if (!is_last) continue;
+			std::copy(fold_counts.begin(), fold_counts.end(), slot_topic_counts);
+			std::fill(fold_counts.begin(), fold_counts.end(), 0.0);
+			continue;
+		}
+
+		log_prob += _m.complete(observed_words, held_words, slot_topic_counts, topic_probs, held_log_probs);
+		word_count += held_words.size();
+	}
+
+	delete[] topic_probs;
+	delete[] held_log_probs;
+	if (_folding) return;
+	_log_probs[id] = log_prob;
+	_word_counts[id] = word_count;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "model.h"
+#include "parallel.h"
+#include "utility.h"
+#include "vocab_index.h"
+
+// Held-out perplexity by document completion, the even words of every tweet predict its odd words
+class evaluator : public parallel
+{
+public:
+	evaluator(model &m, const char *word_path, const char *word_index_path, const char *user_path, size_t thread_num);
+	~evaluator();
+
+	// encodes held-out text once, tweets of users not in the user file belong to unseen users
+	void load(const char *input_path, size_t batch_size);
+
+	// unseen users have uniform topics, or topic counts folded in from the observed words of their tweets
+	double perplexity(const char *user_param_path, bool fold_in);
+
+private:
+	typedef std::unordered_map<char*, int, utility::string_hasher, utility::string_predicate> user_slot_map;
+
+	model &_m;
+	vocab_index _word_index, _user_index;
+	int _hash_num;
+	int _exact_word_num;
+
+	// lines of the batch being encoded, the user of a line is -1 when unseen
+	std::vector<char*> _input_ptrs;
+	std::vector<size_t> _input_sizes;
+	std::vector<int> _input_users;
+	std::vector<std::vector<int>> _input_words;
+
+	// held-out tweets with at least two words, each user has a slot of topic counts
+	std::vector<int> _tweet_slots;
+	std::vector<size_t> _word_offsets;
+	std::vector<int> _words;
+	std::vector<int> _user_slots; // by user id, -1 when the user has no held-out tweet
+	std::vector<int> _slot_users; // -1 for unseen users
+	user_slot_map _unseen_slots;
+	utility::string_pool _unseen_users;
+	std::vector<double> _slot_topic_counts;
+
+	// tweets in slot order, threads take whole users so that folding in needs no locks
+	std::vector<int> _order;
+	std::vector<size_t> _thread_starts;
+
+	bool _encoding;
+	bool _folding;
+	std::vector<double> _log_probs;
+	std::vector<long long> _word_counts;
+
+	void _update(size_t id);
+	void _encode(size_t start, size_t end);
+	void _evaluate(size_t id);
+};
+
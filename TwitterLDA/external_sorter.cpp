@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "external_sorter.h"
+#include "async_io.h"
+#include "utility.h"
+
+// one record of a sorted run, var_int key, var_int seq, var_int size, char data[size]
+class sorted_run_file_reader : public file_reader
+{
+public:
+	sorted_run_file_reader(const char *path, size_t buffer_size) : file_reader(path, buffer_size)
+	{
+		// plain reads into the buffer, readahead chunks for every run merged would exceed the memory budget
+		delete _reader;
+		_reader = nullptr;
+	}
+
+	size_t segment(char *data, size_t size)
+	{
+		utility::read_buffer buffer(data, size);
+		long long key, seq;
+		size_t record_size;
+		if (buffer.read_varint(&key) == 0 || buffer.read_varint(&seq) == 0 || buffer.read_varint(&record_size) == 0) return 0;
+		if (buffer.skip(record_size) != record_size) return 0;
+		return buffer.offset();
+	}
+};
+
+external_sorter::external_sorter(const char *temp_path, size_t memory_size)
+{
+	_temp_path = new char[strlen(temp_path) + 1];
+	strcpy(_temp_path, temp_path);
+	_memory_size = std::max(memory_size, (size_t)1 << 20);
+	_next_record = 0;
+	_merging = false;
+	_last_run = 0;
+}
+
+external_sorter::~external_sorter()
+{
+	_close_runs();
+	for (size_t i = 0; i < _run_paths.size(); ++i)
+	{
+		if (_run_paths[i] == nullptr) continue;
+		remove(_run_paths[i]);
+		delete[] _run_paths[i];
+	}
+	delete[] _temp_path;
+}
+
+void external_sorter::add(long long key, long long seq, const char *data, size_t size)
+{
+	if (_data.size() + size + (_records.size() + 1) * sizeof(record) > _memory_size && !_records.empty()) _spill();
+	record r = { key, seq, _data.size(), size };
+	_records.push_back(r);
+	_data.write_bytes(data, size);
+}
+
+bool external_sorter::next(long long *key, long long *seq, file_item *item)
+{
+	if (!_merging) _start_merge();
+
+	// records never spilled are handed out from memory
+	if (_runs.empty())
+	{
+		if (_next_record >= _records.size()) return false;
+		const record &r = _records[_next_record++];
+		*key = r.key;
+		*seq = r.seq;
+		item->data = _data.buffer() + r.offset;
+		item->size = r.size;
+		return true;
+	}
+
+	return _next_run_record(key, seq, item);
+}
+
+bool external_sorter::_record_less(const record &a, const record &b)
+{
+	if (a.key != b.key) return a.key < b.key;
+	return a.seq < b.seq;
+}
+
+char *external_sorter::_new_run_path()
+{
+	char *path = new char[strlen(_temp_path) + 32];
+	sprintf(path, "%s.%d.bin", _temp_path, (int)_run_paths.size());
+	return path;
+}
+
+void external_sorter::_spill()
+{
+	std::sort(_records.begin(), _records.end(), _record_less);
+
+	char *path = _new_run_path();
+	_run_paths.push_back(path);
+
+	file_writer writer(path);
+	utility::write_buffer buffer;
+	for (size_t i = 0; i < _records.size(); ++i)
+	{
+		const record &r = _records[i];
+		buffer.clear();
+		buffer.write_varint(r.key);
+		buffer.write_varint(r.seq);
+		buffer.write_varint(r.size);
+		buffer.write_bytes(_data.buffer() + r.offset, r.size);
+		writer.write(buffer.buffer(), buffer.size());
+	}
+	writer.close();
+
+	_records.clear();
+	_data.clear();
+}
+
+void external_sorter::_start_merge()
+{
+	_merging = true;
+	if (_run_paths.empty())
+	{
+		std::sort(_records.begin(), _records.end(), _record_less);
+		return;
+	}
+	if (!_records.empty()) _spill();
+
+	// the oldest runs are merged into a new one until a single pass can merge the rest, keeping open files bounded
+	size_t first = 0;
+	utility::write_buffer buffer;
+	while (_run_paths.size() - first > max_merge_runs)
+	{
+		_open_runs(first, max_merge_runs);
+		char *path = _new_run_path();
+		file_writer writer(path);
+		long long key, seq;
+		file_item item;
+		while (_next_run_record(&key, &seq, &item))
+		{
+			buffer.clear();
+			buffer.write_varint(key);
+			buffer.write_varint(seq);
+			buffer.write_varint(item.size);
+			buffer.write_bytes(item.data, item.size);
+			writer.write(buffer.buffer(), buffer.size());
+		}
+		writer.close();
+		_close_runs();
+
+		for (size_t i = first; i < first + max_merge_runs; ++i)
+		{
+			remove(_run_paths[i]);
+			delete[] _run_paths[i];
+			_run_paths[i] = nullptr;
+		}
+		first += max_merge_runs;
+		_run_paths.push_back(path);
+	}
+	_open_runs(first, _run_paths.size() - first);
+}
+
+// the memory budget is shared by the read buffers of the runs
+void external_sorter::_open_runs(size_t first, size_t count)
+{
+	size_t buffer_size = std::max(_memory_size / count, (size_t)1 << 16);
+	_runs.resize(count);
+	_heap.clear();
+	for (size_t i = 0; i < count; ++i)
+	{
+		_runs[i].reader = new sorted_run_file_reader(_run_paths[first + i], buffer_size);
+		if (_read_run(_runs[i])) _heap.push_back(i);
+	}
+	std::make_heap(_heap.begin(), _heap.end(), run_comparer(_runs));
+	_last_run = _runs.size();
+}
+
+void external_sorter::_close_runs()
+{
+	for (size_t i = 0; i < _runs.size(); ++i) delete _runs[i].reader;
+	_runs.clear();
+	_heap.clear();
+}
+
+bool external_sorter::_next_run_record(long long *key, long long *seq, file_item *item)
+{
+	// the run handed out last is advanced only now, so its data stayed valid until this call
+	if (_last_run < _runs.size())
+	{
+		if (_read_run(_runs[_last_run]))
+		{
+			_heap.push_back(_last_run);
+			std::push_heap(_heap.begin(), _heap.end(), run_comparer(_runs));
+		}
+		_last_run = _runs.size();
+	}
+	if (_heap.empty()) return false;
+
+	std::pop_heap(_heap.begin(), _heap.end(), run_comparer(_runs));
+	_last_run = _heap.back();
+	_heap.pop_back();
+	const run &r = _runs[_last_run];
+	*key = r.key;
+	*seq = r.seq;
+	*item = r.item;
+	return true;
+}
+
+bool external_sorter::_read_run(run &r)
+{
+	file_item item = r.reader->get_item(false);
+	if (item.size == 0) return false;
+	utility::read_buffer buffer(item.data, item.size);
+	size_t size = 0;
+	if (buffer.read_varint(&r.key) == 0 || buffer.read_varint(&r.seq) == 0 || buffer.read_varint(&size) == 0 || buffer.offset() + size > item.size)
+	{
+		printf("Corrupt sort run of %s\n", _temp_path);
+		return false; // the rest of the run is dropped
+	}
+	r.item.data = item.data + buffer.offset();
+	r.item.size = size;
+	return true;
+}
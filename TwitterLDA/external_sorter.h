@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include "file_reader.h"
+#include "utility.h"
+
+// Sorts variable size records by key and sequence with bounded memory
+// full runs are sorted and spilled to temporary files, then merged, keys and sequences are not negative
+class external_sorter
+{
+public:
+	static const size_t max_merge_runs = 64; // more runs are first merged into longer runs in passes
+
+	external_sorter(const char *temp_path, size_t memory_size);
+	~external_sorter();
+
+	void add(long long key, long long seq, const char *data, size_t size);
+
+	// records come out in order of key, then sequence, data is valid until the next call
+	bool next(long long *key, long long *seq, file_item *item);
+
+private:
+	struct record
+	{
+		long long key;
+		long long seq;
+		size_t offset;
+		size_t size;
+	};
+
+	struct run
+	{
+		file_reader *reader;
+		long long key;
+		long long seq;
+		file_item item;
+	};
+
+	// orders the heap of runs so that the smallest current record is on top
+	struct run_comparer
+	{
+		const std::vector<run> &_runs;
+
+		run_comparer(const std::vector<run> &runs) : _runs(runs)
+		{
+		}
+
+		bool operator()(size_t a, size_t b) const
+		{
+			const run &x = _runs[a], &y = _runs[b];
+			if (x.key != y.key) return x.key > y.key;
+			return x.seq > y.seq;
+		}
+	};
+
+	char *_temp_path;
+	size_t _memory_size;
+	utility::write_buffer _data;
+	std::vector<record> _records;
+	size_t _next_record;
+	bool _merging;
+
+	std::vector<char*> _run_paths; // nullptr for runs already merged into a longer one
+	std::vector<run> _runs;
+	std::vector<size_t> _heap; // indexes of runs with records left, smallest on top
+	size_t _last_run;
+
+	static bool _record_less(const record &a, const record &b);
+	char *_new_run_path();
+	void _spill();
+	void _start_merge();
+	void _open_runs(size_t first, size_t count);
+	void _close_runs();
+	bool _next_run_record(long long *key, long long *seq, file_item *item);
+	bool _read_run(run &r);
+};
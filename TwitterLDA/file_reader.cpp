@@ -1,26 +1,27 @@
 #include "file_reader.h"
 #include "utility.h"
+#include "gzip_reader.h"
 #include <cstdio>
 #include <cstring>
+#include <cassert>
 
 file_reader::file_reader(const char *path, size_t buffer_size)
 {
 	_fp = fopen(path, "rb");
+	_header_size = 0;
 	_buffer = new char[buffer_size];
 	_buffer_offset = 0;
 	_buffer_count = 0;
 	_buffer_size = buffer_size;
 
 	_position = 0;
-#ifdef  _WIN64
-	_fseeki64(_fp, 0, SEEK_END);
-	_size = _ftelli64(_fp);
-	_fseeki64(_fp, 0, SEEK_SET);
-#else
-	fseek(_fp, 0, SEEK_END);
-	_size = ftell(_fp);
-	fseek(_fp, 0, SEEK_SET);
-#endif
+	_size = utility::file_size(_fp);
+
+	// bulk reads go through readahead requests, _fp is kept for peeking the header
+	_reader = nullptr;
+	_gzip = nullptr;
+	async_io *io = (_fp != nullptr) ? async_io::create(path, false, async_io::default_mode()) : nullptr;
+	if (io != nullptr) _reader = new async_reader(io, _size);
 }
 
 file_reader::~file_reader()
@@ -38,6 +39,10 @@ void file_reader::close()
 {
 	if (_fp != nullptr)
 	{
+		delete _reader;
+		_reader = nullptr;
+		delete _gzip;
+		_gzip = nullptr;
 		fclose(_fp);
 		_fp = nullptr;
 		delete[] _buffer;
@@ -46,13 +51,20 @@ void file_reader::close()
 }
 
 void file_reader::reset()
+{
+	seek(_header_size);
+}
+
+void file_reader::seek(long long position)
 {
 	if (_fp != nullptr)
 	{
-		fseek(_fp, 0, SEEK_SET);
+		if (_gzip != nullptr) _gzip->seek(position);
+		else if (_reader != nullptr) _reader->seek(position);
+		else utility::seek_file(_fp, position);
 		_buffer_offset = 0;
 		_buffer_count = 0;
-		_position = 0;
+		_position = position;
 	}
 }
 
@@ -61,6 +73,11 @@ size_t file_reader::buffer_size() const
 	return _buffer_size;
 }
 
+size_t file_reader::header_size() const
+{
+	return _header_size;
+}
+
 long long file_reader::size() const
 {
 	return _size;
@@ -71,6 +88,32 @@ long long file_reader::position() const
 	return _position;
 }
 
+long long file_reader::buffered_end() const
+{
+	return _position + (long long)_buffer_count;
+}
+
+void file_reader::restore(long long position, long long buffered_end, size_t buffer_size)
+{
+	if (_fp == nullptr) return;
+	if (buffer_size > _buffer_size)
+	{
+		delete[] _buffer;
+		_buffer = new char[buffer_size];
+		_buffer_size = buffer_size;
+	}
+	seek(position);
+	size_t size = (size_t)std::max(std::min(buffered_end - position, (long long)_buffer_size), 0LL);
+	if (size > 0) _buffer_count = _read(_buffer, size);
+}
+
+size_t file_reader::_read(char *data, size_t size)
+{
+	if (_gzip != nullptr) return _gzip->read(data, size);
+	if (_reader != nullptr) return _reader->read(data, size);
+	return utility::fread(data, size, _fp);
+}
+
 file_item file_reader::get_item(bool fixed_buffer)
 {
 	file_item item;
@@ -85,7 +128,7 @@ file_item file_reader::get_item(bool fixed_buffer)
 	trim();
 	while (true)
 	{
-		size_t more = utility::fread(_buffer + _buffer_count, _buffer_size - _buffer_count, _fp);
+		size_t more = _read(_buffer + _buffer_count, _buffer_size - _buffer_count);
 		if (more == 0) return item; // reach end of file, item is still incomplete
 
 		_buffer_count += more;
@@ -117,12 +160,27 @@ bool file_reader::unget_item(file_item item)
 
 text_file_reader::text_file_reader(const char *path, size_t buffer_size) : file_reader(path, buffer_size)
 {
+	char header[4];
+	size_t count = (_fp != nullptr) ? fread(header, 1, sizeof(header), _fp) : 0;
+	if (gzip_reader::is_gzip(header, count))
+	{
+		delete _reader;
+		_reader = nullptr;
+		_gzip = new gzip_reader(path);
+		_size = _gzip->size();
+	}
+	else if (gzip_reader::is_zstd(header, count))
+	{
+		// no zstd decoder is built in, the input reads as empty
+		printf("Zstandard input %s is not supported, recompress it with gzip or bgzip\n", path);
+		_header_size = (size_t)_size;
+	}
+	reset();
 }
 
 size_t text_file_reader::segment(char *data, size_t size)
 {
-	size_t n = 0;
-	while (n < size && data[n] != '\r' && data[n] != '\n') ++n;
+	size_t n = utility::find_line_end(data, size);
 	if (n >= size) return 0;
 	char tail = data[n];
 	data[n] = '\0';
@@ -130,11 +188,71 @@ size_t text_file_reader::segment(char *data, size_t size)
 	return n + 1;
 }
 
+unsigned long long text_file_reader::fingerprint(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr) return 0;
+	fclose(fp);
+
+	// line ends are left out, the same text hashes the same with any line end
+	text_file_reader reader(path, 1 << 16);
+	std::vector<char> text;
+	while (text.size() < fingerprint_size)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		text.insert(text.end(), item.data, item.data + strlen(item.data));
+		text.push_back('\n');
+	}
+	return text.empty() ? 0 : utility::hash_bytes(text.data(), text.size());
+}
+
+bool text_file_reader::supported(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr) return true;
+	char header[4];
+	size_t count = fread(header, 1, sizeof(header), fp);
+	fclose(fp);
+	return !gzip_reader::is_zstd(header, count);
+}
+
+static const char stream_vbyte_header[4] = { 0, 0, 'S', tweet_file_reader::format_version::stream_vbyte };
+static const char weighted_header[3] = { 0, 0, 'W' };
+
 tweet_file_reader::tweet_file_reader(const char *path, size_t buffer_size) : file_reader(path, buffer_size)
 {
+	// version 1 files have no header, and a version 1 tweet never has zero user and zero words
+	_version = format_version::varint;
+	_weighted = false;
+	char header[sizeof(stream_vbyte_header)];
+	if (_fp != nullptr && fread(header, 1, sizeof(header), _fp) == sizeof(header))
+	{
+		if (memcmp(header, stream_vbyte_header, sizeof(header)) == 0)
+		{
+			_version = format_version::stream_vbyte;
+			_header_size = sizeof(stream_vbyte_header);
+		}
+		else if (memcmp(header, weighted_header, sizeof(weighted_header)) == 0)
+		{
+			_version = (format_version)header[sizeof(weighted_header)];
+			_weighted = true;
+			_header_size = sizeof(header);
+		}
+	}
 	reset();
 }
 
+tweet_file_reader::format_version tweet_file_reader::version() const
+{
+	return _version;
+}
+
+bool tweet_file_reader::weighted() const
+{
+	return _weighted;
+}
+
 size_t tweet_file_reader::segment(char *data, size_t size)
 {
 	utility::read_buffer buffer(data, size);
@@ -142,20 +260,102 @@ size_t tweet_file_reader::segment(char *data, size_t size)
 	if (buffer.read_varint(&user) == 0) return 0;
 	int count;
 	if (buffer.read_varint(&count) == 0) return 0;
-	for (int i = 0; i < count; ++i)
+	if (_version == format_version::stream_vbyte)
+	{
+		if (count > 0 && buffer.skip_varints(count) == 0) return 0;
+	}
+	else
 	{
-		int word;
-		if (buffer.read_varint(&word) == 0) return 0;
+		for (int i = 0; i < count; ++i)
+		{
+			int word;
+			if (buffer.read_varint(&word) == 0) return 0;
+		}
 	}
+	int weight;
+	if (_weighted && buffer.read_varint(&weight) == 0) return 0;
 	return buffer.offset();
 }
 
+size_t tweet_file_reader::write_header(file_writer &writer, format_version version, bool weighted)
+{
+	if (weighted)
+	{
+		char header[sizeof(weighted_header) + 1];
+		memcpy(header, weighted_header, sizeof(weighted_header));
+		header[sizeof(weighted_header)] = (char)version;
+		return writer.write(header, sizeof(header));
+	}
+	if (version != format_version::stream_vbyte) return 0;
+	return writer.write(stream_vbyte_header, sizeof(stream_vbyte_header));
+}
+
+size_t tweet_file_reader::read_tweet(utility::read_buffer &buffer, format_version version, int *user, std::vector<int> &words, bool weighted, int *weight)
+{
+	size_t start = buffer.offset();
+	int count;
+	if (buffer.read_varint(user) == 0 || buffer.read_varint(&count) == 0) return 0;
+	words.resize(count);
+	if (version == format_version::stream_vbyte)
+	{
+		if (count > 0 && buffer.read_varints(words.data(), count) == 0) return 0;
+	}
+	else
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (buffer.read_varint(&words[i]) == 0) return 0;
+		}
+	}
+	int value = 1;
+	if (weighted && buffer.read_varint(&value) == 0) return 0;
+	if (weight != nullptr) *weight = value;
+	return buffer.offset() - start;
+}
+
+size_t tweet_file_reader::write_tweet(utility::write_buffer &buffer, format_version version, int user, const std::vector<int> &words)
+{
+	size_t start = buffer.offset();
+	buffer.write_varint(user);
+	buffer.write_varint((int)words.size());
+	if (version == format_version::stream_vbyte)
+	{
+		if (!words.empty()) buffer.write_varints(words.data(), words.size());
+	}
+	else
+	{
+		for (size_t i = 0; i < words.size(); ++i) buffer.write_varint(words[i]);
+	}
+	return buffer.offset() - start;
+}
+
+static const char fixed_header[3] = { 0, 0, 'F' };
+
 tweet_param_file_reader::tweet_param_file_reader(const char *path, size_t buffer_size) : file_reader(path, buffer_size)
 {
+	// a version 1 param never has zero topic and zero words
+	_version = format_version::varint;
+	_topic_size = 0;
+	_word_count = 0;
+	char header[sizeof(fixed_header) + 1];
+	if (_fp != nullptr && fread(header, 1, sizeof(header), _fp) == sizeof(header) && memcmp(header, fixed_header, sizeof(fixed_header)) == 0)
+	{
+		_version = format_version::fixed;
+		_topic_size = header[sizeof(fixed_header)];
+		_header_size = sizeof(header);
+	}
+	reset();
 }
 
 size_t tweet_param_file_reader::segment(char *data, size_t size)
 {
+	if (_version == format_version::fixed)
+	{
+		// record size is known only from the word count of the matching tweet
+		size_t num = _topic_size + (_word_count + 7) / 8;
+		if (num > size) return 0;
+		return num;
+	}
 	utility::read_buffer buffer(data, size);
 	int topic;
 	if (buffer.read_varint(&topic) == 0) return 0;
@@ -166,6 +366,72 @@ size_t tweet_param_file_reader::segment(char *data, size_t size)
 	return buffer.offset() + num;
 }
 
+void tweet_param_file_reader::set_word_count(int word_count)
+{
+	_word_count = word_count;
+}
+
+tweet_param_file_reader::format_version tweet_param_file_reader::version() const
+{
+	return _version;
+}
+
+int tweet_param_file_reader::topic_size() const
+{
+	return _topic_size;
+}
+
+tweet_param_file_reader::format_version tweet_param_file_reader::detect_version(const char *path)
+{
+	tweet_param_file_reader reader(path, 1);
+	return reader.version();
+}
+
+int tweet_param_file_reader::get_topic_size(int topic_num)
+{
+	if (topic_num <= (1 << 8)) return 1;
+	if (topic_num <= (1 << 16)) return 2;
+	return 4;
+}
+
+size_t tweet_param_file_reader::write_header(file_writer &writer, format_version version, int topic_size)
+{
+	if (version != format_version::fixed) return 0;
+	char header[sizeof(fixed_header) + 1];
+	memcpy(header, fixed_header, sizeof(fixed_header));
+	header[sizeof(fixed_header)] = (char)topic_size;
+	return writer.write(header, sizeof(header));
+}
+
+size_t tweet_param_file_reader::read_topic(utility::read_buffer &buffer, format_version version, int topic_size, int word_count, int *topic)
+{
+	if (version == format_version::fixed)
+	{
+		unsigned int value = 0;
+		if (buffer.read_bytes(&value, topic_size) == 0) return 0;
+		*topic = (int)value;
+		return topic_size;
+	}
+	size_t start = buffer.offset();
+	int count;
+	if (buffer.read_varint(topic) == 0 || buffer.read_varint(&count) == 0) return 0;
+	if (count != word_count) return 0;
+	return buffer.offset() - start;
+}
+
+size_t tweet_param_file_reader::write_topic(utility::write_buffer &buffer, format_version version, int topic_size, int word_count, int topic)
+{
+	if (version == format_version::fixed)
+	{
+		unsigned int value = (unsigned int)topic;
+		return buffer.write_bytes(&value, topic_size);
+	}
+	size_t start = buffer.offset();
+	buffer.write_varint(topic);
+	buffer.write_varint(word_count);
+	return buffer.offset() - start;
+}
+
 user_param_file_reader::user_param_file_reader(const char *path, int topic_num, size_t buffer_size) : file_reader(path, buffer_size)
 {
 	_topic_num = topic_num;
@@ -191,10 +457,23 @@ size_t user_param_file_reader::segment(char *data, size_t size)
 	return buffer.offset();
 }
 
+// a varint never ends with a zero continuation, so a version 1 file never starts like this
+static const char indexed_header[3] = { (char)0x80, 0, 'I' };
+
 topic_param_file_reader::topic_param_file_reader(const char *path, int word_num, size_t buffer_size) : file_reader(path, buffer_size)
 {
 	_word_num = word_num;
 	_temp_buffer = new int[word_num];
+	char header[sizeof(indexed_header)];
+	int row_num = 0;
+	if (_fp != nullptr && fread(header, 1, sizeof(header), _fp) == sizeof(header) && memcmp(header, indexed_header, sizeof(indexed_header)) == 0 && utility::fread(&row_num, 1, _fp) == 1)
+	{
+		_row_ends.resize(row_num);
+		bool is_valid = utility::fread(_row_ends.data(), _row_ends.size(), _fp) == _row_ends.size();
+		assert(is_valid && "Invalid topic parameter header");
+		_header_size = sizeof(header) + sizeof(row_num) + _row_ends.size() * sizeof(long long);
+	}
+	reset();
 }
 
 topic_param_file_reader::~topic_param_file_reader()
@@ -214,12 +493,71 @@ int topic_param_file_reader::word_num() const
 	return _word_num;
 }
 
-tweet_id_file_reader::tweet_id_file_reader(const char *path, size_t buffer_size) : file_reader(path, buffer_size)
+const std::vector<long long> &topic_param_file_reader::row_ends() const
 {
+	return _row_ends;
+}
+
+bool topic_param_file_reader::read_rows(std::vector<char> &rows)
+{
+	if (_fp == nullptr || _row_ends.empty()) return false;
+	rows.resize((size_t)_row_ends.back());
+	utility::seek_file(_fp, _header_size);
+	bool is_read = utility::fread(rows.data(), rows.size(), _fp) == rows.size();
+	reset();
+	return is_read;
+}
+
+size_t topic_param_file_reader::write_header(FILE *fp, const std::vector<long long> &row_ends)
+{
+	int row_num = (int)row_ends.size();
+	size_t size = utility::fwrite(indexed_header, sizeof(indexed_header), fp);
+	size += utility::fwrite(&row_num, 1, fp) * sizeof(row_num);
+	size += utility::fwrite(row_ends.data(), row_ends.size(), fp) * sizeof(long long);
+	return size;
+}
+
+tweet_id_file_reader::tweet_id_file_reader(const char *path, bool weighted, size_t buffer_size) : file_reader(path, buffer_size)
+{
+	_weighted = weighted;
 }
 
 size_t tweet_id_file_reader::segment(char *data, size_t size)
 {
-	long long id;
-	return utility::get_varint(data, &id, size);
+	if (!_weighted)
+	{
+		long long id;
+		return utility::get_varint(data, &id, size);
+	}
+	utility::read_buffer buffer(data, size);
+	int count;
+	if (buffer.read_varint(&count) == 0) return 0;
+	for (int i = 0; i < count; ++i)
+	{
+		long long id;
+		if (buffer.read_varint(&id) == 0) return 0;
+	}
+	return buffer.offset();
+}
+
+bool tweet_id_file_reader::weighted() const
+{
+	return _weighted;
+}
+
+size_t tweet_id_file_reader::read_tweet_ids(utility::read_buffer &buffer, bool weighted, std::vector<long long> &tweet_ids)
+{
+	size_t start = buffer.offset();
+	int count = 1;
+	if (weighted && buffer.read_varint(&count) == 0) return 0;
+	tweet_ids.resize(count);
+	long long tweet_id = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		long long delta;
+		if (buffer.read_varint(&delta) == 0) return 0;
+		tweet_id += delta;
+		tweet_ids[i] = tweet_id;
+	}
+	return buffer.offset() - start;
 }
@@ -6,29 +6,85 @@
 	text_file:
 		char text[];
 		(\r\n r \n\r or \n or \r)
+		(optionally gzip compressed, positions are in the decompressed text)
 
-	tweet_file:
+	tweet_file (version 1):
 		var_int user;
 		var_int word_count;
 		var_int words[word_count]
 
-	tweet_param_file:
+	tweet_file (version 2):
+		char header[4] = { 0, 0, 'S', 2 }; (once at beginning of file)
+		var_int user;
+		var_int word_count;
+		stream_vbyte words[word_count];
+			char word_lengths[ceil(word_count / 4)]; (2 bits per word, byte length - 1)
+			char word_bytes[]; (little endian)
+
+	tweet_file (weighted, identical tweets of a user collapsed into one):
+		char header[4] = { 0, 0, 'W', version }; (once at beginning of file)
+		tweet of the version, followed by var_int weight;
+
+	tweet_param_file (version 1):
 		var_int topic;
 		var_int word_count;
 		char word_tags[ceil(word_count / 8)]
 
+	tweet_param_file (version 2, fixed size records updated in place):
+		char header[4] = { 0, 0, 'F', topic_size }; (once at beginning of file)
+		char topic[topic_size]; (little endian)
+		char word_tags[ceil(word_count / 8)]; (word_count from tweet_file)
+
 	user_param_file:
 		var_int user;
 		sparse_var_int_array topic_counts;
 
-	topic_param_file:
+	topic_param_file (version 1):
 		sparse_var_int_array word_counts;
 
+	topic_param_file (indexed, rows decoded in parallel):
+		char header[3] = { 0x80, 0, 'I' }; (once at beginning of file)
+		int row_num; (topic_num + 1)
+		long long row_ends[row_num]; (end offset of every row after the header)
+		sparse_var_int_array word_counts[row_num];
+
 	tweet_id_file:
 		var_int64 tweet_id;
+
+	checkpoint_file: (of an iteration in progress at a batch boundary, or of a finished iteration)
+		char header[4] = { 'C', 'K', 'P', 2 };
+		int iteration;
+		int complete; (1 for a finished iteration, shard parts are absent)
+		int topic_num, word_num, shard_count;
+		long long file_size; (a shorter file is truncated)
+		long long output_sizes[shard_count][2]; (bytes of user param and tweet param written)
+		long long process_word_count, update_word_count;
+		double log_likelihood;
+		int engine_state_size;
+		char engine_states[engine_state_size]; (random engines as text)
+		shard_state shards[shard_count];
+			long long tweet_position, tweet_buffered_end, tweet_buffer_size;
+			long long tweet_param_position, tweet_param_buffered_end, tweet_param_buffer_size;
+			long long user_param_position;
+			int prev_user;
+			int user; (of the run continuing in the next batch, -1 if none)
+			sparse_var_int_array topic_counts; (of the continuing run)
+			long long index_tweet_count, index_user_count;
+			int index_item_count;
+			param_index_item index_items[index_item_count];
+		sparse_var_int_array word_counts[topic_num + 1];
+
+	tweet_id_file (of weighted tweet_file):
+		var_int count; (weight of the tweet)
+		var_int64 tweet_ids[count]; (first id, then differences from the previous id)
 */
 
 #include <cstdio>
+#include <vector>
+#include "utility.h"
+#include "async_io.h"
+
+class gzip_reader;
 
 struct file_item
 {
@@ -40,48 +96,102 @@ class file_reader
 {
 public:
 	file_reader(const char *path, size_t buffer_size);
-	~file_reader();
+	virtual ~file_reader();
 
 	file_item get_item(bool fixed_buffer);
 	bool unget_item(file_item item);
 	void trim();
 	void reset();
+	void seek(long long position);
 	void close();
 	size_t buffer_size() const;
-	long long size() const;
+	size_t header_size() const;
+	long long size() const; // -1 when unknown, as for gzip input that is not block compressed
 	long long position() const;
+	long long buffered_end() const; // of the data read into the buffer
+
+	// seeks and reads up to buffered_end into a buffer of at least buffer_size, the reader then cuts the same items
+	// as it did when it was there
+	void restore(long long position, long long buffered_end, size_t buffer_size);
 
 	virtual size_t segment(char *data, size_t size) = 0;
 
 protected:
+	size_t _header_size;
 	size_t _buffer_size;
 	size_t _buffer_offset;
 	size_t _buffer_count;
 	char *_buffer;
 	FILE *_fp;
+	async_reader *_reader;
+	gzip_reader *_gzip; // replaces _reader for compressed text
 	long long _size;
 	long long _position;
+
+	size_t _read(char *data, size_t size);
 };
 
 class text_file_reader : public file_reader
 {
 public:
+	static const size_t fingerprint_size = 64 << 10;
+
 	text_file_reader(const char *path, size_t buffer_size = 16 << 20);
 	size_t segment(char *data, size_t size);
+
+	// hash of the first lines up to fingerprint_size bytes, 0 for an empty or missing file
+	static unsigned long long fingerprint(const char *path);
+
+	// false for compressed text no decoder is built in for, which reads as empty
+	static bool supported(const char *path);
 };
 
 class tweet_file_reader : public file_reader
 {
 public:
+	enum format_version
+	{
+		varint = 1, stream_vbyte = 2
+	};
+
 	tweet_file_reader(const char *path, size_t buffer_size = 16 << 20);
 	size_t segment(char *data, size_t size);
+	format_version version() const;
+	bool weighted() const;
+
+	static size_t write_header(file_writer &writer, format_version version, bool weighted = false);
+	static size_t read_tweet(utility::read_buffer &buffer, format_version version, int *user, std::vector<int> &words, bool weighted = false, int *weight = nullptr);
+	static size_t write_tweet(utility::write_buffer &buffer, format_version version, int user, const std::vector<int> &words);
+
+protected:
+	format_version _version;
+	bool _weighted;
 };
 
 class tweet_param_file_reader : public file_reader
 {
 public:
+	enum format_version
+	{
+		varint = 1, fixed = 2
+	};
+
 	tweet_param_file_reader(const char *path, size_t buffer_size = 16 << 20);
 	size_t segment(char *data, size_t size);
+	void set_word_count(int word_count);
+	format_version version() const;
+	int topic_size() const;
+
+	static format_version detect_version(const char *path);
+	static int get_topic_size(int topic_num);
+	static size_t write_header(file_writer &writer, format_version version, int topic_size);
+	static size_t read_topic(utility::read_buffer &buffer, format_version version, int topic_size, int word_count, int *topic);
+	static size_t write_topic(utility::write_buffer &buffer, format_version version, int topic_size, int word_count, int topic);
+
+protected:
+	format_version _version;
+	int _topic_size;
+	int _word_count;
 };
 
 class user_param_file_reader : public file_reader
@@ -103,14 +213,27 @@ public:
 	~topic_param_file_reader();
 	size_t segment(char *data, size_t size);
 	int word_num() const;
+
+	// indexed files start with the end offset of every row so rows can be decoded in parallel, empty for version 1
+	const std::vector<long long> &row_ends() const;
+	bool read_rows(std::vector<char> &rows);
+	static size_t write_header(FILE *fp, const std::vector<long long> &row_ends);
+
 protected:
 	int _word_num;
 	int *_temp_buffer;
+	std::vector<long long> _row_ends;
 };
 
 class tweet_id_file_reader : public file_reader
 {
 public:
-	tweet_id_file_reader(const char *path, size_t buffer_size = 16 << 20);
+	tweet_id_file_reader(const char *path, bool weighted = false, size_t buffer_size = 16 << 20);
 	size_t segment(char *data, size_t size);
+	bool weighted() const;
+
+	static size_t read_tweet_ids(utility::read_buffer &buffer, bool weighted, std::vector<long long> &tweet_ids);
+
+protected:
+	bool _weighted;
 };
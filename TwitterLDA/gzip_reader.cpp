@@ -0,0 +1,678 @@
+#include "gzip_reader.h"
+#include "utility.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// bits of deflate data least significant first, from memory or from a file read ahead in blocks
+class bit_input
+{
+public:
+	bit_input(const char *data, size_t size) : _fp(nullptr), _data(data), _size(size), _pos(0), _bit_buffer(0), _bit_count(0), _overrun(false)
+	{
+	}
+
+	bit_input(FILE *fp) : _fp(fp), _data(nullptr), _size(0), _pos(0), _bit_buffer(0), _bit_count(0), _overrun(false)
+	{
+		_buffer.resize(1 << 16);
+	}
+
+	unsigned int peek(int n)
+	{
+		_need(n);
+		return (unsigned int)(_bit_buffer & ((1ULL << n) - 1));
+	}
+
+	void drop(int n)
+	{
+		_bit_buffer >>= n;
+		_bit_count -= n;
+	}
+
+	unsigned int bits(int n)
+	{
+		unsigned int value = peek(n);
+		drop(n);
+		return value;
+	}
+
+	void align()
+	{
+		drop(_bit_count % 8);
+	}
+
+	// whole bytes after align, false at the end of the data
+	bool read_bytes(char *data, size_t size)
+	{
+		for (; size > 0 && _bit_count >= 8; --size) *data++ = (char)bits(8);
+		while (size > 0)
+		{
+			if (_pos == _size && !_fill()) return false;
+			size_t more = std::min(size, _size - _pos);
+			memcpy(data, _data + _pos, more);
+			_pos += more;
+			data += more;
+			size -= more;
+		}
+		return true;
+	}
+
+	// bits were wanted past the end of the data and read as zeros
+	bool overrun() const
+	{
+		return _overrun;
+	}
+
+private:
+	FILE *_fp;
+	std::vector<char> _buffer;
+	const char *_data;
+	size_t _size;
+	size_t _pos;
+	unsigned long long _bit_buffer;
+	int _bit_count;
+	bool _overrun;
+
+	void _need(int n)
+	{
+		while (_bit_count < n)
+		{
+			unsigned long long byte = 0;
+			if (_pos < _size || _fill()) byte = (unsigned char)_data[_pos++];
+			else _overrun = true;
+			_bit_buffer |= byte << _bit_count;
+			_bit_count += 8;
+		}
+	}
+
+	bool _fill()
+	{
+		if (_fp == nullptr) return false;
+		_size = fread(_buffer.data(), 1, _buffer.size(), _fp);
+		_pos = 0;
+		_data = _buffer.data();
+		return _size > 0;
+	}
+};
+
+static const int fast_bits = 10;
+
+// canonical code of deflate, codes up to fast_bits long are looked up by the next bits of the stream
+struct huffman_code
+{
+	short counts[16];
+	short symbols[288];
+	unsigned short fast[1 << fast_bits]; // symbol << 4 | length, 0 for longer codes
+};
+
+static bool build_huffman(huffman_code &code, const unsigned char *lengths, int n)
+{
+	memset(code.counts, 0, sizeof(code.counts));
+	memset(code.fast, 0, sizeof(code.fast));
+	for (int i = 0; i < n; ++i) ++code.counts[lengths[i]];
+	code.counts[0] = 0;
+
+	int left = 1;
+	for (int length = 1; length <= 15; ++length)
+	{
+		left = (left << 1) - code.counts[length];
+		if (left < 0) return false; // over-subscribed
+	}
+
+	short offsets[16];
+	offsets[1] = 0;
+	for (int length = 1; length < 15; ++length) offsets[length + 1] = offsets[length] + code.counts[length];
+	for (int i = 0; i < n; ++i)
+	{
+		if (lengths[i] != 0) code.symbols[offsets[lengths[i]]++] = (short)i;
+	}
+
+	// codes of a length are consecutive, the stream holds them bit reversed
+	int value = 0, index = 0;
+	for (int length = 1; length <= fast_bits; ++length)
+	{
+		for (int i = 0; i < code.counts[length]; ++i, ++value)
+		{
+			int reversed = 0;
+			for (int j = 0; j < length; ++j) reversed |= ((value >> j) & 1) << (length - 1 - j);
+			unsigned short entry = (unsigned short)(code.symbols[index + i] << 4 | length);
+			for (int j = reversed; j < (1 << fast_bits); j += 1 << length) code.fast[j] = entry;
+		}
+		index += code.counts[length];
+		value <<= 1;
+	}
+	return true;
+}
+
+// -1 for a code that is not in the table
+static int decode(bit_input &in, const huffman_code &code)
+{
+	unsigned short entry = code.fast[in.peek(fast_bits)];
+	if (entry != 0)
+	{
+		in.drop(entry & 15);
+		return entry >> 4;
+	}
+
+	int value = 0, first = 0, index = 0;
+	for (int length = 1; length <= 15; ++length)
+	{
+		value |= (int)in.bits(1);
+		int count = code.counts[length];
+		if (value - first < count) return code.symbols[index + value - first];
+		index += count;
+		first = (first + count) << 1;
+		value <<= 1;
+	}
+	return -1;
+}
+
+// the codes of deflate blocks of type 1
+struct fixed_huffman
+{
+	huffman_code lengths;
+	huffman_code distances;
+
+	fixed_huffman()
+	{
+		unsigned char code_lengths[288];
+		for (int i = 0; i < 288; ++i) code_lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+		build_huffman(lengths, code_lengths, 288);
+		std::fill(code_lengths, code_lengths + 30, 5);
+		build_huffman(distances, code_lengths, 30);
+	}
+};
+
+static const fixed_huffman fixed_codes;
+
+static const short length_bases[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extras[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short distance_bases[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short distance_extras[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+struct crc_table
+{
+	unsigned int values[256];
+
+	crc_table()
+	{
+		for (unsigned int i = 0; i < 256; ++i)
+		{
+			unsigned int c = i;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			values[i] = c;
+		}
+	}
+};
+
+static const crc_table crc32_table;
+
+static unsigned int update_crc(unsigned int crc, const char *data, size_t size)
+{
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) crc = crc32_table.values[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static unsigned int read_le32(const unsigned char *data)
+{
+	return (unsigned int)data[0] | (unsigned int)data[1] << 8 | (unsigned int)data[2] << 16 | (unsigned int)data[3] << 24;
+}
+
+static bool skip_string(bit_input &in, size_t *header_size)
+{
+	char c;
+	do
+	{
+		if (!in.read_bytes(&c, 1)) return false;
+		++*header_size;
+	} while (c != '\0');
+	return true;
+}
+
+// 1 for a member header, 0 at the end of the file or before trailing data that is not gzip, -1 for a broken header;
+// block_size is the size of the whole member in a block compressed file, 0 when it is not known
+static int read_member_header(bit_input &in, size_t *block_size, size_t *header_size)
+{
+	unsigned char header[10];
+	if (!in.read_bytes((char*)header, 2) || header[0] != 0x1f || header[1] != 0x8b) return 0;
+	if (!in.read_bytes((char*)header + 2, 8) || header[2] != 8) return -1;
+
+	int flags = header[3];
+	*header_size = 10;
+	*block_size = 0;
+	if (flags & 4)
+	{
+		unsigned char extra_size[2];
+		if (!in.read_bytes((char*)extra_size, 2)) return -1;
+		size_t size = extra_size[0] | extra_size[1] << 8;
+		std::vector<unsigned char> extra(size);
+		if (!in.read_bytes((char*)extra.data(), size)) return -1;
+		*header_size += 2 + size;
+
+		// subfield BC holds the member size - 1
+		for (size_t i = 0; i + 4 <= size; )
+		{
+			size_t field_size = extra[i + 2] | extra[i + 3] << 8;
+			if (extra[i] == 'B' && extra[i + 1] == 'C' && field_size == 2 && i + 6 <= size) *block_size = (extra[i + 4] | extra[i + 5] << 8) + 1;
+			i += 4 + field_size;
+		}
+	}
+	if ((flags & 8) && !skip_string(in, header_size)) return -1;
+	if ((flags & 16) && !skip_string(in, header_size)) return -1;
+	if (flags & 2)
+	{
+		char header_crc[2];
+		if (!in.read_bytes(header_crc, 2)) return -1;
+		*header_size += 2;
+	}
+	return 1;
+}
+
+const size_t gzip_reader::chunk_size;
+const size_t gzip_reader::window_size;
+const size_t gzip_reader::max_threads;
+const size_t gzip_reader::max_chunks;
+
+gzip_reader::gzip_reader(const char *path)
+{
+	_path = path;
+	_size = _scan_size(path);
+	_start();
+}
+
+gzip_reader::~gzip_reader()
+{
+	_stop();
+}
+
+bool gzip_reader::is_gzip(const char *header, size_t size)
+{
+	return size >= 2 && (unsigned char)header[0] == 0x1f && (unsigned char)header[1] == 0x8b;
+}
+
+bool gzip_reader::is_zstd(const char *header, size_t size)
+{
+	return size >= 4 && (unsigned char)header[0] == 0x28 && (unsigned char)header[1] == 0xb5 && (unsigned char)header[2] == 0x2f && (unsigned char)header[3] == 0xfd;
+}
+
+size_t gzip_reader::read(char *data, size_t size)
+{
+	size_t count = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (count < size)
+	{
+		while (!_failed && (_chunks.empty() ? !_scan_done : !_ready.front())) _chunk_cv.wait(lock);
+		if (_failed || _chunks.empty()) break;
+
+		std::vector<char> &chunk = _chunks.front();
+		size_t more = std::min(size - count, chunk.size() - _chunk_offset);
+		if (more > 0) memcpy(data + count, chunk.data() + _chunk_offset, more); // a member may decompress to nothing
+		count += more;
+		_chunk_offset += more;
+		if (_chunk_offset == chunk.size())
+		{
+			_chunks.pop_front();
+			_ready.pop_front();
+			++_chunk_base;
+			_chunk_offset = 0;
+			_space_cv.notify_one();
+		}
+	}
+	_position += count;
+	return count;
+}
+
+void gzip_reader::seek(long long position)
+{
+	if (position < _position)
+	{
+		_stop();
+		_start();
+	}
+
+	std::vector<char> skipped(chunk_size);
+	while (_position < position)
+	{
+		size_t more = (size_t)std::min((long long)chunk_size, position - _position);
+		if (read(skipped.data(), more) < more) break;
+	}
+}
+
+long long gzip_reader::size() const
+{
+	return _size;
+}
+
+void gzip_reader::_start()
+{
+	_position = 0;
+	_jobs.clear();
+	_chunks.clear();
+	_ready.clear();
+	_chunk_base = 0;
+	_next_seq = 0;
+	_chunk_offset = 0;
+	_exit = false;
+	_scan_done = false;
+	_failed = false;
+
+	size_t thread_num = std::max(std::min((size_t)std::thread::hardware_concurrency(), max_threads), (size_t)1);
+	_workers.resize(thread_num);
+	for (size_t i = 0; i < thread_num; ++i) _workers[i] = std::thread(&gzip_reader::_work, this);
+	_scanner = std::thread(&gzip_reader::_scan, this);
+}
+
+void gzip_reader::_stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_exit = true;
+		_job_cv.notify_all();
+		_space_cv.notify_all();
+	}
+	_scanner.join();
+	for (size_t i = 0; i < _workers.size(); ++i) _workers[i].join();
+	_workers.clear();
+}
+
+void gzip_reader::_scan()
+{
+	FILE *fp = fopen(_path.c_str(), "rb");
+	bit_input in(fp);
+	output out;
+	out.streamed = true;
+	bool is_valid = true;
+	while (true)
+	{
+		size_t block_size, header_size;
+		int state = read_member_header(in, &block_size, &header_size);
+		if (state <= 0)
+		{
+			is_valid = (state == 0);
+			break;
+		}
+
+		// members of known size are decompressed by the workers, in any order
+		if (block_size > 0)
+		{
+			std::vector<char> data(std::max(block_size, header_size) - header_size);
+			if (data.size() < 8 || !in.read_bytes(data.data(), data.size()))
+			{
+				is_valid = false;
+				break;
+			}
+			long long seq = _add_chunk(nullptr);
+			if (seq < 0) break;
+			std::unique_lock<std::mutex> lock(_mutex);
+			_jobs.emplace_back();
+			_jobs.back().seq = seq;
+			_jobs.back().data.swap(data);
+			_job_cv.notify_one();
+			continue;
+		}
+
+		out.data.resize(chunk_size + window_size);
+		out.size = 0;
+		out.crc = 0;
+		out.total = 0;
+		if (!_inflate(in, out) || !_finish_member(in, out))
+		{
+			is_valid = false;
+			break;
+		}
+	}
+	if (fp != nullptr) fclose(fp);
+	if (!is_valid) _fail();
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_scan_done = true;
+	_job_cv.notify_all();
+	_chunk_cv.notify_all();
+}
+
+void gzip_reader::_work()
+{
+	output out;
+	out.streamed = false;
+	while (true)
+	{
+		job j;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (_jobs.empty() && !_exit && !_scan_done) _job_cv.wait(lock);
+			if (_exit || _jobs.empty()) break;
+			j.seq = _jobs.front().seq;
+			j.data.swap(_jobs.front().data);
+			_jobs.pop_front();
+		}
+
+		bit_input in(j.data.data(), j.data.size());
+		out.data.resize(std::max(out.data.size(), (size_t)64 << 10));
+		out.size = 0;
+		if (!_inflate(in, out) || !_finish_member(in, out))
+		{
+			_fail();
+			break;
+		}
+		std::vector<char> data(out.data.begin(), out.data.begin() + out.size);
+		_set_chunk(j.seq, data);
+	}
+}
+
+void gzip_reader::_fail()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (!_failed && !_exit) printf("Corrupt gzip data in %s\n", _path.c_str());
+	_failed = true;
+	_chunk_cv.notify_all();
+}
+
+// waits for room in the chunks ahead of the reader, data is a finished chunk or nullptr to reserve one for a worker;
+// -1 when the threads are stopping
+long long gzip_reader::_add_chunk(std::vector<char> *data)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (_chunks.size() >= max_chunks && !_exit) _space_cv.wait(lock);
+	if (_exit) return -1;
+	_chunks.emplace_back();
+	_ready.push_back(data != nullptr);
+	if (data != nullptr)
+	{
+		_chunks.back().swap(*data);
+		_chunk_cv.notify_all();
+	}
+	return _next_seq++;
+}
+
+void gzip_reader::_set_chunk(long long seq, std::vector<char> &data)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	size_t index = (size_t)(seq - _chunk_base);
+	_chunks[index].swap(data);
+	_ready[index] = true;
+	_chunk_cv.notify_all();
+}
+
+bool gzip_reader::_inflate(bit_input &in, output &out)
+{
+	static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	bool is_last;
+	do
+	{
+		is_last = in.bits(1) != 0;
+		int type = in.bits(2);
+		if (type == 0)
+		{
+			in.align();
+			unsigned char header[4];
+			if (!in.read_bytes((char*)header, 4)) return false;
+			size_t length = header[0] | header[1] << 8;
+			if ((length ^ 0xffff) != (size_t)(header[2] | header[3] << 8)) return false;
+			while (length > 0)
+			{
+				size_t more = std::min(length, window_size);
+				if (!_make_room(out, more) || !in.read_bytes(out.data.data() + out.size, more)) return false;
+				out.size += more;
+				length -= more;
+			}
+		}
+		else if (type == 1)
+		{
+			if (!_inflate_codes(in, out, fixed_codes.lengths, fixed_codes.distances)) return false;
+		}
+		else if (type == 2)
+		{
+			int length_num = in.bits(5) + 257;
+			int distance_num = in.bits(5) + 1;
+			int code_num = in.bits(4) + 4;
+			if (length_num > 286 || distance_num > 30) return false;
+
+			unsigned char lengths[320] = { 0 };
+			for (int i = 0; i < code_num; ++i) lengths[order[i]] = (unsigned char)in.bits(3);
+			huffman_code code_lengths;
+			if (!build_huffman(code_lengths, lengths, 19)) return false;
+
+			// lengths of both codes, run length encoded across them
+			int n = 0;
+			while (n < length_num + distance_num)
+			{
+				int symbol = decode(in, code_lengths);
+				if (symbol < 0 || in.overrun()) return false;
+				if (symbol < 16)
+				{
+					lengths[n++] = (unsigned char)symbol;
+					continue;
+				}
+				unsigned char value = 0;
+				int repeat;
+				if (symbol == 16)
+				{
+					if (n == 0) return false;
+					value = lengths[n - 1];
+					repeat = 3 + in.bits(2);
+				}
+				else if (symbol == 17) repeat = 3 + in.bits(3);
+				else repeat = 11 + in.bits(7);
+				if (n + repeat > length_num + distance_num) return false;
+				while (repeat-- > 0) lengths[n++] = value;
+			}
+			if (lengths[256] == 0) return false;
+
+			huffman_code length_code, distance_code;
+			if (!build_huffman(length_code, lengths, length_num) || !build_huffman(distance_code, lengths + length_num, distance_num)) return false;
+			if (!_inflate_codes(in, out, length_code, distance_code)) return false;
+		}
+		else return false;
+	} while (!is_last);
+	return !in.overrun();
+}
+
+bool gzip_reader::_inflate_codes(bit_input &in, output &out, const huffman_code &lengths, const huffman_code &distances)
+{
+	while (!in.overrun())
+	{
+		int symbol = decode(in, lengths);
+		if (symbol < 256)
+		{
+			if (symbol < 0) return false;
+			if (out.size == out.data.size() && !_make_room(out, 1)) return false;
+			out.data[out.size++] = (char)symbol;
+			continue;
+		}
+		if (symbol == 256) return true;
+
+		symbol -= 257;
+		if (symbol >= 29) return false;
+		size_t length = length_bases[symbol] + in.bits(length_extras[symbol]);
+		int distance_symbol = decode(in, distances);
+		if (distance_symbol < 0 || distance_symbol >= 30) return false;
+		size_t distance = distance_bases[distance_symbol] + in.bits(distance_extras[distance_symbol]);
+		if (distance > out.size) return false;
+		if (out.size + length > out.data.size() && !_make_room(out, length)) return false;
+
+		// copies byte by byte, a match may overlap its own output
+		char *target = out.data.data() + out.size;
+		const char *source = target - distance;
+		for (size_t i = 0; i < length; ++i) target[i] = source[i];
+		out.size += length;
+	}
+	return false;
+}
+
+bool gzip_reader::_make_room(output &out, size_t size)
+{
+	if (out.size + size <= out.data.size()) return true;
+	if (out.streamed && out.size > window_size)
+	{
+		if (!_flush(out, window_size)) return false;
+		if (out.size + size <= out.data.size()) return true;
+	}
+	out.data.resize(std::max(out.data.size() * 2, out.size + size));
+	return true;
+}
+
+// hands over all but the last keep bytes as a chunk
+bool gzip_reader::_flush(output &out, size_t keep)
+{
+	size_t count = out.size - keep;
+	out.crc = update_crc(out.crc, out.data.data(), count);
+	out.total += count;
+	std::vector<char> chunk(out.data.begin(), out.data.begin() + count);
+	memmove(out.data.data(), out.data.data() + count, keep);
+	out.size = keep;
+	return _add_chunk(&chunk) >= 0;
+}
+
+bool gzip_reader::_finish_member(bit_input &in, output &out)
+{
+	if (out.streamed)
+	{
+		if (out.size > 0 && !_flush(out, 0)) return false;
+	}
+	else
+	{
+		out.crc = update_crc(0, out.data.data(), out.size);
+		out.total = out.size;
+	}
+
+	in.align();
+	unsigned char trailer[8];
+	if (!in.read_bytes((char*)trailer, 8)) return false;
+	return read_le32(trailer) == out.crc && read_le32(trailer + 4) == (unsigned int)out.total;
+}
+
+long long gzip_reader::_scan_size(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr) return 0;
+
+	// members written by bgzip carry their size as the only extra field
+	long long size = 0, offset = 0;
+	bool is_block = true;
+	while (true)
+	{
+		unsigned char header[18];
+		size_t count = fread(header, 1, sizeof(header), fp);
+		if (count == 0) break;
+		if (count < sizeof(header) || header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4) || header[12] != 'B' || header[13] != 'C')
+		{
+			is_block = false;
+			break;
+		}
+		long long block_size = (header[16] | header[17] << 8) + 1;
+		unsigned char trailer[4];
+		if (!utility::seek_file(fp, offset + block_size - 4) || fread(trailer, 1, 4, fp) != 4)
+		{
+			is_block = false;
+			break;
+		}
+		size += read_le32(trailer);
+		offset += block_size;
+	}
+
+	fclose(fp);
+
+	// a trailer only tells the size of its member modulo 2^32, so the size of any other file is unknown
+	return is_block ? size : -1;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+
+class bit_input;
+struct huffman_code;
+
+// Sequential reads of the text of a gzip file decompressed on background threads, the members of a block
+// compressed file (bgzip and other BGZF writers) are decompressed in parallel, any other gzip stream ahead by one thread
+class gzip_reader
+{
+public:
+	static const size_t chunk_size = 1 << 20; // output of a streamed member handed over at a time
+	static const size_t window_size = 32 << 10;
+	static const size_t max_threads = 8;
+	static const size_t max_chunks = 32; // decompressed ahead of the reader
+
+	gzip_reader(const char *path);
+	~gzip_reader();
+
+	static bool is_gzip(const char *header, size_t size);
+	static bool is_zstd(const char *header, size_t size);
+
+	size_t read(char *data, size_t size);
+
+	// positions are in decompressed text, seeking back starts over from the beginning of the file
+	void seek(long long position);
+
+	// decompressed size of block compressed files, -1 for other files whose size is only known once read
+	long long size() const;
+
+private:
+	// one member of a block compressed file, its output goes to chunk seq
+	struct job
+	{
+		long long seq;
+		std::vector<char> data;
+	};
+
+	// decoded bytes of a member, a streamed member hands over all but a window for back references when full
+	struct output
+	{
+		std::vector<char> data;
+		size_t size;
+		unsigned int crc;
+		long long total;
+		bool streamed;
+	};
+
+	std::string _path;
+	long long _size;
+	long long _position;
+
+	std::thread _scanner;
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _job_cv, _chunk_cv, _space_cv;
+	std::deque<job> _jobs;
+	std::deque<std::vector<char>> _chunks; // in file order, from chunk _chunk_base on
+	std::deque<bool> _ready;
+	long long _chunk_base;
+	long long _next_seq;
+	size_t _chunk_offset; // consumed bytes of the first chunk
+	bool _exit;
+	bool _scan_done;
+	bool _failed;
+
+	void _start();
+	void _stop();
+	void _scan();
+	void _work();
+	void _fail();
+	long long _add_chunk(std::vector<char> *data);
+	void _set_chunk(long long seq, std::vector<char> &data);
+
+	bool _inflate(bit_input &in, output &out);
+	bool _inflate_codes(bit_input &in, output &out, const huffman_code &lengths, const huffman_code &distances);
+	bool _make_room(output &out, size_t size);
+	bool _flush(output &out, size_t keep);
+	bool _finish_member(bit_input &in, output &out);
+
+	static long long _scan_size(const char *path);
+};
+
@@ -3,36 +3,54 @@
 #include <algorithm>
 #include <cstring>
 #include <chrono>
+#include <limits>
 #include "inference.h"
 #include "model.h"
 #include "parallel.h"
 #include "utility.h"
 #include "file_reader.h"
+#include "tweet_index.h"
 
-inference::inference(model &m, model::infer_mode mode, const char *word_path, size_t thread_num) : parallel(thread_num), _m(m)
+inference::inference(model &m, model::infer_mode mode, const char *word_path, const char *word_index_path, size_t thread_num) : parallel(thread_num), _m(m)
 {
 	_mode = mode;
-	text_file_reader reader(word_path);
-	while (true)
-	{
-		file_item item = reader.get_item(false);
-		if (item.size == 0) break;
-		char *ptr = strchr(item.data, '\t');
-		if (ptr != nullptr) *ptr = '\0';
-		char *word = utility::new_string(item.data);
-		_words.push_back(word);
-		_word_ids.insert(std::make_pair(word, (int)_word_ids.size()));
-	}
+
+	// in hashed mode only the exact top words are indexed, the bucket lines after them are labels
+	_hash_num = m.hash_num();
+	_exact_word_num = m.word_num() - _hash_num;
+	if (_hash_num > 0 && _exact_word_num == 0) return;
+	if (word_index_path != nullptr && _word_index.load(word_index_path)) return;
+
+	// buffers made before the binary index, build it from the word file
+	_word_index.build(word_path, (_hash_num > 0) ? _exact_word_num : -1);
 }
 
 inference::~inference()
 {
-	for (size_t i = 0; i < _words.size(); ++i) delete[] _words[i];
 }
 
-void inference::infer(const char *input_path, size_t batch_size, const char *output_path)
+void inference::infer(const char *input_path, const char *tweet_index_path, size_t batch_size, const char *output_path, long long start, long long count)
 {
 	text_file_reader reader(input_path, batch_size);
+
+	// skip to the first line, jumping by the tweet index when input is the buffer corpus
+	long long line = 0;
+	tweet_index index;
+	if (start > 0 && _m.same_text(input_path) && index.load(tweet_index_path) && !index.empty())
+	{
+		const tweet_index_item &item = index.item(index.find_tweet_id(start));
+		if (item.tweet_id <= start && item.text_offset < reader.size())
+		{
+			reader.seek(item.text_offset);
+			line = item.tweet_id;
+		}
+	}
+	for (; line < start; ++line)
+	{
+		if (reader.get_item(false).size == 0) break;
+	}
+	long long remain_count = (count < 0) ? std::numeric_limits<long long>::max() : count;
+
 	FILE *fp = fopen(output_path, "w");
 
 	auto start_time = std::chrono::high_resolution_clock::now();
@@ -40,12 +58,15 @@ void inference::infer(const char *input_path, size_t batch_size, const char *out
 	while (true)
 	{
 		_input_ptrs.clear();
+		_input_sizes.clear();
 		reader.trim();
-		while (true)
+		while (remain_count > 0)
 		{
 			file_item item = reader.get_item(!_input_ptrs.empty());
 			if (item.size == 0) break;
 			_input_ptrs.push_back(item.data);
+			_input_sizes.push_back(item.size);
+			--remain_count;
 		}
 
 		if (_input_ptrs.empty()) break;
@@ -63,7 +84,8 @@ void inference::infer(const char *input_path, size_t batch_size, const char *out
 		process_tweet_count += _input_ptrs.size();
 		auto end_time = std::chrono::high_resolution_clock::now();
 		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-		printf("\r%.2f%% progress  %.2fk tweet/sec  %.1f sec  ", reader.position() * 100.0 / reader.size(), (double)process_tweet_count / duration.count(), duration.count() * 0.001);
+		if (reader.size() > 0) printf("\r%.2f%% progress  %.2fk tweet/sec  %.1f sec  ", reader.position() * 100.0 / reader.size(), (double)process_tweet_count / duration.count(), duration.count() * 0.001);
+		else printf("\r%lld tweets  %.2fk tweet/sec  %.1f sec  ", process_tweet_count, (double)process_tweet_count / duration.count(), duration.count() * 0.001); // size of a gzip stream is unknown
 		fflush(stdout);
 	}
 	fclose(fp);
@@ -83,25 +105,21 @@ void inference::_infer(size_t start, size_t end)
 {
 	std::vector<int> words;
 	double *topic_probs = new double[_m.topic_num()];
+	utility::tokenizer tokenizer;
 	for (size_t i = start; i < end; ++i)
 	{
 		words.clear();
-		char *ptr = _input_ptrs[i];
-		char *p = strchr(ptr, '\t');
-		if (p != nullptr) ptr = p + 1;
-		while (true)
+		const char *text = _input_ptrs[i], *text_end = _input_ptrs[i] + _input_sizes[i];
+		const char *tab = (const char*)memchr(text, '\t', _input_sizes[i]);
+		if (tab != nullptr) text = tab + 1;
+		tokenizer.reset(text, text_end - text);
+		const char *token;
+		size_t size;
+		while (tokenizer.next(&token, &size))
 		{
-			p = strchr(ptr, ' ');
-			if (p != nullptr) *p = '\0';
-			auto iter = _word_ids.find(ptr);
-			if (iter != _word_ids.end()) words.push_back(iter->second);
-			if (p == nullptr)
-			{
-				ptr += strlen(ptr) + 1;
-				break;
-			}
-			*p = ' ';
-			ptr = p + 1;
+			int word = _word_index.find(token, size);
+			if (word >= 0) words.push_back(word);
+			else if (_hash_num > 0) words.push_back(_exact_word_num + (int)(utility::hash_bytes(token, size) % (unsigned long long)_hash_num));
 		}
 		int topic = _m.infer(words, _mode, topic_probs);
 		_output_topics[i] = topic;
@@ -4,23 +4,26 @@
 #include "model.h"
 #include "parallel.h"
 #include "utility.h"
+#include "vocab_index.h"
 
 class inference : public parallel
 {
 public:
-	inference(model &m, model::infer_mode mode, const char *word_path, size_t thread_num);
+	inference(model &m, model::infer_mode mode, const char *word_path, const char *word_index_path, size_t thread_num);
 	~inference();
 
-	void infer(const char *input_path, size_t batch_size, const char *output_path);
+	void infer(const char *input_path, const char *tweet_index_path, size_t batch_size, const char *output_path, long long start = 0, long long count = -1);
 
 private:
 	model &_m;
-	std::unordered_map<char*, int, utility::string_hasher, utility::string_predicate> _word_ids;
-	std::vector<char*> _words;
+	vocab_index _word_index;
 	std::vector<char*> _input_ptrs;
+	std::vector<size_t> _input_sizes;
 	std::vector<int> _output_topics;
 	std::vector<double> _output_probs;
 	model::infer_mode _mode;
+	int _hash_num;
+	int _exact_word_num;
 
 	void _update(size_t id);
 	void _infer(size_t start, size_t end);
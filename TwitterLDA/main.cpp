@@ -1,10 +1,15 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <vector>
 #include "file_reader.h"
 #include "utility.h"
 #include "model.h"
 #include "inference.h"
+#include "evaluator.h"
+#include "stream_trainer.h"
 #include "option.h"
 #include "parallel.h"
 
@@ -15,17 +20,322 @@ void make_buffer(option &opt)
 		opt.tweet_buffer_path, 
 		opt.user_path, 
 		opt.word_path, 
+		opt.word_index_path, 
 		opt.tweet_id_path, 
+		opt.tweet_index_path, 
 		opt.summary_path, 
 		opt.stopword_path, 
 		opt.min_user_freq, 
-		opt.min_word_freq);
+		opt.min_word_freq,
+		(tweet_file_reader::format_version)opt.buffer_version,
+		opt.shard_num,
+		opt.pass_num,
+		(size_t)opt.sketch_size << 20,
+		opt.hash_num,
+		opt.top_word_path,
+		(size_t)opt.sort_size << 20,
+		opt.dedup,
+		opt.thread_num);
+}
+
+void append_buffer(option &opt)
+{
+	std::vector<buffer_extent> extents;
+	int word_num = model::append_buffer(
+		opt.input_text_path, 
+		opt.tweet_buffer_path, 
+		opt.user_path, 
+		opt.word_path, 
+		opt.word_index_path, 
+		opt.tweet_id_path, 
+		opt.tweet_index_path, 
+		opt.summary_path, 
+		opt.stopword_path, 
+		opt.min_user_freq, 
+		opt.min_word_freq,
+		opt.extend,
+		extents,
+		opt.thread_num);
+	if (word_num < 0 || opt.input_param_path_prefix == nullptr) return;
+	if (opt.hyper_param_path == nullptr)
+	{
+		printf("Missing option --hyper-param\n");
+		return;
+	}
+
+	// parameters of the appended tweets are initialized in place, ready for train-cont
+	model m(opt.hyper_param_path, opt.thread_num);
+	m.load_topic_param(opt.input_topic_param_path);
+	m.append_param(extents, word_num, opt.tweet_buffer_path, opt.tweet_index_path, opt.input_user_param_path, opt.input_tweet_param_path, opt.input_param_index_path);
+	m.save_topic_param(opt.input_topic_param_path);
+	m.save_hyper_param(opt.hyper_param_path);
+}
+
+// whether the log-likelihoods or update ratios of the iterations so far meet the stop criterion
+static bool converged(const option &opt, const std::vector<double> &log_likelihoods, const std::vector<double> &update_ratios)
+{
+	size_t n = update_ratios.size();
+	if (n < (size_t)opt.stop_window + 1) return false;
+	if (opt.stop_when == option::stop_criterion::likelihood)
+	{
+		double prev = log_likelihoods[n - 1 - opt.stop_window];
+		return fabs(log_likelihoods[n - 1] - prev) < opt.stop_threshold * fabs(prev);
+	}
+	if (opt.stop_when == option::stop_criterion::update)
+	{
+		for (size_t i = n - opt.stop_window; i < n; ++i)
+		{
+			if (update_ratios[i] >= opt.stop_threshold) return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+// moves the parameter files of every shard of an iteration that turned out to be the last to their output paths
+static void move_param(const char *from, const char *to, int shard_num)
+{
+	for (int i = 0; i < std::max(shard_num, 1); ++i)
+	{
+		char *from_path = utility::shard_path(from, shard_num, i);
+		char *to_path = utility::shard_path(to, shard_num, i);
+		if (!utility::replace_file(from_path, to_path)) printf("Failed to move %s to %s\n", from_path, to_path);
+		delete[] from_path;
+		delete[] to_path;
+	}
+}
+
+// removes dead topics before the next iteration, the hyperparameters are saved with the topics left
+static void prune(const option &opt, model &m, const char *hyper_param_path)
+{
+	int topic_num = m.topic_num();
+	int pruned_num = m.prune_topics(opt.prune_threshold);
+	if (pruned_num == 0) return;
+	printf("Pruned %d of %d topics\n", pruned_num, topic_num);
+	m.save_hyper_param(hyper_param_path);
+}
+
+// a model of a group trained in one pass over the buffer, with its own hyperparameters and parameter files
+struct train_config
+{
+	char *hyper_param_path;
+	char *output_user_param_path, *output_tweet_param_path, *output_param_index_path, *output_topic_param_path;
+	char *user_param_paths[2], *tweet_param_paths[2], *param_index_paths[2];
+	int topic_num;
+	double alpha_m1, beta_m1, beta_bg_m1, gamma_m1;
+	model *m;
+	evaluator *e;
+	std::vector<double> log_likelihoods, update_ratios;
+	bool stopped;
+};
+
+static train_config *new_train_config(const char *output_param_path_prefix, const char *hyper_param_path, const option &opt)
+{
+	train_config *c = new train_config();
+	c->hyper_param_path = utility::new_string(hyper_param_path, "");
+	c->output_user_param_path = utility::new_string(output_param_path_prefix, ".user-param.bin");
+	c->output_tweet_param_path = utility::new_string(output_param_path_prefix, ".tweet-param.bin");
+	c->output_param_index_path = utility::new_string(output_param_path_prefix, ".param-index.bin");
+	c->output_topic_param_path = utility::new_string(output_param_path_prefix, ".topic-param.bin");
+	c->user_param_paths[0] = utility::new_string(output_param_path_prefix, ".user-param.temp0.bin");
+	c->user_param_paths[1] = utility::new_string(output_param_path_prefix, ".user-param.temp1.bin");
+	c->tweet_param_paths[0] = utility::new_string(output_param_path_prefix, ".tweet-param.temp0.bin");
+	c->tweet_param_paths[1] = utility::new_string(output_param_path_prefix, ".tweet-param.temp1.bin");
+	c->param_index_paths[0] = utility::new_string(output_param_path_prefix, ".param-index.temp0.bin");
+	c->param_index_paths[1] = utility::new_string(output_param_path_prefix, ".param-index.temp1.bin");
+	c->topic_num = opt.topic_num;
+	c->alpha_m1 = opt.alpha_m1;
+	c->beta_m1 = opt.beta_m1;
+	c->beta_bg_m1 = opt.beta_bg_m1;
+	c->gamma_m1 = opt.gamma_m1;
+	c->m = nullptr;
+	c->e = nullptr;
+	c->stopped = false;
+	return c;
+}
+
+static void delete_train_config(train_config *c)
+{
+	delete[] c->hyper_param_path;
+	delete[] c->output_user_param_path;
+	delete[] c->output_tweet_param_path;
+	delete[] c->output_param_index_path;
+	delete[] c->output_topic_param_path;
+	for (int i = 0; i < 2; ++i)
+	{
+		delete[] c->user_param_paths[i];
+		delete[] c->tweet_param_paths[i];
+		delete[] c->param_index_paths[i];
+	}
+	delete c->e;
+	delete c->m;
+	delete c;
+}
+
+// appends a config per line of the config file, lines starting with # are comments
+static bool load_train_configs(const option &opt, std::vector<train_config*> &configs)
+{
+	text_file_reader reader(opt.config_path);
+	while (true)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		const char *delimiters = " \t\r\n";
+		char *output_param_path_prefix = strtok(item.data, delimiters);
+		if (output_param_path_prefix == nullptr || output_param_path_prefix[0] == '#') continue;
+		char *hyper_param_path = strtok(nullptr, delimiters);
+		if (hyper_param_path == nullptr)
+		{
+			printf("Missing hyper-param of %s in config\n", output_param_path_prefix);
+			return false;
+		}
+
+		train_config *c = new_train_config(output_param_path_prefix, hyper_param_path, opt);
+		configs.push_back(c);
+		for (char *token = strtok(nullptr, delimiters); token != nullptr; token = strtok(nullptr, delimiters))
+		{
+			char *value = strchr(token, '=');
+			if (value == nullptr)
+			{
+				printf("Invalid config value %s\n", token);
+				return false;
+			}
+			*value++ = '\0';
+			if (strcmp(token, "topic") == 0) c->topic_num = atoi(value);
+			else if (strcmp(token, "alpha-m1") == 0) c->alpha_m1 = atof(value);
+			else if (strcmp(token, "beta-m1") == 0) c->beta_m1 = atof(value);
+			else if (strcmp(token, "beta-bg-m1") == 0) c->beta_bg_m1 = atof(value);
+			else if (strcmp(token, "gamma-m1") == 0) c->gamma_m1 = atof(value);
+			else
+			{
+				printf("Invalid config value %s\n", token);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// trains the model of the options and those of the config file together, the buffer is read and decoded once per
+// batch for all of them; models that meet the stop criterion leave the group
+static void train_group(option &opt)
+{
+	if (opt.param_version == tweet_param_file_reader::format_version::fixed)
+	{
+		printf("Training a group of models needs tweet param version 1\n");
+		return;
+	}
+	if (opt.checkpoint_path != nullptr) printf("Checkpoints are not written for a group of models\n");
+
+	std::vector<train_config*> configs;
+	configs.push_back(new_train_config(opt.output_param_path_prefix, opt.hyper_param_path, opt));
+	bool is_valid = load_train_configs(opt, configs);
+	for (size_t i = 0; i < configs.size() && is_valid; ++i)
+	{
+		train_config &c = *configs[i];
+		c.m = new model(opt.summary_path, c.topic_num, c.alpha_m1, c.beta_m1, c.beta_bg_m1, c.gamma_m1, opt.thread_num);
+		c.m->save_hyper_param(c.hyper_param_path);
+		if (opt.warm_topic_param_path != nullptr && !c.m->load_warm_topic_param(opt.warm_topic_param_path, (opt.warm_word_path != nullptr) ? opt.warm_word_path : opt.word_path, opt.word_path))
+		{
+			is_valid = false;
+			break;
+		}
+		c.m->init_param(opt.tweet_buffer_path, opt.tweet_index_path, c.user_param_paths[0], c.tweet_param_paths[0], c.param_index_paths[0], (tweet_param_file_reader::format_version)opt.param_version, opt.warm_topic_param_path != nullptr);
+		if (opt.held_out_path != nullptr)
+		{
+			c.e = new evaluator(*c.m, opt.word_path, opt.word_index_path, opt.user_path, opt.thread_num);
+			c.e->load(opt.held_out_path, opt.batch_size);
+		}
+	}
+
+	std::vector<model*> models;
+	std::vector<train_config*> active_configs;
+	std::vector<model::param_paths> paths;
+	std::vector<double> update_ratios, log_likelihoods;
+	for (int iter = 1; iter <= opt.iteration_num && is_valid; ++iter)
+	{
+		models.clear();
+		active_configs.clear();
+		paths.clear();
+		for (size_t i = 0; i < configs.size(); ++i)
+		{
+			train_config &c = *configs[i];
+			if (c.stopped) continue;
+			model::param_paths p;
+			p.input_user_path = c.user_param_paths[(iter - 1) % 2];
+			p.input_tweet_path = c.tweet_param_paths[(iter - 1) % 2];
+			bool is_last = iter == opt.iteration_num;
+			p.output_user_path = is_last ? c.output_user_param_path : c.user_param_paths[iter % 2];
+			p.output_tweet_path = is_last ? c.output_tweet_param_path : c.tweet_param_paths[iter % 2];
+			p.output_index_path = is_last ? c.output_param_index_path : c.param_index_paths[iter % 2];
+			models.push_back(c.m);
+			active_configs.push_back(&c);
+			paths.push_back(p);
+		}
+		if (models.empty()) break;
+
+		printf("Iteration %d\n", iter);
+		update_ratios.resize(models.size());
+		log_likelihoods.resize(models.size());
+		model::iterate(models, opt.tweet_buffer_path, opt.tweet_index_path, opt.batch_size, paths, update_ratios.data(), log_likelihoods.data());
+		for (size_t i = 0; i < active_configs.size(); ++i)
+		{
+			train_config &c = *active_configs[i];
+			const model::param_paths &p = paths[i];
+			c.log_likelihoods.push_back(log_likelihoods[i]);
+			c.update_ratios.push_back(update_ratios[i]);
+			printf("%s  %.4f update/word  %.4f log-likelihood/word\n", c.hyper_param_path, update_ratios[i], log_likelihoods[i]);
+			if (c.e != nullptr) c.e->perplexity(p.output_user_path, opt.fold_in);
+
+			if (iter < opt.iteration_num && converged(opt, c.log_likelihoods, c.update_ratios))
+			{
+				printf("Stopped %s after iteration %d of %d\n", c.hyper_param_path, iter, opt.iteration_num);
+				move_param(p.output_user_path, c.output_user_param_path, c.m->shard_num());
+				move_param(p.output_index_path, c.output_param_index_path, c.m->shard_num());
+				move_param(p.output_tweet_path, c.output_tweet_param_path, c.m->shard_num());
+				c.stopped = true;
+			}
+			else if (iter < opt.iteration_num && opt.prune_threshold > 0.0)
+			{
+				prune(opt, *c.m, c.hyper_param_path);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		if (is_valid) configs[i]->m->save_topic_param(configs[i]->output_topic_param_path);
+		delete_train_config(configs[i]);
+	}
 }
 
 void train(option &opt)
 {
+	if (opt.config_path != nullptr)
+	{
+		if (opt.input_param_path_prefix != nullptr) printf("A config trains new models, it cannot continue training\n");
+		else train_group(opt);
+		return;
+	}
+
 	model *m;
 
+	if (opt.input_param_path_prefix == nullptr)
+	{
+		m = new model(opt.summary_path, opt.topic_num, opt.alpha_m1, opt.beta_m1, opt.beta_bg_m1, opt.gamma_m1, opt.thread_num);
+		m->save_hyper_param(opt.hyper_param_path);
+		if (opt.warm_topic_param_path != nullptr && !m->load_warm_topic_param(opt.warm_topic_param_path, (opt.warm_word_path != nullptr) ? opt.warm_word_path : opt.word_path, opt.word_path))
+		{
+			delete m;
+			return;
+		}
+	}
+	else
+	{
+		m = new model(opt.hyper_param_path, opt.thread_num);
+		m->load_topic_param(opt.input_topic_param_path);
+	}
+
 	char *tweet_param_paths[2] =
 	{
 		utility::new_string(opt.output_param_path_prefix, ".tweet-param.temp0.bin"),
@@ -36,23 +346,69 @@ void train(option &opt)
 		utility::new_string(opt.output_param_path_prefix, ".user-param.temp0.bin"),
 		utility::new_string(opt.output_param_path_prefix, ".user-param.temp1.bin")
 	};
+	char *param_index_paths[2] =
+	{
+		utility::new_string(opt.output_param_path_prefix, ".param-index.temp0.bin"),
+		utility::new_string(opt.output_param_path_prefix, ".param-index.temp1.bin")
+	};
 
+	// fixed size tweet params are updated in place in the output file instead of alternating temporary files
+	bool in_place;
 	if (opt.input_param_path_prefix == nullptr)
 	{
-		m = new model(opt.summary_path, opt.topic_num, opt.alpha_m1, opt.beta_m1, opt.beta_bg_m1, opt.gamma_m1, opt.thread_num);
-		m->save_hyper_param(opt.hyper_param_path);
-		m->init_param(opt.tweet_buffer_path, user_param_paths[0], tweet_param_paths[0]);
+		in_place = opt.param_version == tweet_param_file_reader::format_version::fixed;
 	}
 	else
 	{
-		m = new model(opt.hyper_param_path, opt.thread_num);
-		m->load_topic_param(opt.input_topic_param_path);
+		char *input_tweet_param_path = utility::shard_path(opt.input_tweet_param_path, m->shard_num(), 0);
+		in_place = tweet_param_file_reader::detect_version(input_tweet_param_path) == tweet_param_file_reader::format_version::fixed;
+		delete[] input_tweet_param_path;
 	}
 
-	for (int iter = 1; iter <= opt.iteration_num; ++iter)
+	// pages of later batches rewritten in place may be newer than a checkpoint, so only alternating files are checkpointed
+	int start_iter = 1;
+	if (opt.checkpoint_path != nullptr && in_place)
+	{
+		printf("Checkpoints need tweet param version 1, not written\n");
+	}
+	else if (opt.checkpoint_path != nullptr)
+	{
+		m->set_checkpoint(opt.checkpoint_path, opt.checkpoint_interval);
+		start_iter = std::max(m->checkpoint_iteration(), 1);
+	}
+
+	// a run that ended after its last iteration but before saving the topic params saves them from the checkpoint
+	bool is_restored = start_iter <= opt.iteration_num || m->restore_finished_iteration();
+	if (!is_restored) printf("Checkpoint %s of the finished training not readable, outputs left as they are\n", opt.checkpoint_path);
+
+	if (opt.input_param_path_prefix == nullptr && m->checkpoint_iteration() == 0)
+	{
+		m->init_param(opt.tweet_buffer_path, opt.tweet_index_path, user_param_paths[0], in_place ? opt.output_tweet_param_path : tweet_param_paths[0], param_index_paths[0], (tweet_param_file_reader::format_version)opt.param_version, opt.warm_topic_param_path != nullptr);
+	}
+
+	// renumbered params must match the hyperparameters, so only a new model without checkpoints is pruned
+	double prune_threshold = opt.prune_threshold;
+	if (prune_threshold > 0.0 && (opt.input_param_path_prefix != nullptr || opt.checkpoint_path != nullptr))
+	{
+		printf("Topics are pruned only when training a new model without checkpoints\n");
+		prune_threshold = 0.0;
+	}
+
+	// held-out text is encoded once and scored with the parameters of every iteration
+	evaluator *e = nullptr;
+	if (opt.held_out_path != nullptr)
+	{
+		e = new evaluator(*m, opt.word_path, opt.word_index_path, opt.user_path, opt.thread_num);
+		e->load(opt.held_out_path, opt.batch_size);
+	}
+
+	// the first iteration leaves the initialization, it only serves as the start of a window
+	std::vector<double> log_likelihoods, update_ratios;
+	for (int iter = start_iter; iter <= opt.iteration_num; ++iter)
 	{
 		const char *input_user_param_path, *output_user_param_path;
 		const char *input_tweet_param_path, *output_tweet_param_path;
+		const char *output_param_index_path;
 		
 		if (iter == 1 && opt.input_param_path_prefix != nullptr)
 		{
@@ -69,26 +425,78 @@ void train(option &opt)
 		{
 			output_user_param_path = opt.output_user_param_path;
 			output_tweet_param_path = opt.output_tweet_param_path;
+			output_param_index_path = opt.output_param_index_path;
 		}
 		else
 		{
 			output_user_param_path = user_param_paths[iter % 2];
 			output_tweet_param_path = tweet_param_paths[iter % 2];
+			output_param_index_path = param_index_paths[iter % 2];
+		}
+
+		if (in_place)
+		{
+			if (iter > 1 || opt.input_param_path_prefix == nullptr) input_tweet_param_path = opt.output_tweet_param_path;
+			output_tweet_param_path = opt.output_tweet_param_path;
 		}
 
 		printf("Iteration %d\n", iter);
-		double update_ratio = m->iterate(opt.tweet_buffer_path, opt.batch_size, input_user_param_path, input_tweet_param_path, output_user_param_path, output_tweet_param_path);
+		double log_likelihood;
+		double update_ratio = m->iterate(opt.tweet_buffer_path, opt.tweet_index_path, opt.batch_size, input_user_param_path, input_tweet_param_path, output_user_param_path, output_tweet_param_path, output_param_index_path, &log_likelihood, iter);
+		log_likelihoods.push_back(log_likelihood);
+		update_ratios.push_back(update_ratio);
+		if (e != nullptr) e->perplexity(output_user_param_path, opt.fold_in);
+
+		if (iter < opt.iteration_num && converged(opt, log_likelihoods, update_ratios))
+		{
+			printf("Stopped after iteration %d of %d\n", iter, opt.iteration_num);
+			move_param(output_user_param_path, opt.output_user_param_path, m->shard_num());
+			move_param(output_param_index_path, opt.output_param_index_path, m->shard_num());
+			if (!in_place) move_param(output_tweet_param_path, opt.output_tweet_param_path, m->shard_num());
+			break;
+		}
+		if (iter < opt.iteration_num && prune_threshold > 0.0) prune(opt, *m, opt.hyper_param_path);
 	}
 
-	m->save_topic_param(opt.output_topic_param_path);
+	if (is_restored)
+	{
+		m->save_topic_param(opt.output_topic_param_path);
+		if (m->checkpoint_iteration() > 0) remove(opt.checkpoint_path);
+	}
 
 	delete[] tweet_param_paths[0];
 	delete[] tweet_param_paths[1];
 	delete[] user_param_paths[0];
 	delete[] user_param_paths[1];
+	delete[] param_index_paths[0];
+	delete[] param_index_paths[1];
+	delete e;
 	delete m;
 }
 
+void train_stream(option &opt)
+{
+	model m(opt.summary_path, opt.topic_num, opt.alpha_m1, opt.beta_m1, opt.beta_bg_m1, opt.gamma_m1, opt.thread_num);
+	m.save_hyper_param(opt.hyper_param_path);
+	if (opt.warm_topic_param_path != nullptr && !m.load_warm_topic_param(opt.warm_topic_param_path, (opt.warm_word_path != nullptr) ? opt.warm_word_path : opt.word_path, opt.word_path)) return;
+	stream_trainer trainer(m, opt.warm_topic_param_path != nullptr, opt.word_path, opt.word_index_path, opt.thread_num);
+	trainer.train(opt.input_text_path, opt.step_size, opt.window_size, opt.sweep_num, opt.snapshot_size, opt.output_topic_param_path);
+}
+
+void eval(option &opt)
+{
+	model m(opt.hyper_param_path, opt.thread_num);
+	m.load_topic_param(opt.input_topic_param_path);
+	evaluator e(m, opt.word_path, opt.word_index_path, opt.user_path, opt.thread_num);
+	e.load(opt.input_text_path, opt.batch_size);
+	double perplexity = e.perplexity(opt.input_user_param_path, opt.fold_in);
+	if (opt.output_text_path == nullptr) return;
+
+	FILE *fp = fopen(opt.output_text_path, "w");
+	fprintf(fp, "perplexity=%f\n", perplexity);
+	fclose(fp);
+}
+
 void dump_topic(option &opt)
 {
 	model m(opt.hyper_param_path, 0);
@@ -99,38 +507,45 @@ void dump_topic(option &opt)
 void dump_user(option &opt)
 {
 	model m(opt.hyper_param_path, 0);
-	m.save_user_topic_distribution_text(opt.input_user_param_path, opt.user_path, opt.output_text_path);
+	m.save_user_topic_distribution_text(opt.input_user_param_path, opt.user_path, opt.output_text_path, opt.batch_size);
 }
 
 void dump_tweet(option &opt)
 {
 	model m(opt.hyper_param_path, 0);
-	m.save_tweet_topic_text(opt.input_tweet_param_path, opt.input_text_path, opt.tweet_id_path, opt.output_text_path);
+	m.save_tweet_topic_text(opt.input_tweet_param_path, opt.input_param_index_path, opt.input_text_path, opt.tweet_buffer_path, opt.tweet_id_path, opt.tweet_index_path, opt.output_text_path, opt.start_line, opt.line_count, opt.batch_size);
 }
 
 void infer_prob(option &opt)
 {
 	model m(opt.hyper_param_path, 0);
 	m.load_topic_param(opt.input_topic_param_path);
-	inference infer(m, model::infer_mode::probability, opt.word_path, opt.thread_num);
-	infer.infer(opt.input_text_path, opt.batch_size, opt.output_text_path);
+	inference infer(m, model::infer_mode::probability, opt.word_path, opt.word_index_path, opt.thread_num);
+	char *tweet_index_path = m.sorted() ? nullptr : utility::shard_path(opt.tweet_index_path, m.shard_num(), 0); // any shard locates lines of the buffer text unless sorted by user
+	infer.infer(opt.input_text_path, tweet_index_path, opt.batch_size, opt.output_text_path, opt.start_line, opt.line_count);
+	delete[] tweet_index_path;
 }
 
 void infer_score(option &opt)
 {
 	model m(opt.hyper_param_path, 0);
 	m.load_topic_param(opt.input_topic_param_path);
-	inference infer(m, model::infer_mode::score, opt.word_path, opt.thread_num);
-	infer.infer(opt.input_text_path, opt.batch_size, opt.output_text_path);
+	inference infer(m, model::infer_mode::score, opt.word_path, opt.word_index_path, opt.thread_num);
+	char *tweet_index_path = m.sorted() ? nullptr : utility::shard_path(opt.tweet_index_path, m.shard_num(), 0); // any shard locates lines of the buffer text unless sorted by user
+	infer.infer(opt.input_text_path, tweet_index_path, opt.batch_size, opt.output_text_path, opt.start_line, opt.line_count);
+	delete[] tweet_index_path;
 }
 
 const void *command_table[][2] =
 {
 	{ "make-buffer", &make_buffer },
+	{ "append-buffer", &append_buffer },
 	{ "train", &train },
 	{ "train-cont", &train },
+	{ "train-stream", &train_stream },
 	{ "infer-prob", infer_prob },
 	{ "infer-score", infer_score },
+	{ "eval", &eval },
 	{ "dump-topic", &dump_topic },
 	{ "dump-user", &dump_user },
 	{ "dump-tweet", &dump_tweet },
@@ -145,6 +560,17 @@ int main(int argc, char *argv[])
 		opt.print_usage(opt.command);
 		return 1;
 	}
+	if (opt.input_text_path != nullptr && !text_file_reader::supported(opt.input_text_path))
+	{
+		printf("Unsupported compression of input %s, decompress it or recompress it with gzip or bgzip\n", opt.input_text_path);
+		return 1;
+	}
+	async_io::set_default_mode(opt.io_mode);
+	if (opt.delimiters != nullptr && !utility::tokenizer::set_default_delimiters(opt.delimiters))
+	{
+		printf("Invalid delimiters %s\n", opt.delimiters);
+		return 1;
+	}
 
 	for (int i = 0; command_table[i][0] != nullptr; ++i)
 	{
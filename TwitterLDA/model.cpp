@@ -1,8 +1,13 @@
 #include "model.h"
 #include "file_reader.h"
 #include "utility.h"
+#include "tweet_index.h"
+#include "buffer_builder.h"
+#include "external_sorter.h"
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <cmath>
 #include <cassert>
 #include <unordered_set>
 #include <unordered_map>
@@ -11,24 +16,80 @@
 #include <random>
 #include <vector>
 #include <chrono>
+#include <sstream>
+#include <string>
+
+static const char checkpoint_header[4] = { 'C', 'K', 'P', 2 };
 
 void model::_init()
 {
 	_topic_word_counts = utility::new_array<int>(_topic_num + 1, _word_num);
 	_total_word_counts = new long long[2];
 	_topic_all_word_counts = new long long[_topic_num + 1];
-
-	_tweet_read_buffers = new utility::read_buffer[_thread_num];
-	_tweet_param_read_buffers = new utility::read_buffer[_thread_num];
-	_tweet_param_write_buffers = new utility::write_buffer[_thread_num];
+	for (int i = 0; i <= _topic_num; ++i) std::fill(_topic_word_counts[i], _topic_word_counts[i] + _word_num, 0);
+	_sum_topic_word_counts();
+
+	_slice_num = 0;
+	_slice_shards = nullptr;
+	_slice_starts = nullptr;
+	_tweet_read_buffers = nullptr;
+	_tweet_param_read_buffers = nullptr;
+	_tweet_param_write_buffers = nullptr;
+	_slice_log_likelihoods = nullptr;
+	_decoded_slices = nullptr;
+	_init_slices(_thread_num);
 	_random_engines = new std::default_random_engine[_thread_num];
+	_reading = false;
+	_initializing = false;
+	_init_ranges = nullptr;
+	_tweet_version = tweet_file_reader::format_version::varint;
+	_tweet_weighted = false;
+	_tweet_param_version = tweet_param_file_reader::format_version::varint;
+	_tweet_param_topic_size = 0;
+	_checkpoint_path = nullptr;
+	_checkpoint_interval = 0.0;
+	_resume_iteration = 0;
+	_leader = nullptr;
+	_iteration = 0;
+	_encoding_topics = _decoding_topics = false;
+	_topic_row_buffers = nullptr;
+	_topic_rows = nullptr;
+	_topic_row_ends = nullptr;
+	_checkpointing = false;
+	_process_word_count = _update_word_count = 0;
+	_log_likelihood_sum = 0.0;
 }
 
+void model::_init_slices(size_t slice_num)
+{
+	if (slice_num == _slice_num) return;
+	delete[] _slice_shards;
+	delete[] _slice_starts;
+	delete[] _tweet_read_buffers;
+	delete[] _tweet_param_read_buffers;
+	delete[] _tweet_param_write_buffers;
+	delete[] _slice_log_likelihoods;
+	delete[] _decoded_slices;
+
+	_slice_num = slice_num;
+	_slice_shards = new shard*[slice_num];
+	_slice_starts = new size_t[slice_num];
+	_tweet_read_buffers = new utility::read_buffer[slice_num];
+	_tweet_param_read_buffers = new utility::read_buffer[slice_num];
+	_tweet_param_write_buffers = new utility::write_buffer[slice_num];
+	_slice_log_likelihoods = new double[slice_num];
+	_decoded_slices = new decoded_slice[slice_num];
+}
 
 model::model(int topic_num, int word_num, double alpha_m1, double beta_m1, double beta_bg_m1, double gamma_m1, size_t thread_num) : parallel(thread_num)
 {
 	_topic_num = topic_num;
 	_word_num = word_num;
+	_shard_num = 0;
+	_hash_num = 0;
+	_sorted = false;
+	_text_size = -1;
+	_text_hash = 0;
 
 	_alpha_m1 = alpha_m1;
 	_beta_m1 = beta_m1;
@@ -40,6 +101,11 @@ model::model(int topic_num, int word_num, double alpha_m1, double beta_m1, doubl
 
 model::model(const char *summary_path, int topic_num, double alpha_m1, double beta_m1, double beta_bg_m1, double gamma_m1, size_t thread_num) : parallel(thread_num)
 {
+	_shard_num = 0;
+	_hash_num = 0;
+	_sorted = false;
+	_text_size = -1;
+	_text_hash = 0;
 	load_hyper_param(summary_path);
 	_topic_num = topic_num;
 
@@ -53,22 +119,29 @@ model::model(const char *summary_path, int topic_num, double alpha_m1, double be
 
 model::model(const char *hyper_param_path, size_t thread_num) : parallel(thread_num)
 {
+	_shard_num = 0;
+	_hash_num = 0;
+	_sorted = false;
+	_text_size = -1;
+	_text_hash = 0;
 	load_hyper_param(hyper_param_path);
 	_init();
 }
 
 model::~model()
 {
+	delete[] _slice_shards;
+	delete[] _slice_starts;
 	delete[] _tweet_read_buffers;
 	delete[] _tweet_param_read_buffers;
 	delete[] _tweet_param_write_buffers;
+	delete[] _slice_log_likelihoods;
+	delete[] _decoded_slices;
 	delete[] _random_engines;
 
 	delete[] _topic_all_word_counts;
 	delete[] _total_word_counts;
 	utility::delete_array(_topic_word_counts);
-
-	for (size_t i = 0; i < _user_topic_counts.size(); ++i) delete[] _user_topic_counts[i];
 }
 
 int model::topic_num() const
@@ -81,90 +154,544 @@ int model::word_num() const
 	return _word_num;
 }
 
-void model::_update(size_t id)
+int model::shard_num() const
 {
-	_sample(_tweet_read_buffers[id], _tweet_param_read_buffers[id], _tweet_param_write_buffers[id], _random_engines[id]);
+	return _shard_num;
 }
 
-void model::init_param(const char *tweet_path, const char *user_param_path, const char *tweet_param_path, unsigned int rand_seed)
+int model::hash_num() const
 {
-	std::default_random_engine random_engine(rand_seed);
-	std::uniform_int_distribution<int> topic_distr(0, _topic_num - 1);
-	std::uniform_int_distribution<int> word_distr(0, 0xff);
+	return _hash_num;
+}
 
-	int *topic_counts = new int[_topic_num];
-	std::fill(topic_counts, topic_counts + _topic_num, 0);
-	for (int i = 0; i <= _topic_num; ++i)
+bool model::sorted() const
+{
+	return _sorted;
+}
+
+bool model::same_text(const char *text_path) const
+{
+	if (_text_hash == 0) return false; // buffers made before the fingerprint was kept
 	{
-		std::fill(_topic_word_counts[i], _topic_word_counts[i] + _word_num, 0);
+		text_file_reader reader(text_path, 1 << 16);
+		if (reader.size() != _text_size) return false;
 	}
-	_total_word_counts[0] = _total_word_counts[1] = 0;
-	std::fill(_topic_all_word_counts, _topic_all_word_counts + _topic_num + 1, 0);
+	return text_file_reader::fingerprint(text_path) == _text_hash;
+}
 
-	tweet_file_reader tweet_reader(tweet_path);
+void model::_update(size_t id)
+{
+	if (_initializing)
+	{
+		_init_range(_init_ranges[id]);
+		return;
+	}
 
-	utility::write_buffer user_param_buffer, tweet_param_buffer;
-	int user = -1;
-	FILE *fp_user_param = fopen(user_param_path, "wb");
-	FILE *fp_tweet_param = fopen(tweet_param_path, "wb");
-	while (true)
+	if (_encoding_topics)
+	{
+		_encode_topic_rows(id, _thread_num);
+		return;
+	}
+
+	if (_decoding_topics)
+	{
+		_decode_topic_rows(id, _thread_num);
+		return;
+	}
+
+	if (_reading)
+	{
+		// each shard is read by one thread with its own readers
+		for (size_t i = id; i < _shards.size(); i += _thread_num) _read_batch(*_shards[i], (_leader == nullptr) ? nullptr : _leader->_shards[i]);
+		return;
+	}
+
+	for (size_t i = id; i < _slice_num; i += _thread_num)
+	{
+		// the leader of models trained together decodes the tweets for all of them
+		if (_leader == nullptr) _decode_slice(i);
+		const decoded_slice &slice = (_leader == nullptr) ? _decoded_slices[i] : _leader->_decoded_slices[i];
+		_sample(*_slice_shards[i], _slice_starts[i], slice, _tweet_param_read_buffers[i], _tweet_param_write_buffers[i], _random_engines[id], _slice_log_likelihoods[i]);
+	}
+}
+
+void model::init_param(const char *tweet_path, const char *tweet_index_path, const char *user_param_path, const char *tweet_param_path, const char *param_index_path, tweet_param_file_reader::format_version tweet_param_version, bool warm, unsigned int rand_seed)
+{
+	if (!warm)
+	{
+		for (int i = 0; i <= _topic_num; ++i)
+		{
+			std::fill(_topic_word_counts[i], _topic_word_counts[i] + _word_num, 0);
+		}
+	}
+
+	// the first thread counts into the model, the others keep the counts of a round to be added after it;
+	// a warm start reads the loaded counts throughout, so all threads keep theirs for new counts replacing them at the end
+	int **init_counts = _topic_word_counts;
+	if (warm)
+	{
+		init_counts = utility::new_array<int>(_topic_num + 1, _word_num);
+		for (int i = 0; i <= _topic_num; ++i) std::fill(init_counts[i], init_counts[i] + _word_num, 0);
+	}
+	_init_ranges = new init_range[_thread_num];
+	for (size_t i = 0; i < _thread_num; ++i)
 	{
-		file_item item = tweet_reader.get_item(false);
-		utility::read_buffer tweet_buffer(item.data, item.size);
-		int curr_user;
-		if (item.size == 0 || tweet_buffer.read_varint(&curr_user) == 0 || curr_user != user)
+		init_range &range = _init_ranges[i];
+		range.rand_seed = rand_seed;
+		range.warm = warm;
+		range.topic_word_counts = (i == 0 && !warm) ? _topic_word_counts : nullptr;
+	}
+	_tweet_param_version = tweet_param_version;
+	_tweet_param_topic_size = tweet_param_file_reader::get_topic_size(_topic_num);
+
+	for (int shard = 0; shard < std::max(_shard_num, 1); ++shard)
+	{
+		char *paths[5] =
+		{
+			utility::shard_path(tweet_path, _shard_num, shard),
+			utility::shard_path(tweet_index_path, _shard_num, shard),
+			utility::shard_path(user_param_path, _shard_num, shard),
+			utility::shard_path(tweet_param_path, _shard_num, shard),
+			utility::shard_path(param_index_path, _shard_num, shard)
+		};
+
+		tweet_index index;
+		index.load(paths[1]);
+		param_index_writer index_writer(index);
+		for (size_t i = 0; i < _thread_num; ++i)
+		{
+			_init_ranges[i].tweet_reader = new tweet_file_reader(paths[0], 1 << 20);
+			_init_ranges[i].index = &index;
+			_init_ranges[i].shard = shard;
+		}
+
+		file_writer user_param_writer(paths[2]);
+		file_writer tweet_param_writer(paths[3]);
+		long long user_param_size = 0, tweet_param_offset = tweet_param_file_reader::write_header(tweet_param_writer, tweet_param_version, _tweet_param_topic_size);
+
+		// every round, each thread initializes the next few blocks, which are written in order afterwards
+		size_t block_num = std::max(index.size(), (size_t)1);
+		_initializing = true;
+		for (size_t block = 0; block < block_num; block = std::min(block + _thread_num * init_round_blocks, block_num))
 		{
-			// got new user, write parameters of the previous user
-			if (user >= 0)
+			for (size_t i = 0; i < _thread_num; ++i)
 			{
-				user_param_buffer.clear();
-				user_param_buffer.write_varint(user);
-				user_param_buffer.write_sparse_array(topic_counts, _topic_num, 0);
-				utility::fwrite(user_param_buffer.buffer(), user_param_buffer.size(), fp_user_param);
+				_init_ranges[i].start_block = std::min(block + i * init_round_blocks, block_num);
+				_init_ranges[i].end_block = std::min(block + (i + 1) * init_round_blocks, block_num);
 			}
-			if (item.size > 0)
+			parallel::_update();
+
+			for (size_t i = 0; i < _thread_num; ++i)
 			{
-				user = curr_user;
-				std::fill(topic_counts, topic_counts + _topic_num, 0);
+				init_range &range = _init_ranges[i];
+				for (size_t j = 0; j < range.count_deltas.size(); ++j)
+				{
+					const count_delta &delta = range.count_deltas[j];
+					init_counts[delta.topic][delta.word] += delta.count;
+				}
+				user_param_writer.write(range.user_param_buffer.buffer(), range.user_param_buffer.size());
+				for (size_t j = 0; j < range.user_param_sizes.size(); ++j)
+				{
+					index_writer.add_user(user_param_size);
+					user_param_size += range.user_param_sizes[j];
+				}
+				tweet_param_writer.write(range.tweet_param_buffer.buffer(), range.tweet_param_buffer.size());
+				for (size_t j = 0; j < range.tweet_param_sizes.size(); ++j)
+				{
+					index_writer.add_tweet(tweet_param_offset);
+					tweet_param_offset += range.tweet_param_sizes[j];
+				}
 			}
 		}
-		if (item.size == 0) break;
+		_initializing = false;
+		user_param_writer.close();
+		tweet_param_writer.close();
+		index_writer.save(paths[4]);
 
-		// initialize topic
-		int topic = topic_distr(random_engine);
-		++topic_counts[topic];
-		tweet_param_buffer.clear();
-		tweet_param_buffer.write_varint(topic);
+		for (size_t i = 0; i < _thread_num; ++i) delete _init_ranges[i].tweet_reader;
+		for (int i = 0; i < 5; ++i) delete[] paths[i];
+	}
 
-		// initialize words
-		int word_count;
-		tweet_buffer.read_varint(&word_count);
-		tweet_param_buffer.write_varint(word_count);
+	if (warm)
+	{
+		utility::delete_array(_topic_word_counts);
+		_topic_word_counts = init_counts;
+	}
+	delete[] _init_ranges;
+	_init_ranges = nullptr;
+	_sum_topic_word_counts();
+}
 
-		for (int i = 0; i < word_count; i += 8)
+void model::_init_range(init_range &range)
+{
+	range.user_param_buffer.clear();
+	range.tweet_param_buffer.clear();
+	range.user_param_sizes.clear();
+	range.tweet_param_sizes.clear();
+	range.count_deltas.clear();
+	if (range.start_block >= range.end_block) return;
+
+	const tweet_index &index = *range.index;
+	tweet_file_reader &tweet_reader = *range.tweet_reader;
+	tweet_reader.seek(index.empty() ? (long long)tweet_reader.header_size() : index.item(range.start_block).tweet_offset);
+
+	std::vector<int> words;
+	int *topic_counts = new int[_topic_num];
+	for (size_t block = range.start_block; block < range.end_block; ++block)
+	{
+		// blocks start at user boundaries and are seeded by position, so params do not depend on the number of threads
+		std::seed_seq seed = { range.rand_seed, (unsigned int)range.shard, (unsigned int)block };
+		std::default_random_engine random_engine(seed);
+		long long tweet_count = (block + 1 < index.size()) ? index.item(block).tweet_count : std::numeric_limits<long long>::max();
+
+		int user = -1;
+		for (long long tweet = 0; ; ++tweet)
 		{
-			char value = word_distr(random_engine);
-			if (i + 8 > word_count) value &= (1 << (word_count - i)) - 1;
-			tweet_param_buffer.write(value);
-			for (int j = 0; j < 8 && i + j < word_count; ++j)
+			file_item item = { nullptr, 0 };
+			if (tweet < tweet_count) item = tweet_reader.get_item(false);
+			utility::read_buffer tweet_buffer(item.data, item.size);
+			int curr_user, weight;
+			if (item.size == 0 || tweet_file_reader::read_tweet(tweet_buffer, tweet_reader.version(), &curr_user, words, tweet_reader.weighted(), &weight) == 0 || curr_user != user)
+			{
+				// got new user, write parameters of the previous user
+				if (user >= 0)
+				{
+					size_t start = range.user_param_buffer.size();
+					range.user_param_buffer.write_varint(user);
+					range.user_param_buffer.write_sparse_array(topic_counts, _topic_num, 0);
+					range.user_param_sizes.push_back(range.user_param_buffer.size() - start);
+				}
+				if (item.size > 0)
+				{
+					user = curr_user;
+					std::fill(topic_counts, topic_counts + _topic_num, 0);
+				}
+			}
+			if (item.size == 0) break;
+
+			size_t start = range.tweet_param_buffer.size();
+			int topic = (range.warm && !words.empty()) ? infer(words, infer_mode::probability) : -1;
+			topic_counts[_init_tweet(words, weight, topic, range.topic_word_counts, &range.count_deltas, range.tweet_param_buffer, _tweet_param_version, _tweet_param_topic_size, random_engine)] += weight;
+			range.tweet_param_sizes.push_back(range.tweet_param_buffer.size() - start);
+		}
+	}
+	delete[] topic_counts;
+}
+
+void model::append_param(const std::vector<buffer_extent> &extents, int word_num, const char *tweet_path, const char *tweet_index_path, const char *user_param_path, const char *tweet_param_path, const char *param_index_path, unsigned int rand_seed)
+{
+	if (extents.size() != (size_t)std::max(_shard_num, 1))
+	{
+		printf("Hyperparameter file not match buffer shards\n");
+		return;
+	}
+	std::default_random_engine random_engine(rand_seed);
+	_resize_words(word_num);
+
+	int *topic_counts = new int[_topic_num];
+	for (int shard = 0; shard < std::max(_shard_num, 1); ++shard)
+	{
+		const buffer_extent &extent = extents[shard];
+		char *paths[5] =
+		{
+			utility::shard_path(tweet_path, _shard_num, shard),
+			utility::shard_path(tweet_index_path, _shard_num, shard),
+			utility::shard_path(user_param_path, _shard_num, shard),
+			utility::shard_path(tweet_param_path, _shard_num, shard),
+			utility::shard_path(param_index_path, _shard_num, shard)
+		};
+
+		// new tweets start after the extent of the shard before appending
+		tweet_file_reader tweet_reader(paths[0]);
+		tweet_reader.seek(extent.buffer_size);
+		tweet_index index;
+		index.load(paths[1]);
+		param_index_writer index_writer(index);
+		if (!index_writer.resume(paths[4], extent.tweet_count, extent.user_record_count))
+		{
+			printf("Parameter index file not match, skip appending parameters of %s\n", paths[2]);
+			for (int i = 0; i < 5; ++i) delete[] paths[i];
+			continue;
+		}
+
+		tweet_param_file_reader::format_version tweet_param_version;
+		int topic_size;
+		long long user_param_size, tweet_param_offset;
+		{
+			tweet_param_file_reader tweet_param_reader(paths[3]);
+			tweet_param_version = tweet_param_reader.version();
+			topic_size = tweet_param_reader.topic_size();
+			tweet_param_offset = tweet_param_reader.size();
+		}
+
+		// the first new tweet may continue the last run, whose record is then rewritten with the new counts
+		int user = -1;
+		bool continued = false;
+		std::fill(topic_counts, topic_counts + _topic_num, 0);
+		{
+			user_param_file_reader user_param_reader(paths[2], _topic_num);
+			user_param_size = user_param_reader.size();
+			file_item item = tweet_reader.get_item(false);
+			utility::read_buffer tweet_buffer(item.data, item.size);
+			std::vector<int> words;
+			int first_user;
+			if (item.size > 0 && extent.last_user >= 0 && tweet_file_reader::read_tweet(tweet_buffer, tweet_reader.version(), &first_user, words, tweet_reader.weighted()) > 0 && first_user == extent.last_user)
+			{
+				long long record_offset = index_writer.last_user_param_offset();
+				user_param_reader.seek(record_offset);
+				while (true)
+				{
+					file_item user_param_item = user_param_reader.get_item(false);
+					if (user_param_item.size == 0) break;
+					utility::read_buffer user_param_buffer(user_param_item.data, user_param_item.size);
+					user_param_buffer.read_varint(&user);
+					std::fill(topic_counts, topic_counts + _topic_num, 0);
+					user_param_buffer.read_sparse_array(topic_counts, _topic_num);
+					user_param_size = record_offset;
+					record_offset += user_param_item.size;
+				}
+				assert((user == extent.last_user) && "User param file not aligned");
+				continued = true;
+			}
+		}
+		tweet_reader.seek(extent.buffer_size);
+
+		utility::write_buffer user_param_buffer, tweet_param_buffer;
+		std::vector<int> words;
+		file_writer user_param_writer(paths[2], true);
+		file_writer tweet_param_writer(paths[3], true);
+		user_param_writer.seek(user_param_size);
+		tweet_param_writer.seek(tweet_param_offset);
+		while (true)
+		{
+			file_item item = tweet_reader.get_item(false);
+			utility::read_buffer tweet_buffer(item.data, item.size);
+			int curr_user, weight;
+			if (item.size == 0 || tweet_file_reader::read_tweet(tweet_buffer, tweet_reader.version(), &curr_user, words, tweet_reader.weighted(), &weight) == 0 || curr_user != user)
 			{
-				int word;
-				tweet_buffer.read_varint(&word);
-				if (value & (1 << j))
+				if (user >= 0)
 				{
-					_inc_topic_word_count(topic, word);
+					user_param_buffer.clear();
+					user_param_buffer.write_varint(user);
+					user_param_buffer.write_sparse_array(topic_counts, _topic_num, 0);
+					user_param_writer.write(user_param_buffer.buffer(), user_param_buffer.size());
+					if (!continued) index_writer.add_user(user_param_size);
+					user_param_size += user_param_buffer.size();
+					continued = false;
 				}
-				else
+				if (item.size > 0)
 				{
-					_inc_topic_word_count(_topic_num, word);
+					user = curr_user;
+					std::fill(topic_counts, topic_counts + _topic_num, 0);
 				}
 			}
+			if (item.size == 0) break;
+
+			tweet_param_buffer.clear();
+			topic_counts[_init_tweet(words, weight, -1, _topic_word_counts, nullptr, tweet_param_buffer, tweet_param_version, topic_size, random_engine)] += weight;
+			tweet_param_writer.write(tweet_param_buffer.buffer(), tweet_param_buffer.size());
+			index_writer.add_tweet(tweet_param_offset);
+			tweet_param_offset += tweet_param_buffer.size();
+		}
+		user_param_writer.close();
+		tweet_param_writer.close();
+		index_writer.save(paths[4]);
+
+		for (int i = 0; i < 5; ++i) delete[] paths[i];
+	}
+	delete[] topic_counts;
+	_sum_topic_word_counts();
+}
+
+int model::_init_tweet(const std::vector<int> &words, int weight, int topic, int **topic_word_counts, std::vector<count_delta> *count_deltas, utility::write_buffer &tweet_param_buffer, tweet_param_file_reader::format_version tweet_param_version, int topic_size, std::default_random_engine &random_engine)
+{
+	std::uniform_int_distribution<int> topic_distr(0, _topic_num - 1);
+	std::uniform_int_distribution<int> word_distr(0, 0xff);
+	std::uniform_real_distribution<double> uniform_distr(0.0, 1.0);
+
+	// initialize topic, a given topic was inferred from the loaded counts, which then tag words as in sampling
+	bool warm = topic >= 0;
+	if (!warm) topic = topic_distr(random_engine);
+	int word_count = (int)words.size();
+	tweet_param_file_reader::write_topic(tweet_param_buffer, tweet_param_version, topic_size, word_count, topic);
+
+	// initialize words
+	for (int i = 0; i < word_count; i += 8)
+	{
+		char value = 0;
+		if (!warm)
+		{
+			value = word_distr(random_engine);
+			if (i + 8 > word_count) value &= (1 << (word_count - i)) - 1;
+		}
+		for (int j = 0; warm && j < 8 && i + j < word_count; ++j)
+		{
+			int word = words[i + j];
+			double pi0 = _total_word_counts[0] + _gamma_m1;
+			double pi1 = _total_word_counts[1] + _gamma_m1;
+			double phi0 = (_topic_word_counts[_topic_num][word] + _beta_bg_m1) / (_topic_all_word_counts[_topic_num] + _beta_bg_m1 * _word_num);
+			double phi1 = (_topic_word_counts[topic][word] + _beta_m1) / (_topic_all_word_counts[topic] + _beta_m1 * _word_num);
+			if (uniform_distr(random_engine) * (pi0 * phi0 + pi1 * phi1) > pi0 * phi0) value |= 1 << j;
+		}
+		tweet_param_buffer.write(value);
+		for (int j = 0; j < 8 && i + j < word_count; ++j)
+		{
+			int word = words[i + j];
+			int word_topic = (value & (1 << j)) ? topic : _topic_num;
+			if (topic_word_counts != nullptr)
+			{
+				topic_word_counts[word_topic][word] += weight;
+			}
+			else
+			{
+				count_delta delta = { word_topic, word, weight };
+				count_deltas->push_back(delta);
+			}
+		}
+	}
+	return topic;
+}
+
+void model::_resize_words(int word_num)
+{
+	// appended words take ids after the existing ones, their counts start at zero
+	if (word_num == _word_num) return;
+	int **topic_word_counts = utility::new_array<int>(_topic_num + 1, word_num);
+	for (int i = 0; i <= _topic_num; ++i)
+	{
+		std::fill(topic_word_counts[i], topic_word_counts[i] + word_num, 0);
+		std::copy(_topic_word_counts[i], _topic_word_counts[i] + std::min(_word_num, word_num), topic_word_counts[i]);
+	}
+	utility::delete_array(_topic_word_counts);
+	_topic_word_counts = topic_word_counts;
+	_word_num = word_num;
+}
+
+bool model::load_warm_topic_param(const char *topic_param_path, const char *warm_word_path, const char *word_path)
+{
+	// words of the previous model are mapped to the current vocabulary by string, words new to it start at zero
+	utility::string_pool words;
+	std::unordered_map<char*, int, utility::string_hasher, utility::string_predicate> word_ids;
+	text_file_reader word_reader(word_path);
+	while (true)
+	{
+		file_item item = word_reader.get_item(false);
+		if (item.size == 0) break;
+		char *ptr = strchr(item.data, '\t');
+		if (ptr != nullptr) *ptr = '\0';
+		word_ids.insert(std::make_pair(words.add(item.data), (int)word_ids.size()));
+	}
+	if ((int)word_ids.size() != _word_num)
+	{
+		printf("Invalid word file\n");
+		return false;
+	}
+
+	std::vector<int> word_map;
+	text_file_reader warm_word_reader(warm_word_path);
+	while (true)
+	{
+		file_item item = warm_word_reader.get_item(false);
+		if (item.size == 0) break;
+		char *ptr = strchr(item.data, '\t');
+		if (ptr != nullptr) *ptr = '\0';
+		auto word_itor = word_ids.find(item.data);
+		word_map.push_back((word_itor != word_ids.end()) ? word_itor->second : -1);
+	}
+
+	int warm_word_num = (int)word_map.size();
+	int *counts = new int[std::max(warm_word_num, 1)];
+	topic_param_file_reader reader(topic_param_path, warm_word_num);
+	int topic = 0;
+	for (; ; ++topic)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		if (topic > _topic_num) continue;
+		std::fill(counts, counts + warm_word_num, 0);
+		utility::read_buffer buffer(item.data, item.size);
+		buffer.read_sparse_array(counts, warm_word_num);
+		std::fill(_topic_word_counts[topic], _topic_word_counts[topic] + _word_num, 0);
+		for (int i = 0; i < warm_word_num; ++i)
+		{
+			if (word_map[i] >= 0) _topic_word_counts[topic][word_map[i]] = counts[i];
 		}
+	}
+	delete[] counts;
+	if (topic != _topic_num + 1)
+	{
+		printf("Warm start model has %d topics, not %d\n", topic - 1, _topic_num);
+		return false;
+	}
+	_sum_topic_word_counts();
+	return true;
+}
 
-		utility::fwrite(tweet_param_buffer.buffer(), tweet_param_buffer.size(), fp_tweet_param);
+void model::_sum_topic_word_counts()
+{
+	_total_word_counts[0] = _total_word_counts[1] = 0;
+	for (int i = 0; i <= _topic_num; ++i)
+	{
+		long long sum = 0;
+		for (int j = 0; j < _word_num; ++j) sum += _topic_word_counts[i][j];
+		_topic_all_word_counts[i] = sum;
+		_total_word_counts[(i < _topic_num) ? 1 : 0] += sum;
+	}
+}
+
+int model::prune_topics(double threshold)
+{
+	// topics below threshold times the mean topic word count go, the largest one always stays
+	double min_count = threshold * _total_word_counts[1] / _topic_num;
+	int largest_topic = (int)(std::max_element(_topic_all_word_counts, _topic_all_word_counts + _topic_num) - _topic_all_word_counts);
+	std::vector<int> topic_map(_topic_num);
+	int topic_num = 0;
+	for (int i = 0; i < _topic_num; ++i)
+	{
+		topic_map[i] = (_topic_all_word_counts[i] >= min_count || i == largest_topic) ? topic_num++ : -1;
+	}
+	if (topic_num == _topic_num) return 0;
+
+	// words of pruned topics join the background until the next iteration moves their tweets
+	int **topic_word_counts = utility::new_array<int>(topic_num + 1, _word_num);
+	long long *topic_all_word_counts = new long long[topic_num + 1];
+	std::copy(_topic_word_counts[_topic_num], _topic_word_counts[_topic_num] + _word_num, topic_word_counts[topic_num]);
+	topic_all_word_counts[topic_num] = _topic_all_word_counts[_topic_num];
+	for (int i = 0; i < _topic_num; ++i)
+	{
+		int topic = topic_map[i];
+		if (topic >= 0)
+		{
+			std::copy(_topic_word_counts[i], _topic_word_counts[i] + _word_num, topic_word_counts[topic]);
+			topic_all_word_counts[topic] = _topic_all_word_counts[i];
+			continue;
+		}
+		for (int j = 0; j < _word_num; ++j) topic_word_counts[topic_num][j] += _topic_word_counts[i][j];
+		topic_all_word_counts[topic_num] += _topic_all_word_counts[i];
+	}
+	utility::delete_array(_topic_word_counts);
+	delete[] _topic_all_word_counts;
+	_topic_word_counts = topic_word_counts;
+	_topic_all_word_counts = topic_all_word_counts;
+	_total_word_counts[0] = _topic_all_word_counts[topic_num];
+	_total_word_counts[1] = 0;
+	for (int i = 0; i < topic_num; ++i) _total_word_counts[1] += _topic_all_word_counts[i];
+
+	// maps of successive prunes before an iteration compose
+	if (!_topic_map.empty())
+	{
+		for (size_t i = 0; i < _topic_map.size(); ++i)
+		{
+			if (_topic_map[i] >= 0) _topic_map[i] = topic_map[_topic_map[i]];
+		}
+	}
+	else
+	{
+		_topic_map.swap(topic_map);
 	}
-	fclose(fp_user_param);
-	fclose(fp_tweet_param);
+	int pruned_num = _topic_num - topic_num;
+	_topic_num = topic_num;
+	return pruned_num;
 }
 
 void model::load_hyper_param(const char *path)
@@ -183,6 +710,11 @@ void model::load_hyper_param(const char *path)
 		if (strcmp(item.data, "beta_m1") == 0) sscanf(ptr, "%lf", &_beta_m1);
 		if (strcmp(item.data, "beta_bg_m1") == 0) sscanf(ptr, "%lf", &_beta_bg_m1);
 		if (strcmp(item.data, "gamma_m1") == 0) sscanf(ptr, "%lf", &_gamma_m1);
+		if (strcmp(item.data, "shard_num") == 0) sscanf(ptr, "%d", &_shard_num);
+		if (strcmp(item.data, "hash_num") == 0) sscanf(ptr, "%d", &_hash_num);
+		if (strcmp(item.data, "sorted") == 0) _sorted = atoi(ptr) != 0;
+		if (strcmp(item.data, "text_size") == 0) sscanf(ptr, "%lld", &_text_size);
+		if (strcmp(item.data, "text_hash") == 0) sscanf(ptr, "%llu", &_text_hash);
 	}
 }
 
@@ -195,57 +727,93 @@ void model::save_hyper_param(const char *path)
 	fprintf(fp, "beta_m1=%.20f\n", _beta_m1);
 	fprintf(fp, "beta_bg_m1=%.20f\n", _beta_bg_m1);
 	fprintf(fp, "gamma_m1=%.20f\n", _gamma_m1);
+	if (_shard_num > 0) fprintf(fp, "shard_num=%d\n", _shard_num);
+	if (_hash_num > 0) fprintf(fp, "hash_num=%d\n", _hash_num);
+	if (_sorted) fprintf(fp, "sorted=1\n");
+	if (_text_hash != 0) fprintf(fp, "text_size=%lld\ntext_hash=%llu\n", _text_size, _text_hash);
 	fclose(fp);
 }
 
 void model::load_topic_param(const char *path)
 {
 	topic_param_file_reader reader(path, _word_num);
-	_total_word_counts[0] = _total_word_counts[1] = 0;
-	std::fill(_topic_all_word_counts, _topic_all_word_counts + _topic_num + 1, 0);
-	for (int i = 0; i <= _topic_num; ++i)
+	std::vector<char> rows;
+	if (reader.read_rows(rows))
 	{
-		file_item item = reader.get_item(false);
-		assert((item.size != 0) && "Invalid topic parameter file");
-
-		int *curr = _topic_word_counts[i];
-		std::fill(curr, curr + _word_num, 0);
-		utility::read_buffer buffer(item.data, item.size);
-		buffer.read_sparse_array(curr, _word_num);
-		long long sum = 0;
-		for (int j = 0; j < _word_num; ++j) sum += curr[j];
-		if (i < _topic_num)
-		{
-			_total_word_counts[1] += sum;
-			_topic_all_word_counts[i] += sum;
-		}
-		else
+		assert((reader.row_ends().size() == (size_t)_topic_num + 1) && "Invalid topic parameter file");
+		_topic_rows = rows.data();
+		_topic_row_ends = reader.row_ends().data();
+		_decoding_topics = true;
+		if (_thread_num > 0) parallel::_update();
+		else _decode_topic_rows(0, 1);
+		_decoding_topics = false;
+		_topic_rows = nullptr;
+		_topic_row_ends = nullptr;
+	}
+	else
+	{
+		// rows of a version 1 file are found only by decoding the previous ones
+		for (int i = 0; i <= _topic_num; ++i)
 		{
-			_total_word_counts[0] += sum;
-			_topic_all_word_counts[_topic_num] += sum;
+			file_item item = reader.get_item(false);
+			assert((item.size != 0) && "Invalid topic parameter file");
+
+			int *curr = _topic_word_counts[i];
+			std::fill(curr, curr + _word_num, 0);
+			utility::read_buffer buffer(item.data, item.size);
+			buffer.read_sparse_array(curr, _word_num);
+			long long sum = 0;
+			for (int j = 0; j < _word_num; ++j) sum += curr[j];
+			_topic_all_word_counts[i] = sum;
 		}
 	}
+
+	_total_word_counts[0] = _topic_all_word_counts[_topic_num];
+	_total_word_counts[1] = 0;
+	for (int i = 0; i < _topic_num; ++i) _total_word_counts[1] += _topic_all_word_counts[i];
 }
 
 void model::save_topic_param(const char *path)
 {
+	_topic_row_buffers = new utility::write_buffer[_topic_num + 1];
+	_encoding_topics = true;
+	if (_thread_num > 0) parallel::_update();
+	else _encode_topic_rows(0, 1);
+	_encoding_topics = false;
+
+	std::vector<long long> row_ends(_topic_num + 1);
+	for (int i = 0; i <= _topic_num; ++i) row_ends[i] = ((i == 0) ? 0 : row_ends[i - 1]) + (long long)_topic_row_buffers[i].size();
 	FILE *fp = fopen(path, "wb");
-	utility::write_buffer buffer;
-	for (int i = 0; i <= _topic_num; ++i)
+	topic_param_file_reader::write_header(fp, row_ends);
+	for (int i = 0; i <= _topic_num; ++i) utility::fwrite(_topic_row_buffers[i].buffer(), _topic_row_buffers[i].size(), fp);
+	fclose(fp);
+	delete[] _topic_row_buffers;
+	_topic_row_buffers = nullptr;
+}
+
+// rows of the topic params from start on with a step of the number of threads, a model without threads codes them all
+void model::_encode_topic_rows(size_t start, size_t step)
+{
+	for (int i = (int)start; i <= _topic_num; i += (int)step)
+	{
+		_topic_row_buffers[i].clear();
+		_topic_row_buffers[i].write_sparse_array(_topic_word_counts[i], _word_num, 0);
+	}
+}
+
+void model::_decode_topic_rows(size_t start, size_t step)
+{
+	for (int i = (int)start; i <= _topic_num; i += (int)step)
 	{
-		buffer.clear();
 		int *curr = _topic_word_counts[i];
-		buffer.write_sparse_array(curr, _word_num, 0);
-		utility::fwrite(buffer.buffer(), buffer.size(), fp);
-		int nonzero_count = 0;
+		std::fill(curr, curr + _word_num, 0);
+		long long row_start = (i == 0) ? 0 : _topic_row_ends[i - 1];
+		size_t more = utility::get_sparse_array(_topic_rows + row_start, curr, _word_num, (size_t)(_topic_row_ends[i] - row_start));
+		assert((more != 0) && "Invalid topic parameter file");
 		long long sum = 0;
-		for (int j = 0; j < _word_num; ++j) 
-		{
-			if (curr[j] > 0) ++nonzero_count;
-			sum += curr[j];
-		}
+		for (int j = 0; j < _word_num; ++j) sum += curr[j];
+		_topic_all_word_counts[i] = sum;
 	}
-	fclose(fp);
 }
 
 double model::topic_word_density()
@@ -269,246 +837,739 @@ double model::topic_word_density()
 	return sum / num;
 }
 
-double model::iterate(const char *tweet_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path)
+static long long write_dirty_pages(file_writer &writer, long long offset, const char *prev_data, const char *new_data, size_t size)
 {
-	tweet_file_reader tweet_reader(tweet_path, batch_size);
-	user_param_file_reader user_param_reader(input_user_path, _topic_num);
-	tweet_param_file_reader tweet_param_reader(input_tweet_path, batch_size);
-	FILE *fp_user_param = fopen(output_user_path, "wb");
-	FILE *fp_tweet_param = fopen(output_tweet_path, "wb");
-	_user_indexes.clear();
-	std::vector<char*> tweet_ptrs;
-	std::vector<char*> tweet_param_ptrs;
-	utility::write_buffer user_param_write_buffer;
+	const long long page_size = 1 << 12;
+	long long dirty_size = 0;
+	size_t start = 0;
+	while (start < size)
+	{
+		// pages are aligned to file offsets
+		size_t end = (size_t)std::min((long long)size, ((offset + (long long)start) / page_size + 1) * page_size - offset);
+		if (memcmp(prev_data + start, new_data + start, end - start) != 0)
+		{
+			writer.write_at(offset + start, new_data + start, end - start);
+			dirty_size += end - start;
+		}
+		start = end;
+	}
+	return dirty_size;
+}
 
-	auto start_time = std::chrono::high_resolution_clock::now();
-	long long process_word_count = 0, update_word_count = 0;
-	while (true)
+model::shard::shard(const char *tweet_path, const char *tweet_index_path, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, int topic_num, size_t batch_size, bool resume)
+{
+	// a model trained along with a leader reads the tweets of the leader, and may need twice their size for its params
+	tweet_reader = (tweet_path != nullptr) ? new tweet_file_reader(tweet_path, batch_size) : nullptr;
+	if (tweet_path == nullptr) batch_size *= 2;
+	index.load(tweet_index_path);
+	index_writer = new param_index_writer(index);
+	user_param_reader = new user_param_file_reader(input_user_path, topic_num);
+
+	// fixed size tweet params are updated in place, writing only the changed pages
+	in_place = tweet_param_file_reader::detect_version(input_tweet_path) == tweet_param_file_reader::format_version::fixed;
+	if (in_place && strcmp(input_tweet_path, output_tweet_path) != 0) utility::copy_file(input_tweet_path, output_tweet_path);
+	tweet_param_reader = new tweet_param_file_reader(in_place ? output_tweet_path : input_tweet_path, batch_size);
+
+	// a resumed iteration keeps writing its output files after the checkpointed sizes
+	user_param_writer = new file_writer(output_user_path, resume);
+	tweet_param_writer = new file_writer(output_tweet_path, in_place || resume);
+	user_param_size = 0;
+	tweet_param_offset = tweet_param_reader->header_size();
+	dirty_tweet_param_size = 0;
+	user_count = 0;
+	prev_user = -1;
+}
+
+model::shard::~shard()
+{
+	delete tweet_reader;
+	delete tweet_param_reader;
+	delete user_param_reader;
+	delete user_param_writer;
+	delete tweet_param_writer;
+	delete index_writer;
+	for (size_t i = 0; i < user_topic_counts.size(); ++i) delete[] user_topic_counts[i];
+}
+
+void model::_read_batch(shard &s, const shard *leader)
+{
+	// with a leader the batch is exactly its tweets, read from its buffer
+	if (leader == nullptr) s.tweet_reader->trim();
+	s.tweet_param_reader->trim();
+	s.tweet_ptrs.clear();
+	s.tweet_param_ptrs.clear();
+	s.tweet_user_indexes.clear();
+
+	for (size_t tweet = 0; ; ++tweet)
 	{
-		tweet_reader.trim();
-		tweet_param_reader.trim();
-		tweet_ptrs.clear();
-		tweet_param_ptrs.clear();
+		file_item tweet_item, tweet_param_item;
+		int user = -1, word_count = 0;
+		if (leader == nullptr)
+		{
+			tweet_item = s.tweet_reader->get_item(!s.tweet_ptrs.empty());
+		}
+		else
+		{
+			bool has_tweet = tweet + 1 < leader->tweet_ptrs.size();
+			tweet_item.data = has_tweet ? leader->tweet_ptrs[tweet] : nullptr;
+			tweet_item.size = has_tweet ? leader->tweet_ptrs[tweet + 1] - leader->tweet_ptrs[tweet] : 0;
+		}
+		if (tweet_item.size > 0)
+		{
+			utility::read_buffer tweet_header(tweet_item.data, tweet_item.size);
+			tweet_header.read_varint(&user);
+			tweet_header.read_varint(&word_count);
+		}
+		s.tweet_param_reader->set_word_count(word_count);
 
-		// read data batch
-		while (true)
+		if (s.tweet_ptrs.empty())
 		{
-			file_item tweet_item, tweet_param_item;
-			if (tweet_ptrs.empty())
+			tweet_param_item = s.tweet_param_reader->get_item(false);
+			if (tweet_item.size == 0 || tweet_param_item.size == 0)
 			{
-				tweet_item = tweet_reader.get_item(false);
-				tweet_param_item = tweet_param_reader.get_item(false);
-				if (tweet_item.size == 0 || tweet_param_item.size == 0)
-				{
-					assert((tweet_item.size == tweet_param_item.size) && "Tweet data and param file endings not aligned");
-					break;
-				}
-				tweet_ptrs.push_back(tweet_item.data);
-				tweet_param_ptrs.push_back(tweet_param_item.data);
+				assert((tweet_item.size == tweet_param_item.size) && "Tweet data and param file endings not aligned");
+				break;
+			}
+			s.tweet_ptrs.push_back(tweet_item.data);
+			s.tweet_param_ptrs.push_back(tweet_param_item.data);
+		}
+		else
+		{
+			if (tweet_item.size == 0) break;
+			tweet_param_item = s.tweet_param_reader->get_item(true);
+			if (tweet_param_item.size == 0)
+			{
+				assert((leader == nullptr) && "Param buffer smaller than the batch of the leader");
+				s.tweet_reader->unget_item(tweet_item);
+				break;
+			}
+		}
+		s.tweet_ptrs.push_back(tweet_item.data + tweet_item.size);
+		s.tweet_param_ptrs.push_back(tweet_param_item.data + tweet_param_item.size);
+
+		if (user != s.prev_user) // got new user run in tweet data, read one more user parameter data
+		{
+			size_t user_index = s.user_count++;
+			s.prev_user = user;
+
+			while (user_index >= s.user_topic_counts.size())
+			{
+				s.user_topic_counts.push_back(new int[_topic_num]);
+				s.user_all_topic_counts.push_back(0);
+				s.user_ids.push_back(-1);
+			}
+
+			file_item user_param_item = s.user_param_reader->get_item(false);
+			assert((user_param_item.size != 0) && "User param file not aligned");
+
+			utility::read_buffer user_param_buffer(user_param_item.data, user_param_item.size);
+			int curr_user;
+			user_param_buffer.read_varint(&curr_user);
+			assert((curr_user == user) && "User param file not aligned");
+
+			s.user_ids[user_index] = user;
+
+			int *topic_counts = s.user_topic_counts[user_index];
+			std::fill(topic_counts, topic_counts + _topic_num, 0);
+			if (_topic_map.empty())
+			{
+				user_param_buffer.read_sparse_array(topic_counts, _topic_num);
 			}
 			else
 			{
-				tweet_item = tweet_reader.get_item(true);
-				if (tweet_item.size == 0) break;
-				tweet_param_item = tweet_param_reader.get_item(true);
-				if (tweet_param_item.size == 0)
+				// counts of pruned topics are dropped, their tweets leave the user when sampled
+				s.pruned_topic_counts.assign(_topic_map.size(), 0);
+				user_param_buffer.read_sparse_array(s.pruned_topic_counts.data(), _topic_map.size());
+				for (size_t i = 0; i < _topic_map.size(); ++i)
 				{
-					tweet_reader.unget_item(tweet_item);
-					break;
+					if (_topic_map[i] >= 0) topic_counts[_topic_map[i]] = s.pruned_topic_counts[i];
 				}
 			}
-			tweet_ptrs.push_back(tweet_item.data + tweet_item.size);
-			tweet_param_ptrs.push_back(tweet_param_item.data + tweet_param_item.size);
-
-			int user;
-			utility::get_varint(tweet_item.data, &user, tweet_item.size);
-			if (_user_indexes.find(user) == _user_indexes.end()) // got new user in tweet data, read one more user parameter data
+			for (int i = 0; i < _topic_num; ++i)
 			{
-				size_t user_index = _user_indexes.size();
-				_user_indexes.insert(std::make_pair(user, (int)user_index));
-
-				while (user_index >= _user_topic_counts.size())
+				if (topic_counts[i] < 0)
 				{
-					_user_topic_counts.push_back(new int[_topic_num]);
-					_user_all_topic_counts.push_back(0);
-					_user_ids.push_back(-1);
+					puts("oops");
 				}
+			}
+			int all_topic_count = 0;
+			for (int i = 0; i < _topic_num; ++i) all_topic_count += topic_counts[i];
+			s.user_all_topic_counts[user_index] = all_topic_count;
+		}
+		s.tweet_user_indexes.push_back((int)s.user_count - 1);
+	}
+}
 
-				file_item user_param_item = user_param_reader.get_item(false);
-				assert((user_param_item.size != 0) && "User param file not aligned");
+void model::_begin_iteration(const char *tweet_path, const char *tweet_index_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, int iteration, const model *leader)
+{
+	// every shard streams its own files, an unsharded buffer is a single shard
+	size_t shard_count = (size_t)std::max(_shard_num, 1);
+	_leader = leader;
+	_iteration = iteration;
+	_process_word_count = _update_word_count = 0;
+	_log_likelihood_sum = 0.0;
+
+	// a checkpoint of this iteration cuts the output files back to its sizes and resumes after its batch,
+	// later iterations of the run carry on from the counts in memory
+	_checkpointing = _checkpoint_path != nullptr && iteration > 0 && leader == nullptr;
+	std::vector<char> checkpoint_data;
+	utility::read_buffer checkpoint;
+	bool complete = false;
+	bool resume = _checkpointing && iteration == _resume_iteration && _read_checkpoint(iteration, checkpoint_data, checkpoint, &complete);
+	_resume_iteration = 0;
+	for (size_t i = 0; i < shard_count; ++i)
+	{
+		char *paths[6] =
+		{
+			utility::shard_path(tweet_path, _shard_num, (int)i),
+			utility::shard_path(tweet_index_path, _shard_num, (int)i),
+			utility::shard_path(input_user_path, _shard_num, (int)i),
+			utility::shard_path(input_tweet_path, _shard_num, (int)i),
+			utility::shard_path(output_user_path, _shard_num, (int)i),
+			utility::shard_path(output_tweet_path, _shard_num, (int)i)
+		};
+		long long output_sizes[2] = { 0, 0 };
+		if (resume && !complete)
+		{
+			checkpoint.read(&output_sizes[0]);
+			checkpoint.read(&output_sizes[1]);
+			bool truncated = utility::truncate_file(paths[4], output_sizes[0]) && utility::truncate_file(paths[5], output_sizes[1]);
+			assert(truncated && "Output files of checkpoint missing");
+		}
+		int input_topic_num = _topic_map.empty() ? _topic_num : (int)_topic_map.size();
+		shard *s = new shard((leader == nullptr) ? paths[0] : nullptr, paths[1], paths[2], paths[3], paths[4], paths[5], input_topic_num, std::max(batch_size / shard_count, (size_t)1), resume && !complete);
+		if (resume && !complete)
+		{
+			s->user_param_size = output_sizes[0];
+			s->tweet_param_offset = output_sizes[1];
+			s->user_param_writer->seek(output_sizes[0]);
+			s->tweet_param_writer->seek(output_sizes[1]);
+		}
+		_shards.push_back(s);
+		for (int j = 0; j < 6; ++j) delete[] paths[j];
+	}
+	_tweet_version = (leader == nullptr) ? _shards[0]->tweet_reader->version() : leader->_tweet_version;
+	_tweet_weighted = (leader == nullptr) ? _shards[0]->tweet_reader->weighted() : leader->_tweet_weighted;
+	_tweet_param_version = _shards[0]->tweet_param_reader->version();
+	_tweet_param_topic_size = _shards[0]->tweet_param_reader->topic_size();
 
-				utility::read_buffer user_param_buffer(user_param_item.data, user_param_item.size);
-				int curr_user;
-				user_param_buffer.read_varint(&curr_user);
-				assert((curr_user == user) && "User param file not aligned");
+	// threads are spread over shards, or shards over threads when there are more shards
+	_init_slices(std::max(_thread_num, shard_count));
+	assert((leader == nullptr || (leader->_slice_num == _slice_num && leader->_shards.size() == _shards.size())) && "Models trained together differ in threads or shards");
 
-				_user_ids[user_index] = user;
+	if (resume)
+	{
+		bool restored = _restore_checkpoint(checkpoint, complete, &_process_word_count, &_update_word_count, &_log_likelihood_sum);
+		assert(restored && "Invalid checkpoint");
+		printf("Resumed from checkpoint of iteration %d\n", complete ? iteration - 1 : iteration);
+	}
+}
 
-				int *topic_counts = _user_topic_counts[user_index];
-				std::fill(topic_counts, topic_counts + _topic_num, 0);
-				user_param_buffer.read_sparse_array(topic_counts, _topic_num);
-				for (int i = 0; i < _topic_num; ++i)
+bool model::_read_batches()
+{
+	// read data batch of every shard
+	_reading = true;
+	parallel::_update();
+	_reading = false;
+
+	size_t shard_count = _shards.size();
+	bool is_empty = true;
+	for (size_t i = 0; i < _slice_num; ++i)
+	{
+		shard &s = *_shards[i % shard_count];
+		_slice_shards[i] = &s;
+		_tweet_param_write_buffers[i].clear();
+		_slice_log_likelihoods[i] = 0.0;
+		if (s.tweet_ptrs.empty())
+		{
+			_slice_starts[i] = 0;
+			_tweet_read_buffers[i] = utility::read_buffer();
+			_tweet_param_read_buffers[i] = utility::read_buffer();
+			continue;
+		}
+		is_empty = false;
+
+		size_t part = i / shard_count;
+		size_t part_count = (_slice_num - i % shard_count + shard_count - 1) / shard_count;
+		size_t start = part * (s.tweet_ptrs.size() - 1) / part_count;
+		size_t end = (part + 1) * (s.tweet_ptrs.size() - 1) / part_count;
+		_slice_starts[i] = start;
+		_tweet_read_buffers[i] = utility::read_buffer(s.tweet_ptrs[start], s.tweet_ptrs[end] - s.tweet_ptrs[start]);
+		_tweet_param_read_buffers[i] = utility::read_buffer(s.tweet_param_ptrs[start], s.tweet_param_ptrs[end] - s.tweet_param_ptrs[start]);
+	}
+	return !is_empty;
+}
+
+void model::_decode_slice(size_t i)
+{
+	decoded_slice &slice = _decoded_slices[i];
+	slice.users.clear();
+	slice.weights.clear();
+	slice.words.clear();
+	slice.word_offsets.assign(1, 0);
+
+	utility::read_buffer &tweet_buffer = _tweet_read_buffers[i];
+	std::vector<int> &words = slice.scratch;
+	while (true)
+	{
+		int user, weight;
+		if (tweet_file_reader::read_tweet(tweet_buffer, _tweet_version, &user, words, _tweet_weighted, &weight) == 0) break;
+		slice.users.push_back(user);
+		slice.weights.push_back(weight);
+		slice.words.insert(slice.words.end(), words.begin(), words.end());
+		slice.word_offsets.push_back(slice.words.size());
+	}
+}
+
+void model::_merge_batches()
+{
+	// update user, topic, and word counts, slices of a shard are merged in file order
+	for (size_t i = 0; i < _slice_num; ++i)
+	{
+		shard &s = *_slice_shards[i];
+		const decoded_slice &slice = (_leader == nullptr) ? _decoded_slices[i] : _leader->_decoded_slices[i];
+		_log_likelihood_sum += _slice_log_likelihoods[i];
+		utility::read_buffer &prev_tweet_param_buffer = _tweet_param_read_buffers[i];
+		prev_tweet_param_buffer.reset();
+		utility::read_buffer new_tweet_param_buffer(_tweet_param_write_buffers[i].buffer(), _tweet_param_write_buffers[i].size());
+		for (size_t j = 0; j < slice.users.size(); ++j)
+		{
+			int user = slice.users[j], weight = slice.weights[j];
+			const int *words = slice.words.data() + slice.word_offsets[j];
+			s.index_writer->add_tweet(s.tweet_param_offset + new_tweet_param_buffer.offset());
+			int user_index = s.tweet_user_indexes[_slice_starts[i] + j];
+			assert((s.user_ids[user_index] == user) && "User not in buffer");
+
+			// a weighted tweet moves the counts of all its identical copies
+			int word_count = (int)(slice.word_offsets[j + 1] - slice.word_offsets[j]);
+			_process_word_count += (long long)word_count * weight;
+
+			int prev_topic;
+			size_t prev_more = tweet_param_file_reader::read_topic(prev_tweet_param_buffer, _tweet_param_version, _tweet_param_topic_size, word_count, &prev_topic);
+			assert((prev_more != 0) && "Word counts not match in tweet data and previous param");
+			if (!_topic_map.empty()) prev_topic = _topic_map[prev_topic];
+
+			int new_topic;
+			size_t new_more = tweet_param_file_reader::read_topic(new_tweet_param_buffer, _tweet_param_version, _tweet_param_topic_size, word_count, &new_topic);
+			assert((new_more != 0) && "Word counts not match in tweet data and new param");
+
+			// topic words of a pruned topic were moved to the background
+			if (prev_topic >= 0) s.user_topic_counts[user_index][prev_topic] -= weight;
+			s.user_topic_counts[user_index][new_topic] += weight;
+			int prev_word_topic = (prev_topic >= 0) ? prev_topic : _topic_num;
+
+			for (int k = 0; k < word_count; k += 8)
+			{
+				char prev_tag = 0, new_tag = 0;
+				prev_tweet_param_buffer.read(&prev_tag);
+				new_tweet_param_buffer.read(&new_tag);
+				for (int l = 0; l < 8 && k + l < word_count; ++l)
 				{
-					if (topic_counts[i] < 0)
+					int word = words[k + l];
+					if (prev_tag & (1 << l))
+					{
+						_dec_topic_word_count(prev_word_topic, word, weight);
+					}
+					else
+					{
+						_dec_topic_word_count(_topic_num, word, weight);
+					}
+
+					if (new_tag & (1 << l))
+					{
+						_inc_topic_word_count(new_topic, word, weight);
+					}
+					else
 					{
-						puts("oops");
+						_inc_topic_word_count(_topic_num, word, weight);
 					}
+
+					if ((prev_tag & (1 << l)) != (new_tag & (1 << l)) || ((prev_tag & (1 << l)) && (new_tag & (1 << l)) && prev_topic != new_topic)) _update_word_count += weight;
 				}
-				int all_topic_count = 0;
-				for (int i = 0; i < _topic_num; ++i) all_topic_count += topic_counts[i];
-				_user_all_topic_counts[user_index] = all_topic_count;
 			}
 		}
 
-		if (tweet_ptrs.empty()) break;
+		utility::write_buffer &tweet_param_write_buffer = _tweet_param_write_buffers[i];
+		if (s.in_place)
+		{
+			assert((tweet_param_write_buffer.size() == prev_tweet_param_buffer.size()) && "Fixed size param changed size");
+			s.dirty_tweet_param_size += write_dirty_pages(*s.tweet_param_writer, s.tweet_param_offset, prev_tweet_param_buffer.buffer(), tweet_param_write_buffer.buffer(), tweet_param_write_buffer.size());
+		}
+		else
+		{
+			s.tweet_param_writer->write(tweet_param_write_buffer.buffer(), tweet_param_write_buffer.size());
+		}
+		s.tweet_param_offset += tweet_param_write_buffer.size();
+	}
+
+	utility::write_buffer user_param_write_buffer;
+	for (size_t j = 0; j < _shards.size(); ++j)
+	{
+		shard &s = *_shards[j];
+		if (s.tweet_ptrs.empty()) continue;
+
+		// the last user run may continue in the next batch of the shard
+		user_param_write_buffer.clear();
+		size_t user_count = s.user_count;
+		for (size_t i = 0; i < user_count - 1; ++i)
+		{
+			s.index_writer->add_user(s.user_param_size + user_param_write_buffer.size());
+			user_param_write_buffer.write_varint(s.user_ids[i]);
+			user_param_write_buffer.write_sparse_array(s.user_topic_counts[i], _topic_num);
+		}
+		s.user_param_writer->write(user_param_write_buffer.buffer(), user_param_write_buffer.size());
+		s.user_param_size += user_param_write_buffer.size();
+		if (user_count >= 1)
+		{
+			std::swap(s.user_ids[0], s.user_ids[user_count - 1]);
+			std::swap(s.user_topic_counts[0], s.user_topic_counts[user_count - 1]);
+			std::swap(s.user_all_topic_counts[0], s.user_all_topic_counts[user_count - 1]);
+			s.user_count = 1;
+		}
+	}
+}
+
+void model::_read_progress(long long *position, long long *size) const
+{
+	*position = *size = 0;
+	for (size_t j = 0; j < _shards.size(); ++j)
+	{
+		*position += _shards[j]->tweet_reader->position();
+		*size += _shards[j]->tweet_reader->size();
+	}
+}
+
+double model::_end_iteration(const char *output_index_path, double *log_likelihood)
+{
+	long long tweet_param_size = 0, dirty_tweet_param_size = 0;
+	utility::write_buffer user_param_write_buffer;
+	for (size_t j = 0; j < _shards.size(); ++j)
+	{
+		shard &s = *_shards[j];
+		user_param_write_buffer.clear();
+		for (size_t i = 0; i < s.user_count; ++i)
+		{
+			s.index_writer->add_user(s.user_param_size + user_param_write_buffer.size());
+			user_param_write_buffer.write_varint(s.user_ids[i]);
+			user_param_write_buffer.write_sparse_array(s.user_topic_counts[i], _topic_num);
+		}
+		s.user_param_writer->write(user_param_write_buffer.buffer(), user_param_write_buffer.size());
+
+		if (_checkpointing)
+		{
+			s.user_param_writer->sync();
+			s.tweet_param_writer->sync();
+		}
+		s.user_param_writer->close();
+		s.tweet_param_writer->close();
+		char *index_path = utility::shard_path(output_index_path, _shard_num, (int)j);
+		s.index_writer->save(index_path);
+		delete[] index_path;
+
+		tweet_param_size += s.tweet_param_offset - (long long)s.tweet_param_reader->header_size();
+		dirty_tweet_param_size += s.dirty_tweet_param_size;
+	}
+	bool in_place = _shards[0]->in_place;
+	for (size_t j = 0; j < _shards.size(); ++j) delete _shards[j];
+	_shards.clear();
+	_leader = nullptr;
+	_topic_map.clear();
+	if (_checkpointing) _write_checkpoint(_iteration, true, _process_word_count, _update_word_count, _log_likelihood_sum);
+
+	if (in_place) printf("%.2f%% tweet param rewritten\n", dirty_tweet_param_size * 100.0 / std::max(1LL, tweet_param_size));
+	fflush(stdout);
+
+	if (log_likelihood != nullptr) *log_likelihood = _log_likelihood_sum / _process_word_count;
+	return (double)_update_word_count / _process_word_count;
+}
+
+double model::iterate(const char *tweet_path, const char *tweet_index_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, const char *output_index_path, double *log_likelihood, int iteration)
+{
+	_begin_iteration(tweet_path, tweet_index_path, batch_size, input_user_path, input_tweet_path, output_user_path, output_tweet_path, iteration, nullptr);
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	auto checkpoint_time = start_time;
+	while (_read_batches())
+	{
+		// invoke worker threads for sampling
+		parallel::_update();
+		_merge_batches();
+
+		long long position, size;
+		_read_progress(&position, &size);
+		auto end_time = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+		printf("\r%.2f%% progress  %.4f update/word  %.4f log-likelihood/word  %.2fk word/sec  %.1f sec  ", position * 100.0 / size, (double)_update_word_count / _process_word_count, _log_likelihood_sum / _process_word_count, (double)_process_word_count / duration.count(), duration.count() * 0.001);
+		fflush(stdout);
+
+		if (_checkpointing && std::chrono::duration<double>(end_time - checkpoint_time).count() >= _checkpoint_interval)
+		{
+			_write_checkpoint(_iteration, false, _process_word_count, _update_word_count, _log_likelihood_sum);
+			checkpoint_time = end_time;
+		}
+	}
+
+	printf("\n");
+	return _end_iteration(output_index_path, log_likelihood);
+}
+
+void model::iterate(std::vector<model*> &models, const char *tweet_path, const char *tweet_index_path, size_t batch_size, const std::vector<param_paths> &paths, double *update_ratios, double *log_likelihoods)
+{
+	// the first model reads and decodes every batch, the others read only their own params of the same tweets
+	model *leader = models[0];
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		const param_paths &p = paths[i];
+		models[i]->_begin_iteration(tweet_path, tweet_index_path, batch_size, p.input_user_path, p.input_tweet_path, p.output_user_path, p.output_tweet_path, 0, (i == 0) ? nullptr : leader);
+	}
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	while (true)
+	{
+		bool is_read = leader->_read_batches();
+		for (size_t i = 1; i < models.size(); ++i)
+		{
+			bool is_follower_read = models[i]->_read_batches();
+			assert((is_follower_read == is_read) && "Tweet params of models trained together not aligned");
+		}
+		if (!is_read) break;
+
+		// the decoded slices of the leader are kept until every model has sampled and merged the batch
+		for (size_t i = 0; i < models.size(); ++i) models[i]->parallel::_update();
+		for (size_t i = 0; i < models.size(); ++i) models[i]->_merge_batches();
+
+		long long position, size;
+		leader->_read_progress(&position, &size);
+		auto end_time = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+		printf("\r%.2f%% progress  %d models  %.2fk word/sec  %.1f sec  ", position * 100.0 / size, (int)models.size(), (double)leader->_process_word_count / duration.count(), duration.count() * 0.001);
+		fflush(stdout);
+	}
+
+	printf("\n");
+	for (size_t i = 0; i < models.size(); ++i) update_ratios[i] = models[i]->_end_iteration(paths[i].output_index_path, &log_likelihoods[i]);
+}
+
+void model::set_checkpoint(const char *path, double interval)
+{
+	_checkpoint_path = path;
+	_checkpoint_interval = interval;
+	_resume_iteration = checkpoint_iteration();
+
+	FILE *fp = (_resume_iteration == 0) ? fopen(path, "rb") : nullptr;
+	if (fp != nullptr)
+	{
+		printf("Checkpoint %s is truncated or not of this model, ignored\n", path);
+		fclose(fp);
+	}
+}
+
+int model::checkpoint_iteration()
+{
+	if (_checkpoint_path == nullptr) return 0;
+	std::vector<char> data;
+	utility::read_buffer buffer;
+	int iteration;
+	bool complete;
+	if (!_load_checkpoint(data, buffer, &iteration, &complete)) return 0;
+	return complete ? iteration + 1 : iteration;
+}
+
+bool model::restore_finished_iteration()
+{
+	std::vector<char> data;
+	utility::read_buffer buffer;
+	int iteration;
+	bool complete;
+	if (_checkpoint_path == nullptr || !_load_checkpoint(data, buffer, &iteration, &complete) || !complete) return false;
+	return _restore_checkpoint(buffer, true, &_process_word_count, &_update_word_count, &_log_likelihood_sum);
+}
+
+// reads the checkpoint up to its output sizes, false if it is missing, truncated or of another model
+bool model::_load_checkpoint(std::vector<char> &data, utility::read_buffer &buffer, int *iteration, bool *complete)
+{
+	FILE *fp = fopen(_checkpoint_path, "rb");
+	if (fp == nullptr) return false;
+	data.resize((size_t)utility::file_size(fp));
+	size_t size = data.empty() ? 0 : utility::fread(data.data(), data.size(), fp);
+	fclose(fp);
+	buffer = utility::read_buffer(data.data(), size);
+
+	char header[4];
+	int values[5]; // iteration, complete, topic_num, word_num, shard_count
+	long long file_size = 0;
+	if (buffer.read_bytes(header, 4) == 0 || memcmp(header, checkpoint_header, 4) != 0) return false;
+	for (int i = 0; i < 5; ++i)
+	{
+		if (buffer.read(&values[i]) == 0) return false;
+	}
+	if (buffer.read(&file_size) == 0 || file_size != (long long)size) return false;
+	if (values[2] != _topic_num || values[3] != _word_num || values[4] != std::max(_shard_num, 1)) return false;
+	*iteration = values[0];
+	*complete = values[1] != 0;
+	return true;
+}
+
+bool model::_read_checkpoint(int iteration, std::vector<char> &data, utility::read_buffer &buffer, bool *complete)
+{
+	int checkpoint_iteration;
+	if (!_load_checkpoint(data, buffer, &checkpoint_iteration, complete)) return false;
+	return checkpoint_iteration == (*complete ? iteration - 1 : iteration);
+}
+
+// false when a value fails to read, the restore then stops part way
+bool model::_restore_checkpoint(utility::read_buffer &buffer, bool complete, long long *process_word_count, long long *update_word_count, double *log_likelihood)
+{
+	// the word counts of a finished iteration are its final counts, carried into the next one
+	long long counts[2] = { 0, 0 };
+	double sum = 0.0;
+	if (buffer.read(&counts[0]) == 0 || buffer.read(&counts[1]) == 0 || buffer.read(&sum) == 0) return false;
+	if (!complete)
+	{
+		*process_word_count = counts[0];
+		*update_word_count = counts[1];
+		*log_likelihood = sum;
+	}
+
+	int engine_state_size = 0;
+	if (buffer.read(&engine_state_size) == 0 || engine_state_size < 0) return false;
+	std::string engine_states(engine_state_size, ' ');
+	if (engine_state_size > 0 && buffer.read_bytes(&engine_states[0], engine_state_size) == 0) return false;
+	std::istringstream engine_stream(engine_states);
+	// engine extraction resets the stream flags, so the separators are skipped explicitly
+	for (size_t i = 0; i < _thread_num; ++i) engine_stream >> std::ws >> _random_engines[i];
 
-		for (size_t i = 0; i < _thread_num; ++i)
+	for (size_t j = 0; !complete && j < _shards.size(); ++j)
+	{
+		// readers get back the data they had buffered, so the batches after the checkpoint are cut as they were
+		shard &s = *_shards[j];
+		long long positions[7];
+		for (int i = 0; i < 7; ++i)
 		{
-			size_t start = i * (tweet_ptrs.size() - 1) / _thread_num;
-			size_t end = (i + 1) * (tweet_ptrs.size() - 1) / _thread_num;
-			_tweet_read_buffers[i] = utility::read_buffer(tweet_ptrs[start], tweet_ptrs[end] - tweet_ptrs[start]);
-			_tweet_param_read_buffers[i] = utility::read_buffer(tweet_param_ptrs[start], tweet_param_ptrs[end] - tweet_param_ptrs[start]);
-			_tweet_param_write_buffers[i].clear();
+			if (buffer.read(&positions[i]) == 0) return false;
 		}
-
-		// invoke worker threads for sampling
-		parallel::_update();
-
-		// update user, topic, and word counts
-		for (size_t i = 0; i < _thread_num; ++i)
+		s.tweet_reader->restore(positions[0], positions[1], (size_t)positions[2]);
+		s.tweet_param_reader->restore(positions[3], positions[4], (size_t)positions[5]);
+		s.user_param_reader->seek(positions[6]);
+
+		int user = -1;
+		if (buffer.read(&s.prev_user) == 0 || buffer.read(&user) == 0) return false;
+		s.user_count = 0;
+		if (user >= 0)
 		{
-			utility::read_buffer &tweet_buffer = _tweet_read_buffers[i];
-			tweet_buffer.reset();
-			utility::read_buffer &prev_tweet_param_buffer = _tweet_param_read_buffers[i];
-			prev_tweet_param_buffer.reset();
-			utility::read_buffer new_tweet_param_buffer(_tweet_param_write_buffers[i].buffer(), _tweet_param_write_buffers[i].size());
-			utility::fwrite(_tweet_param_write_buffers[i].buffer(), _tweet_param_write_buffers[i].size(), fp_tweet_param);
-			while (true)
+			if (s.user_topic_counts.empty())
 			{
-				int user;
-				if (tweet_buffer.read_varint(&user) == 0) break;
-				auto user_itor = _user_indexes.find(user);
-				assert((user_itor != _user_indexes.end()) && "User not in buffer");
-
-				int word_count;
-				tweet_buffer.read_varint(&word_count);
-				process_word_count += word_count;
-
-				int user_index = user_itor->second;
-				int prev_topic, prev_word_count;
-				prev_tweet_param_buffer.read_varint(&prev_topic);
-				prev_tweet_param_buffer.read_varint(&prev_word_count);
-				assert((word_count == prev_word_count) && "Word counts not match in tweet data and previous param");
-
-				int new_topic, new_word_count;
-				new_tweet_param_buffer.read_varint(&new_topic);
-				new_tweet_param_buffer.read_varint(&new_word_count);
-				assert((word_count == new_word_count) && "Word counts not match in tweet data and new param");
-
-				--_user_topic_counts[user_index][prev_topic];
-				++_user_topic_counts[user_index][new_topic];
-
-				for (int j = 0; j < word_count; j += 8)
-				{
-					char prev_tag, new_tag;
-					prev_tweet_param_buffer.read(&prev_tag);
-					new_tweet_param_buffer.read(&new_tag);
-					for (int k = 0; k < 8 && j + k < word_count; ++k)
-					{
-						int word;
-						tweet_buffer.read_varint(&word);
-						if (prev_tag & (1 << k))
-						{
-							_dec_topic_word_count(prev_topic, word);
-						}
-						else
-						{
-							_dec_topic_word_count(_topic_num, word);
-						}
-
-						if (new_tag & (1 << k))
-						{
-							_inc_topic_word_count(new_topic, word);
-						}
-						else
-						{
-							_inc_topic_word_count(_topic_num, word);
-						}
-
-						if ((prev_tag & (1 << k)) != (new_tag & (1 << k)) || ((prev_tag & (1 << k)) && (new_tag & (1 << k)) && prev_topic != new_topic)) ++update_word_count;
-					}
-				}
+				s.user_topic_counts.push_back(new int[_topic_num]);
+				s.user_all_topic_counts.push_back(0);
+				s.user_ids.push_back(-1);
 			}
+			s.user_count = 1;
+			s.user_ids[0] = user;
+			std::fill(s.user_topic_counts[0], s.user_topic_counts[0] + _topic_num, 0);
+			if (buffer.read_sparse_array(s.user_topic_counts[0], _topic_num) == 0) return false;
+			int all_topic_count = 0;
+			for (int i = 0; i < _topic_num; ++i) all_topic_count += s.user_topic_counts[0][i];
+			s.user_all_topic_counts[0] = all_topic_count;
 		}
+		if (!s.index_writer->read_state(buffer)) return false;
+	}
 
-		user_param_write_buffer.clear();
-		size_t user_count = _user_indexes.size();
-		for (size_t i = 0; i < user_count - 1; ++i)
-		{
-			user_param_write_buffer.write_varint(_user_ids[i]);
-			user_param_write_buffer.write_sparse_array(_user_topic_counts[i], _topic_num);
-			_user_indexes.erase(_user_ids[i]);
-		}
-		utility::fwrite(user_param_write_buffer.buffer(), user_param_write_buffer.size(), fp_user_param);
-		if (user_count >= 1)
-		{
-			std::swap(_user_ids[0], _user_ids[user_count - 1]);
-			std::swap(_user_topic_counts[0], _user_topic_counts[user_count - 1]);
-			std::swap(_user_all_topic_counts[0], _user_all_topic_counts[user_count - 1]);
-			_user_indexes[_user_ids[0]] = 0;
-		}
+	for (int i = 0; i <= _topic_num; ++i)
+	{
+		std::fill(_topic_word_counts[i], _topic_word_counts[i] + _word_num, 0);
+		if (buffer.read_sparse_array(_topic_word_counts[i], _word_num) == 0) return false;
+	}
+	_sum_topic_word_counts();
+	return true;
+}
 
-		auto end_time = std::chrono::high_resolution_clock::now();
-		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-		printf("\r%.2f%% progress  %.4f update/word  %.2fk word/sec  %.1f sec  ", tweet_reader.position() * 100.0 / tweet_reader.size(), (double)update_word_count / process_word_count, (double)process_word_count / duration.count(), duration.count() * 0.001);
-		fflush(stdout);
+void model::_write_checkpoint(int iteration, bool complete, long long process_word_count, long long update_word_count, double log_likelihood)
+{
+	// output files reach the disk before the checkpoint that refers to their sizes replaces the previous one
+	utility::write_buffer buffer;
+	buffer.write_bytes(checkpoint_header, 4);
+	buffer.write(iteration);
+	buffer.write(complete ? 1 : 0);
+	buffer.write(_topic_num);
+	buffer.write(_word_num);
+	buffer.write(std::max(_shard_num, 1));
+	size_t file_size_offset = buffer.size();
+	buffer.write(0LL);
+	for (size_t j = 0; !complete && j < _shards.size(); ++j)
+	{
+		shard &s = *_shards[j];
+		s.user_param_writer->sync();
+		s.tweet_param_writer->sync();
+		buffer.write(s.user_param_size);
+		buffer.write(s.tweet_param_offset);
 	}
+	buffer.write(process_word_count);
+	buffer.write(update_word_count);
+	buffer.write(log_likelihood);
 
-	user_param_write_buffer.clear();
-	for (size_t i = 0; i < _user_indexes.size(); ++i)
+	std::ostringstream engine_stream;
+	for (size_t i = 0; i < _thread_num; ++i) engine_stream << _random_engines[i] << ' ';
+	std::string engine_states = engine_stream.str();
+	buffer.write((int)engine_states.size());
+	buffer.write_bytes(engine_states.data(), engine_states.size());
+
+	for (size_t j = 0; !complete && j < _shards.size(); ++j)
 	{
-		user_param_write_buffer.write_varint(_user_ids[i]);
-		user_param_write_buffer.write_sparse_array(_user_topic_counts[i], _topic_num);
+		shard &s = *_shards[j];
+		buffer.write(s.tweet_reader->position());
+		buffer.write(s.tweet_reader->buffered_end());
+		buffer.write((long long)s.tweet_reader->buffer_size());
+		buffer.write(s.tweet_param_reader->position());
+		buffer.write(s.tweet_param_reader->buffered_end());
+		buffer.write((long long)s.tweet_param_reader->buffer_size());
+		buffer.write(s.user_param_reader->position());
+		int user = (s.user_count > 0) ? s.user_ids[0] : -1;
+		buffer.write(s.prev_user);
+		buffer.write(user);
+		if (user >= 0) buffer.write_sparse_array(s.user_topic_counts[0], _topic_num);
+		s.index_writer->write_state(buffer);
 	}
-	utility::fwrite(user_param_write_buffer.buffer(), user_param_write_buffer.size(), fp_user_param);
 
-	fclose(fp_user_param);
-	fclose(fp_tweet_param);
-	
-	printf("\n");
-	fflush(stdout);
+	for (int i = 0; i <= _topic_num; ++i) buffer.write_sparse_array(_topic_word_counts[i], _word_num);
+	long long file_size = (long long)buffer.size();
+	memcpy(buffer.buffer() + file_size_offset, &file_size, sizeof(file_size));
 
-	return (double)update_word_count / process_word_count;
+	char *temp_path = utility::new_string(_checkpoint_path, ".temp");
+	FILE *fp = fopen(temp_path, "wb");
+	bool written = fp != nullptr && utility::fwrite(buffer.buffer(), buffer.size(), fp) == buffer.size() && utility::sync_file(fp);
+	if (fp != nullptr) fclose(fp);
+	if (!written || !utility::replace_file(temp_path, _checkpoint_path)) printf("Failed to write checkpoint %s\n", _checkpoint_path);
+	delete[] temp_path;
 }
 
-inline void model::_inc_topic_word_count(int topic, int word)
+inline void model::_inc_topic_word_count(int topic, int word, int count)
 {
-	++_topic_word_counts[topic][word];
-	++_topic_all_word_counts[topic];
+	_topic_word_counts[topic][word] += count;
+	_topic_all_word_counts[topic] += count;
 	if (topic == _topic_num)
 	{
-		++_total_word_counts[0];
+		_total_word_counts[0] += count;
 	}
 	else
 	{
-		++_total_word_counts[1];
+		_total_word_counts[1] += count;
 	}
 }
 
-inline void model::_dec_topic_word_count(int topic, int word)
+inline void model::_dec_topic_word_count(int topic, int word, int count)
 {
-	--_topic_word_counts[topic][word];
+	_topic_word_counts[topic][word] -= count;
 	assert(_topic_word_counts[topic][word] >= 0);
-	--_topic_all_word_counts[topic];
+	_topic_all_word_counts[topic] -= count;
 	assert(_topic_all_word_counts[topic] >= 0);
 	if (topic == _topic_num) 
 	{
-		--_total_word_counts[0];
+		_total_word_counts[0] -= count;
 		assert(_total_word_counts[0] >= 0);
 	}
 	else
 	{
-		--_total_word_counts[1];
+		_total_word_counts[1] -= count;
 		assert(_total_word_counts[1] >= 0);
 	}
 }
@@ -563,46 +1624,39 @@ static inline void pow_fix_exp(double &x, int &x_exp, int n)
 	fix_exp(x, x_exp);
 }
 
-void model::_sample(utility::read_buffer &tweet_read_buffer, utility::read_buffer &tweet_param_read_buffer, utility::write_buffer &tweet_param_write_buffer, std::default_random_engine &random_engine)
+void model::_sample(shard &s, size_t start, const decoded_slice &slice, utility::read_buffer &tweet_param_read_buffer, utility::write_buffer &tweet_param_write_buffer, std::default_random_engine &random_engine, double &log_likelihood)
 {
-	std::uniform_real_distribution<double> uniform_distr(0.0, 1.0);
+	log_likelihood = 0.0;
 
-	std::vector<int> words, topic_words;
+	std::vector<int> topic_words;
 	std::vector<char> word_tags;
 
 	double *topic_probs = new double[_topic_num];
 	int *topic_prob_exps = new int[_topic_num];
 	int *candidate_topics = new int[_topic_num];
 
-	while (true)
+	for (size_t tweet = 0; tweet < slice.users.size(); ++tweet)
 	{
-		int user;
-		if (tweet_read_buffer.read_varint(&user) == 0) break;
-		auto user_itor = _user_indexes.find(user);
-		assert((user_itor != _user_indexes.end()) && "User not in buffer");
-
-		int user_index = user_itor->second;
-
-		int word_count;
-		tweet_read_buffer.read_varint(&word_count);
-		int prev_topic, param_word_count;
-		tweet_param_read_buffer.read_varint(&prev_topic);
-		tweet_param_read_buffer.read_varint(&param_word_count);
-		assert((param_word_count == word_count) && "Tweet data and param are not aligned");
+		// copies of a weighted tweet share one topic and one set of word tags, its weight only scales the counts in the merge
+		int user = slice.users[tweet], weight = slice.weights[tweet];
+		const int *words = slice.words.data() + slice.word_offsets[tweet];
+		int user_index = s.tweet_user_indexes[start + tweet];
+		assert((s.user_ids[user_index] == user) && "User not in buffer");
+
+		int word_count = (int)(slice.word_offsets[tweet + 1] - slice.word_offsets[tweet]);
+		int prev_topic;
+		size_t param_more = tweet_param_file_reader::read_topic(tweet_param_read_buffer, _tweet_param_version, _tweet_param_topic_size, word_count, &prev_topic);
+		assert((param_more != 0) && "Tweet data and param are not aligned");
+		if (!_topic_map.empty()) prev_topic = _topic_map[prev_topic];
 
-		word_tags.clear();
 		topic_words.clear();
-		words.clear();
 		for (int i = 0; i < word_count; i += 8)
 		{
-			char tag;
+			char tag = 0;
 			tweet_param_read_buffer.read(&tag);
-			word_tags.push_back(tag);
 			for (int j = 0; j < 8 && i + j < word_count; ++j)
 			{
-				int word;
-				tweet_read_buffer.read_varint(&word);
-				words.push_back(word);
+				int word = words[i + j];
 				if (tag & (1 << j))
 				{
 					topic_words.push_back(word);
@@ -610,88 +1664,13 @@ void model::_sample(utility::read_buffer &tweet_read_buffer, utility::read_buffe
 			}
 		}
 
-		// sample user topic
-		int max_prob_exp = std::numeric_limits<int>::min();
-
-		candidate_topics[0] = prev_topic;
-		for (int i = 0, j = 1; i < _topic_num; ++i)
-		{
-			if (i != prev_topic) candidate_topics[j++] = i;
-		}
-
-		for (int i = 0; i < _topic_num; ++i)
-		{
-			int topic = candidate_topics[i];
-			double prob = (_user_topic_counts[user_index][topic] + _alpha_m1) / (_user_all_topic_counts[user_index] + _alpha_m1 * _topic_num); // theta(user, topic)
-			int prob_exp = 0;
-			for (size_t j = 0; j < topic_words.size(); ++j)
-			{
-				int word = topic_words[j];
-
-				double phi = (_topic_word_counts[topic][word] + _beta_m1) / (_topic_all_word_counts[topic] + _beta_m1 * _word_num); // phi(topic, word)
-				prob *= phi;
-
-				if ((j & 15) == 15)
-				{
-					fix_exp(prob, prob_exp);
-					if (prob_exp + 52 < max_prob_exp) break;
-				}
-			}
-			
-			fix_exp(prob, prob_exp);
-
-			assert((prob > 0.0) && "Non-positive probability");
-
-			topic_probs[topic] = prob;
-			topic_prob_exps[topic] = prob_exp;
-			if (max_prob_exp < prob_exp) max_prob_exp = prob_exp;
-		}
-
-		double topic_prob_sum = 0.0;
-		for (int topic = 0; topic < _topic_num; ++topic)
-		{
-			topic_probs[topic] = pack_exp(topic_probs[topic], topic_prob_exps[topic] - max_prob_exp);
-			topic_prob_sum += topic_probs[topic];
-		}
-		double topic_choice = uniform_distr(random_engine) * topic_prob_sum;
-		topic_prob_sum = 0.0;
-		int selected_topic = _topic_num - 1;
-		for (int topic = 0; topic < _topic_num; ++topic)
-		{
-			topic_prob_sum += topic_probs[topic];
-			if (topic_choice <= topic_prob_sum)
-			{
-				selected_topic = topic;
-				break;
-			}
-		}
-
-		tweet_param_write_buffer.write_varint(selected_topic);
-		tweet_param_write_buffer.write_varint(word_count);
+		int selected_topic = _sample_topic(topic_words, s.user_topic_counts[user_index], s.user_all_topic_counts[user_index], prev_topic, topic_probs, topic_prob_exps, candidate_topics, random_engine);
+		tweet_param_file_reader::write_topic(tweet_param_write_buffer, _tweet_param_version, _tweet_param_topic_size, word_count, selected_topic);
 
-		// sample word whether in the selected topic or background topic
-		for (int i = 0; i < word_count; i += 8)
-		{
-			char tag = 0;
-			for (int j = 0; j < 8 && i + j < word_count; ++j)
-			{
-				int is_prev_selected = (word_tags[i / 8] & (1 << j)) ? 1 : 0;
-				int is_prev_topic = (selected_topic == prev_topic) ? 1 : 0;
-				int word = words[i + j];
-				double pi0 = _total_word_counts[0] + _gamma_m1;
-				double pi1 = _total_word_counts[1] + _gamma_m1;
-				double phi0 = (_topic_word_counts[_topic_num][word] + _beta_bg_m1) / (_topic_all_word_counts[_topic_num] + _beta_bg_m1 * _word_num);
-				double phi1 = (_topic_word_counts[selected_topic][word] + _beta_m1) / (_topic_all_word_counts[selected_topic] + _beta_m1 * _word_num);
-				double prob0 = pi0 * phi0;
-				double prob1 = pi1 * phi1;
-				double word_choice = uniform_distr(random_engine) * (prob0 + prob1);
-				if (word_choice > prob0)
-				{
-					tag |= 1 << j;
-				}
-			}
-			tweet_param_write_buffer.write(tag);
-		}
+		// the joint likelihood of the sampled topic under the user and of each word under the topic or background is a by-product
+		double theta = (s.user_topic_counts[user_index][selected_topic] + _alpha_m1) / (s.user_all_topic_counts[user_index] + _alpha_m1 * _topic_num);
+		log_likelihood += weight * _sample_word_tags(words, word_count, selected_topic, theta, word_tags, random_engine);
+		tweet_param_write_buffer.write_bytes(word_tags.data(), word_tags.size());
 	}
 
 	delete[] candidate_topics;
@@ -699,194 +1678,140 @@ void model::_sample(utility::read_buffer &tweet_read_buffer, utility::read_buffe
 	delete[] topic_prob_exps;
 }
 
-void model::make_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *tweet_id_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq)
+int model::_sample_topic(const std::vector<int> &topic_words, const int *user_topic_counts, int user_all_topic_count, int prev_topic, double *topic_probs, int *topic_prob_exps, int *candidate_topics, std::default_random_engine &random_engine)
 {
-	char default_user[] = "*";
-
-	text_file_reader reader(input_path);
-
-	printf("Building mappings...\n");
+	std::uniform_real_distribution<double> uniform_distr(0.0, 1.0);
+	int max_prob_exp = std::numeric_limits<int>::min();
 
-	std::unordered_map<char *, size_t, utility::string_hasher, utility::string_predicate> user_ids, word_ids;
-	std::vector<char *> users, words;
-	std::vector<int> user_counts, word_counts;
-	while (true)
+	// the previous topic goes first, it is likely the best and lets the others stop early
+	int candidate_count = 0;
+	if (prev_topic >= 0) candidate_topics[candidate_count++] = prev_topic;
+	for (int i = 0; i < _topic_num; ++i)
 	{
-		file_item item = reader.get_item(false);
-		if (item.size == 0) break;
+		if (i != prev_topic) candidate_topics[candidate_count++] = i;
+	}
 
-		char *ptr = strchr(item.data, '\t');
-		char *user_str;
-		if (ptr != nullptr)
-		{
-			*ptr++ = '\0';
-			user_str = item.data;
-		}
-		else
+	for (int i = 0; i < _topic_num; ++i)
+	{
+		int topic = candidate_topics[i];
+		double prob = (user_topic_counts[topic] + _alpha_m1) / (user_all_topic_count + _alpha_m1 * _topic_num); // theta(user, topic)
+		int prob_exp = 0;
+		for (size_t j = 0; j < topic_words.size(); ++j)
 		{
-			ptr = item.data;
-			user_str = default_user;
-		}
+			int word = topic_words[j];
 
-		auto user_iterator = user_ids.find(user_str);
-		if (user_iterator == user_ids.end())
-		{
-			char *user = utility::new_string(user_str);
-			user_ids.insert(std::make_pair(user, users.size()));
-			users.push_back(user);
-			user_counts.push_back(1);
-		}
-		else
-		{
-			++user_counts[user_iterator->second];
-		}
+			double phi = (_topic_word_counts[topic][word] + _beta_m1) / (_topic_all_word_counts[topic] + _beta_m1 * _word_num); // phi(topic, word)
+			prob *= phi;
 
-		while (*ptr)
-		{
-			char *p = strchr(ptr, ' ');
-			if (p != nullptr) *p = '\0';
-			auto word_iterator = word_ids.find(ptr);
-			if (word_iterator == word_ids.end())
+			if ((j & 15) == 15)
 			{
-				char *word = utility::new_string(ptr);
-				word_ids.insert(std::make_pair(word, words.size()));
-				words.push_back(word);
-				word_counts.push_back(1);
-			}
-			else
-			{
-				++word_counts[word_iterator->second];
+				fix_exp(prob, prob_exp);
+				if (prob_exp + 52 < max_prob_exp) break;
 			}
-
-			if (p == nullptr) break;
-			ptr = p + 1;
 		}
-	}
-
-	std::vector<int> user_indexes;
-	for (size_t i = 0; i < users.size(); ++i) user_indexes.push_back((int)i);
-	std::sort(user_indexes.begin(), user_indexes.end(), utility::index_comparer<std::vector<int>>(user_counts, true));
-	user_ids.clear();
-	FILE *fp_user = fopen(user_path, "w");
-	for (size_t i = 0; i < user_indexes.size(); ++i)
-	{
-		size_t j = user_indexes[i];
-		if (user_counts[j] < min_user_freq) break;
-		user_ids.insert(std::make_pair(users[j], i));
-		fprintf(fp_user, "%s\t%d\n", users[j], user_counts[j]);
-	}
-	fclose(fp_user);
+		
+		fix_exp(prob, prob_exp);
 
-	printf("%d users\n", (int)user_ids.size());
+		assert((prob > 0.0) && "Non-positive probability");
 
-	if (stopword_path != nullptr)
-	{
-		text_file_reader stopword_reader(stopword_path);
-		while (true)
-		{
-			file_item item = stopword_reader.get_item(false);
-			if (item.size == 0) break;
-			auto word_itor = word_ids.find(item.data);
-			if (word_itor != word_ids.end()) word_ids.erase(word_itor);
-		}
+		topic_probs[topic] = prob;
+		topic_prob_exps[topic] = prob_exp;
+		if (max_prob_exp < prob_exp) max_prob_exp = prob_exp;
 	}
 
-	std::vector<int> word_indexes;
-	for (auto word_itor : word_ids) word_indexes.push_back((int)word_itor.second);
-	std::sort(word_indexes.begin(), word_indexes.end(), utility::index_comparer<std::vector<int>>(word_counts, true));
-	word_ids.clear();
-	FILE *fp_word = fopen(word_path, "w");
-	for (size_t i = 0; i < word_indexes.size(); ++i)
+	double topic_prob_sum = 0.0;
+	for (int topic = 0; topic < _topic_num; ++topic)
 	{
-		size_t j = word_indexes[i];
-		if (word_counts[j] < min_word_freq) break;
-		word_ids.insert(std::make_pair(words[j], i));
-		fprintf(fp_word, "%s\t%d\n", words[j], word_counts[j]);
+		topic_probs[topic] = pack_exp(topic_probs[topic], topic_prob_exps[topic] - max_prob_exp);
+		topic_prob_sum += topic_probs[topic];
 	}
-	fclose(fp_word);
-
-	printf("%d words\n", (int)word_ids.size());
-	printf("Building buffer...\n");
-
-	FILE *fp_buffer = fopen(buffer_path, "wb");
-	FILE *fp_tweet_id = fopen(tweet_id_path, "wb");
-
-	reader.reset();
-
-	long long valid_tweet_count = 0, total_tweet_count = 0;
-	std::vector<int> word_buffer;
-	utility::write_buffer tweet_buffer, tweet_id_buffer;
-	while (true)
+	double topic_choice = uniform_distr(random_engine) * topic_prob_sum;
+	topic_prob_sum = 0.0;
+	int selected_topic = _topic_num - 1;
+	for (int topic = 0; topic < _topic_num; ++topic)
 	{
-		file_item item = reader.get_item(false);
-		if (item.size == 0) break;
-		++total_tweet_count;
-
-		char *ptr = strchr(item.data, '\t');
-		char *user_str;
-		if (ptr != nullptr)
+		topic_prob_sum += topic_probs[topic];
+		if (topic_choice <= topic_prob_sum)
 		{
-			*ptr++ = '\0';
-			user_str = item.data;
-		}
-		else
-		{
-			ptr = item.data;
-			user_str = default_user;
+			selected_topic = topic;
+			break;
 		}
+	}
+	return selected_topic;
+}
 
-		auto user_iterator = user_ids.find(user_str);
-		if (user_iterator == user_ids.end()) continue;
-		int user_id = (int)user_iterator->second;
+double model::_sample_word_tags(const int *words, int word_count, int topic, double theta, std::vector<char> &word_tags, std::default_random_engine &random_engine)
+{
+	std::uniform_real_distribution<double> uniform_distr(0.0, 1.0);
+	double tweet_prob = theta;
+	int tweet_prob_exp = 0;
 
-		word_buffer.clear();
-		while (*ptr)
+	// sample word whether in the selected topic or background topic
+	word_tags.clear();
+	for (int i = 0; i < word_count; i += 8)
+	{
+		char tag = 0;
+		for (int j = 0; j < 8 && i + j < word_count; ++j)
 		{
-			char *p = strchr(ptr, ' ');
-			if (p != nullptr) *p = '\0';
-			auto word_iterator = word_ids.find(ptr);
-			if (word_iterator != word_ids.end())
+			int word = words[i + j];
+			double pi0 = _total_word_counts[0] + _gamma_m1;
+			double pi1 = _total_word_counts[1] + _gamma_m1;
+			double phi0 = (_topic_word_counts[_topic_num][word] + _beta_bg_m1) / (_topic_all_word_counts[_topic_num] + _beta_bg_m1 * _word_num);
+			double phi1 = (_topic_word_counts[topic][word] + _beta_m1) / (_topic_all_word_counts[topic] + _beta_m1 * _word_num);
+			double prob0 = pi0 * phi0;
+			double prob1 = pi1 * phi1;
+			double word_choice = uniform_distr(random_engine) * (prob0 + prob1);
+			if (word_choice > prob0)
 			{
-				int word = (int)word_iterator->second;
-				word_buffer.push_back(word);
+				tag |= 1 << j;
 			}
-			if (p == nullptr) break;
-			ptr = p + 1;
+			tweet_prob *= (prob0 + prob1) / (pi0 + pi1);
 		}
+		word_tags.push_back(tag);
+		if ((i & 15) == 8) fix_exp(tweet_prob, tweet_prob_exp);
+	}
+	fix_exp(tweet_prob, tweet_prob_exp);
+	return log(tweet_prob) + tweet_prob_exp * log(2.0);
+}
 
-		if (word_buffer.empty()) continue;
-		int word_count = (int)word_buffer.size();
+double model::sample_tweet(const std::vector<int> &words, std::vector<char> &word_tags, int *topic, const int *user_topic_counts, int user_all_topic_count, sample_scratch &scratch, std::default_random_engine &random_engine)
+{
+	scratch.topic_probs.resize(_topic_num);
+	scratch.topic_prob_exps.resize(_topic_num);
+	scratch.candidate_topics.resize(_topic_num);
 
-		tweet_buffer.clear();
-		tweet_buffer.write_varint(user_id);
-		tweet_buffer.write_varint(word_count);
-		for (int i = 0; i < word_count; ++i)
-		{
-			tweet_buffer.write_varint(word_buffer[i]);
-		}
+	// all words of a new tweet are topic words until its first sample
+	scratch.topic_words.clear();
+	for (size_t i = 0; i < words.size(); ++i)
+	{
+		if (*topic < 0 || (word_tags[i / 8] & (1 << (i % 8)))) scratch.topic_words.push_back(words[i]);
+	}
 
-		utility::fwrite(tweet_buffer.buffer(), tweet_buffer.size(), fp_buffer);
-		
-		tweet_id_buffer.clear();
-		tweet_id_buffer.write_varint(total_tweet_count - 1);
-		utility::fwrite(tweet_id_buffer.buffer(), tweet_id_buffer.size(), fp_tweet_id);
+	*topic = _sample_topic(scratch.topic_words, user_topic_counts, user_all_topic_count, *topic, scratch.topic_probs.data(), scratch.topic_prob_exps.data(), scratch.candidate_topics.data(), random_engine);
+	double theta = (user_topic_counts[*topic] + _alpha_m1) / (user_all_topic_count + _alpha_m1 * _topic_num);
+	return _sample_word_tags(words.data(), (int)words.size(), *topic, theta, word_tags, random_engine);
+}
 
-		++valid_tweet_count;
+void model::add_tweet(const std::vector<int> &words, const std::vector<char> &word_tags, int topic, int count)
+{
+	for (size_t i = 0; i < words.size(); ++i)
+	{
+		int word_topic = (word_tags[i / 8] & (1 << (i % 8))) ? topic : _topic_num;
+		if (count > 0) _inc_topic_word_count(word_topic, words[i], count);
+		else _dec_topic_word_count(word_topic, words[i], -count);
 	}
-	fclose(fp_buffer);
-	fclose(fp_tweet_id);
-
-	for (size_t i = 0; i < users.size(); ++i) delete[] users[i];
-	for (size_t i = 0; i < words.size(); ++i) delete[] words[i];
+}
 
-	printf("%lld / %lld tweets\n", valid_tweet_count, total_tweet_count);
+void model::make_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, tweet_file_reader::format_version buffer_version, int shard_num, int pass_num, size_t sketch_size, int hash_num, const char *top_word_path, size_t sort_size, bool dedup, size_t thread_num)
+{
+	buffer_builder builder(thread_num);
+	builder.build(input_path, buffer_path, user_path, word_path, word_index_path, tweet_id_path, tweet_index_path, summary_path, stopword_path, min_user_freq, min_word_freq, buffer_version, shard_num, pass_num, sketch_size, hash_num, top_word_path, sort_size, dedup);
+}
 
-	FILE *fp_summary = fopen(summary_path, "w");
-	fprintf(fp_summary, "word_num=%d\n", (int)word_ids.size());
-	fprintf(fp_summary, "user_num=%d\n", (int)user_ids.size());
-	fprintf(fp_summary, "valid_tweet_num=%lld\n", valid_tweet_count);
-	fprintf(fp_summary, "total_tweet_num=%lld\n", total_tweet_count);
-	fclose(fp_summary);
+int model::append_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, bool extend, std::vector<buffer_extent> &extents, size_t thread_num)
+{
+	buffer_builder builder(thread_num);
+	return builder.append(input_path, buffer_path, user_path, word_path, word_index_path, tweet_id_path, tweet_index_path, summary_path, stopword_path, min_user_freq, min_word_freq, extend, extents);
 }
 
 void model::save_user_topic_distribution(const char *user_param_path, const char *output_path)
@@ -900,8 +1825,8 @@ void model::save_user_topic_distribution(const char *user_param_path, const char
 		file_item item = reader.get_item(false);
 		if (item.size == 0) break;
 		utility::read_buffer user_buffer(item.data, item.size);
-		int user;
-		user_buffer.read(&user);
+		int user = -1;
+		if (user_buffer.read(&user) == 0) continue;
 		std::fill(topic_counts, topic_counts + _topic_num, 0);
 		user_buffer.read_sparse_array(topic_counts, _topic_num);
 
@@ -944,9 +1869,24 @@ void model::save_topic_word_distribution(const char *output_path)
 	fclose(fp);
 }
 
-void model::save_user_topic_distribution_text(const char *user_param_path, const char *user_path, const char *output_path)
+// one line of the topic counts of a user in decreasing order, the counts are cleared as they are written
+static void write_user_topics(FILE *fp, const char *user, int *topic_counts, int *topics, int topic_num)
+{
+	std::sort(topics, topics + topic_num, utility::index_comparer<int*>(topic_counts, true));
+	fprintf(fp, "%s", user);
+	for (int i = 0; i < topic_num; ++i)
+	{
+		int topic = topics[i];
+		if (topic_counts[topic] == 0) break;
+		fprintf(fp, "\t%d %d", topic, topic_counts[topic]);
+		topic_counts[topic] = 0;
+	}
+	fprintf(fp, "\n");
+}
+
+void model::save_user_topic_distribution_text(const char *user_param_path, const char *user_path, const char *output_path, size_t sort_size)
 {
-	std::vector<char*> users;
+	utility::string_pool users;
 	text_file_reader user_reader(user_path);
 	while (true)
 	{
@@ -954,7 +1894,40 @@ void model::save_user_topic_distribution_text(const char *user_param_path, const
 		if (item.size == 0) break;
 		char *ptr = strchr(item.data, '\t');
 		if (ptr != nullptr) *ptr = '\0';
-		users.push_back(utility::new_string(item.data));
+		users.add(item.data);
+	}
+
+	// a user has a param record per run of its tweets, the runs of a user are added up into the line of its first run
+	size_t shard_count = (size_t)std::max(_shard_num, 1);
+	std::vector<long long> first_records(users.size(), -1);
+	long long record_count = 0;
+	bool is_split = false;
+	for (size_t shard = 0; shard < shard_count; ++shard)
+	{
+		char *path = utility::shard_path(user_param_path, _shard_num, (int)shard);
+		user_param_file_reader user_param_reader(path, _topic_num);
+		delete[] path;
+		while (true)
+		{
+			file_item item = user_param_reader.get_item(false);
+			if (item.size == 0) break;
+			utility::read_buffer buffer(item.data, item.size);
+			int user = -1;
+			if (buffer.read_varint(&user) == 0 || user < 0 || (size_t)user >= users.size()) continue;
+			if (first_records[user] < 0) first_records[user] = record_count;
+			else is_split = true;
+			++record_count;
+		}
+	}
+
+	// runs of a user apart from each other are brought together by sorting records by the first run of their user
+	external_sorter *sorter = nullptr;
+	if (is_split)
+	{
+		char *temp_path = new char[strlen(output_path) + 32];
+		sprintf(temp_path, "%s.sort", output_path);
+		sorter = new external_sorter(temp_path, sort_size);
+		delete[] temp_path;
 	}
 
 	int *topics = new int[_topic_num];
@@ -962,36 +1935,63 @@ void model::save_user_topic_distribution_text(const char *user_param_path, const
 	int *topic_counts = new int[_topic_num];
 	std::fill(topic_counts, topic_counts + _topic_num, 0);
 	FILE *fp = fopen(output_path, "w");
-	user_param_file_reader user_param_reader(user_param_path, _topic_num);
-	while (true)
+	long long record = 0;
+	for (size_t shard = 0; shard < shard_count; ++shard)
 	{
-		file_item item = user_param_reader.get_item(false);
-		if (item.size == 0) break;
-		
-		utility::read_buffer buffer(item.data, item.size);
-		int user;
-		buffer.read_varint(&user);
-		buffer.read_sparse_array(topic_counts, _topic_num);
-		std::sort(topics, topics + _topic_num, utility::index_comparer<int*>(topic_counts, true));
-		fprintf(fp, "%s", users[user]);
-		for (int i = 0; i < _topic_num; ++i)
+		char *path = utility::shard_path(user_param_path, _shard_num, (int)shard);
+		user_param_file_reader user_param_reader(path, _topic_num);
+		delete[] path;
+		while (true)
 		{
-			int topic = topics[i];
-			if (topic_counts[topic] == 0) break;
-			fprintf(fp, "\t%d %d", topic, topic_counts[topic]);
-			topic_counts[topic] = 0;
+			file_item item = user_param_reader.get_item(false);
+			if (item.size == 0) break;
+			
+			utility::read_buffer buffer(item.data, item.size);
+			int user = -1;
+			if (buffer.read_varint(&user) == 0 || user < 0 || (size_t)user >= users.size()) continue;
+			if (sorter != nullptr)
+			{
+				sorter->add(first_records[user], record++, item.data, item.size);
+				continue;
+			}
+			buffer.read_sparse_array(topic_counts, _topic_num);
+			write_user_topics(fp, users.get(user), topic_counts, topics, _topic_num);
 		}
-		fprintf(fp, "\n");
+	}
+	if (sorter != nullptr)
+	{
+		int *run_topic_counts = new int[_topic_num];
+		std::fill(run_topic_counts, run_topic_counts + _topic_num, 0);
+		long long first_record, seq, prev_first_record = -1;
+		int prev_user = -1;
+		file_item item;
+		while (sorter->next(&first_record, &seq, &item))
+		{
+			utility::read_buffer buffer(item.data, item.size);
+			int user = -1;
+			buffer.read_varint(&user);
+			if (first_record != prev_first_record && prev_user >= 0) write_user_topics(fp, users.get(prev_user), topic_counts, topics, _topic_num);
+			prev_first_record = first_record;
+			prev_user = user;
+			buffer.read_sparse_array(run_topic_counts, _topic_num);
+			for (int i = 0; i < _topic_num; ++i)
+			{
+				topic_counts[i] += run_topic_counts[i];
+				run_topic_counts[i] = 0;
+			}
+		}
+		if (prev_user >= 0) write_user_topics(fp, users.get(prev_user), topic_counts, topics, _topic_num);
+		delete[] run_topic_counts;
+		delete sorter;
 	}
 	fclose(fp);
 	delete[] topic_counts;
 	delete[] topics;
-	for (size_t i = 0; i < users.size(); ++i) delete[] users[i];
 }
 
 void model::save_topic_word_distribution_text(const char *word_path, const char *output_path)
 {
-	std::vector<char*> words;
+	utility::string_pool words;
 	text_file_reader reader(word_path);
 	while (true)
 	{
@@ -999,7 +1999,7 @@ void model::save_topic_word_distribution_text(const char *word_path, const char
 		if (item.size == 0) break;
 		char *ptr = strchr(item.data, '\t');
 		if (ptr != nullptr) *ptr = '\0';
-		words.push_back(utility::new_string(item.data));
+		words.add(item.data);
 	}
 	if (words.size() != (size_t)_word_num)
 	{
@@ -1019,40 +2019,173 @@ void model::save_topic_word_distribution_text(const char *word_path, const char
 			int k = indexes[j];
 			int count = _topic_word_counts[i][k];
 			if (count == 0) break;
-			fprintf(fp, "\t%s %d", words[k], count);
+			fprintf(fp, "\t%s %d", words.get(k), count);
 		}
 		fprintf(fp, "\n");
 	}
 	fclose(fp);
 	delete[] indexes;
-	for (size_t i = 0; i < words.size(); ++i) delete[] words[i];
 }
 
-void model::save_tweet_topic_text(const char *tweet_param_path, const char *tweet_path, const char *tweet_id_path, const char *output_path)
+// reads tweet ids and topics of one shard, tweet ids are increasing
+// every id of a weighted tweet is handed out in turn with its topic
+struct tweet_topic_source
+{
+	tweet_param_file_reader *tweet_param_reader;
+	tweet_file_reader *buffer_reader;
+	tweet_id_file_reader *tweet_id_reader;
+	tweet_index index;
+	std::vector<long long> tweet_ids;
+	size_t next_tweet_id;
+	long long tweet_id;
+	int topic;
+};
+
+static bool next_tweet_topic(tweet_topic_source &source)
+{
+	if (source.next_tweet_id < source.tweet_ids.size())
+	{
+		source.tweet_id = source.tweet_ids[source.next_tweet_id++];
+		return true;
+	}
+
+	bool is_fixed = source.tweet_param_reader->version() == tweet_param_file_reader::format_version::fixed;
+	if (is_fixed)
+	{
+		file_item buffer_item = source.buffer_reader->get_item(false);
+		utility::read_buffer buffer(buffer_item.data, buffer_item.size);
+		int user, word_count = 0;
+		if (buffer.read_varint(&user) > 0) buffer.read_varint(&word_count);
+		source.tweet_param_reader->set_word_count(word_count);
+	}
+	file_item tweet_param_item = source.tweet_param_reader->get_item(false);
+	file_item tweet_id_item = source.tweet_id_reader->get_item(false);
+	if (tweet_param_item.size == 0 || tweet_id_item.size == 0)
+	{
+		if (tweet_param_item.size != tweet_id_item.size)
+		{
+			printf("Tweet file and parameter file not match\n");
+		}
+		return false;
+	}
+	utility::read_buffer tweet_param_buffer(tweet_param_item.data, tweet_param_item.size);
+	if (is_fixed)
+	{
+		tweet_param_file_reader::read_topic(tweet_param_buffer, source.tweet_param_reader->version(), source.tweet_param_reader->topic_size(), 0, &source.topic);
+	}
+	else
+	{
+		tweet_param_buffer.read_varint(&source.topic);
+	}
+	utility::read_buffer tweet_id_buffer(tweet_id_item.data, tweet_id_item.size);
+	tweet_id_file_reader::read_tweet_ids(tweet_id_buffer, source.tweet_id_reader->weighted(), source.tweet_ids);
+	source.tweet_id = source.tweet_ids[0];
+	source.next_tweet_id = 1;
+	return true;
+}
+
+void model::save_tweet_topic_text(const char *tweet_param_path, const char *param_index_path, const char *tweet_path, const char *buffer_path, const char *tweet_id_path, const char *tweet_index_path, const char *output_path, long long start, long long count, size_t sort_size)
 {
-	tweet_param_file_reader tweet_param_reader(tweet_param_path);
 	text_file_reader tweet_reader(tweet_path);
-	tweet_id_file_reader tweet_id_reader(tweet_id_path);
 	long long tweet_count = 0;
+	long long end = (count < 0) ? std::numeric_limits<long long>::max() : start + count;
+	bool text_indexed = start > 0 && same_text(tweet_path); // lines of any other text are skipped up to start
+
+	// tweets of all shards are merged back into line order
+	size_t shard_count = (size_t)std::max(_shard_num, 1);
+	std::vector<tweet_topic_source> sources(shard_count);
+	for (size_t i = 0; i < shard_count; ++i)
+	{
+		char *paths[5] =
+		{
+			utility::shard_path(tweet_param_path, _shard_num, (int)i),
+			utility::shard_path(param_index_path, _shard_num, (int)i),
+			utility::shard_path(buffer_path, _shard_num, (int)i),
+			utility::shard_path(tweet_id_path, _shard_num, (int)i),
+			utility::shard_path(tweet_index_path, _shard_num, (int)i)
+		};
+		tweet_topic_source &source = sources[i];
+		source.tweet_param_reader = new tweet_param_file_reader(paths[0]);
+		bool is_fixed = source.tweet_param_reader->version() == tweet_param_file_reader::format_version::fixed;
+		source.buffer_reader = new tweet_file_reader(paths[2], is_fixed ? (16 << 20) : 1); // word counts of fixed size params
+		source.tweet_id_reader = new tweet_id_file_reader(paths[3], source.buffer_reader->weighted());
+		source.next_tweet_id = 0;
+
+		// jump to the block containing the first line, blocks of a sorted buffer are not in line order
+		if (start > 0 && !_sorted && source.index.load(paths[4], paths[1]) && source.index.has_param())
+		{
+			size_t j = source.index.find_tweet_id(start);
+			const tweet_index_item &item = source.index.item(j);
+			if (item.tweet_id <= start)
+			{
+				source.tweet_param_reader->seek(source.index.param_item(j).tweet_param_offset);
+				source.buffer_reader->seek(item.tweet_offset);
+				source.tweet_id_reader->seek(item.tweet_id_offset);
+				if (text_indexed && tweet_count < item.tweet_id)
+				{
+					tweet_reader.seek(item.text_offset);
+					tweet_count = item.tweet_id;
+				}
+			}
+		}
+		if (!next_tweet_topic(source)) source.tweet_id = -1;
+		for (int j = 0; j < 5; ++j) delete[] paths[j];
+	}
+
+	// tweets of a sorted buffer are sorted back into line order, otherwise shards are merged by line
+	external_sorter *sorter = nullptr;
+	if (_sorted)
+	{
+		char *temp_path = new char[strlen(output_path) + 32];
+		sprintf(temp_path, "%s.sort", output_path);
+		sorter = new external_sorter(temp_path, sort_size);
+		delete[] temp_path;
+
+		utility::write_buffer topic_buffer;
+		for (size_t i = 0; i < shard_count; ++i)
+		{
+			tweet_topic_source &source = sources[i];
+			while (source.tweet_id >= 0)
+			{
+				if (source.tweet_id >= start && source.tweet_id < end)
+				{
+					topic_buffer.clear();
+					topic_buffer.write_varint(source.topic);
+					sorter->add(source.tweet_id, 0, topic_buffer.buffer(), topic_buffer.size());
+				}
+				if (!next_tweet_topic(source)) source.tweet_id = -1;
+			}
+		}
+	}
+
 	FILE *fp = fopen(output_path, "w");
 	while (true)
 	{
-		file_item tweet_param_item = tweet_param_reader.get_item(false);
-		file_item tweet_id_item = tweet_id_reader.get_item(false);
-		if (tweet_param_item.size == 0 || tweet_id_item.size == 0)
+		long long tweet_id;
+		int topic = -1;
+		if (sorter != nullptr)
+		{
+			long long seq;
+			file_item item;
+			if (!sorter->next(&tweet_id, &seq, &item)) break;
+			utility::read_buffer topic_buffer(item.data, item.size);
+			topic_buffer.read_varint(&topic);
+		}
+		else
 		{
-			if (tweet_param_item.size != tweet_id_item.size)
+			tweet_topic_source *source = nullptr;
+			for (size_t i = 0; i < shard_count; ++i)
 			{
-				printf("Tweet file and parameter file not match\n");
+				if (sources[i].tweet_id >= 0 && (source == nullptr || sources[i].tweet_id < source->tweet_id)) source = &sources[i];
 			}
-			break;
+			if (source == nullptr) break;
+			tweet_id = source->tweet_id;
+			topic = source->topic;
+			if (!next_tweet_topic(*source)) source->tweet_id = -1;
 		}
-		utility::read_buffer tweet_param_buffer(tweet_param_item.data, tweet_param_item.size);
-		int topic;
-		tweet_param_buffer.read_varint(&topic);
-		utility::read_buffer tweet_id_buffer(tweet_id_item.data, tweet_id_item.size);
-		long long tweet_id;
-		tweet_id_buffer.read_varint(&tweet_id);
+
+		if (tweet_id < start) continue;
+		if (tweet_id >= end) break;
 
 		while (tweet_count <= tweet_id)
 		{
@@ -1064,7 +2197,7 @@ void model::save_tweet_topic_text(const char *tweet_param_path, const char *twee
 			}
 			++tweet_count;
 
-			fprintf(fp, "%d\t%s\n", (tweet_count == tweet_id + 1) ? topic : -1, tweet_item.data);
+			if (tweet_count > start) fprintf(fp, "%d\t%s\n", (tweet_count == tweet_id + 1) ? topic : -1, tweet_item.data);
 		}
 
 		if (tweet_count != tweet_id + 1)
@@ -1074,6 +2207,14 @@ void model::save_tweet_topic_text(const char *tweet_param_path, const char *twee
 		}
 	}
 	fclose(fp);
+	delete sorter;
+
+	for (size_t i = 0; i < shard_count; ++i)
+	{
+		delete sources[i].tweet_param_reader;
+		delete sources[i].buffer_reader;
+		delete sources[i].tweet_id_reader;
+	}
 }
 
 int model::infer(std::vector<int> &words, infer_mode mode, double *probs)
@@ -1163,4 +2304,61 @@ int model::infer(std::vector<int> &words, infer_mode mode, double *probs)
 	}
 
 	return selected_topic;
+}
+
+double model::complete(const std::vector<int> &observed_words, const std::vector<int> &held_words, const double *user_topic_counts, double *topic_probs, double *held_log_probs)
+{
+	double user_all_topic_count = 0.0;
+	for (int topic = 0; topic < _topic_num; ++topic) user_all_topic_count += user_topic_counts[topic];
+	double pi_sum = _total_word_counts[0] + _total_word_counts[1] + _gamma_m1 * 2;
+	double pi0 = (_total_word_counts[0] + _gamma_m1) / pi_sum;
+	double pi1 = (_total_word_counts[1] + _gamma_m1) / pi_sum;
+
+	double max_log_prob = -std::numeric_limits<double>::infinity();
+	for (int topic = 0; topic < _topic_num; ++topic)
+	{
+		double theta = (user_topic_counts[topic] + _alpha_m1) / (user_all_topic_count + _alpha_m1 * _topic_num);
+		topic_probs[topic] = log(theta) + _mixture_log_prob(observed_words, topic, pi0, pi1);
+		held_log_probs[topic] = _mixture_log_prob(held_words, topic, pi0, pi1);
+		max_log_prob = std::max(max_log_prob, topic_probs[topic]);
+	}
+
+	// log sum over topics of the posterior times the held-out probability, relative to the largest terms
+	double max_held_log_prob = -std::numeric_limits<double>::infinity();
+	for (int topic = 0; topic < _topic_num; ++topic)
+	{
+		topic_probs[topic] -= max_log_prob;
+		held_log_probs[topic] += topic_probs[topic];
+		max_held_log_prob = std::max(max_held_log_prob, held_log_probs[topic]);
+	}
+	double prob_sum = 0.0, held_prob_sum = 0.0;
+	for (int topic = 0; topic < _topic_num; ++topic)
+	{
+		topic_probs[topic] = exp(topic_probs[topic]);
+		prob_sum += topic_probs[topic];
+		held_prob_sum += exp(held_log_probs[topic] - max_held_log_prob);
+	}
+	for (int topic = 0; topic < _topic_num; ++topic) topic_probs[topic] /= prob_sum;
+	return max_held_log_prob + log(held_prob_sum) - log(prob_sum);
+}
+
+double model::_mixture_log_prob(const std::vector<int> &words, int topic, double pi0, double pi1)
+{
+	// every word is drawn from the background or the topic, products of 8 words stay far above underflow
+	int *bg_word_counts = _topic_word_counts[_topic_num];
+	int *word_counts = _topic_word_counts[topic];
+	double bg_sum = _topic_all_word_counts[_topic_num] + _beta_bg_m1 * _word_num;
+	double sum = _topic_all_word_counts[topic] + _beta_m1 * _word_num;
+	double log_prob = 0.0, prob = 1.0;
+	for (size_t i = 0; i < words.size(); ++i)
+	{
+		int word = words[i];
+		prob *= pi0 * (bg_word_counts[word] + _beta_bg_m1) / bg_sum + pi1 * (word_counts[word] + _beta_m1) / sum;
+		if ((i & 7) == 7)
+		{
+			log_prob += log(prob);
+			prob = 1.0;
+		}
+	}
+	return log_prob + log(prob);
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include "file_reader.h"
 #include "utility.h"
 #include "parallel.h"
+#include "tweet_index.h"
+#include "async_io.h"
 #include <unordered_set>
 #include <unordered_map>
 #include <thread>
@@ -18,59 +20,224 @@ public:
 		probability, score
 	};
 
+	// scratch of one thread sampling tweets one at a time
+	struct sample_scratch
+	{
+		std::vector<int> topic_words;
+		std::vector<double> topic_probs;
+		std::vector<int> topic_prob_exps;
+		std::vector<int> candidate_topics;
+	};
+
+	// params of a model in an iteration of a group
+	struct param_paths
+	{
+		const char *input_user_path, *input_tweet_path;
+		const char *output_user_path, *output_tweet_path, *output_index_path;
+	};
+
 	model(const char *summary_path, int topic_num, double alpha_m1, double beta_m1, double beta_bg_m1, double gamma_m1, size_t thread_num);
 	model(int topic_num, int word_num, double alpha_m1, double beta_m1, double beta_bg_m1, double gamma_m1, size_t thread_num);
 	model(const char *hyper_param_path, size_t thread_num);
 	~model();
 
-	void init_param(const char *tweet_path, const char *user_param_path, const char *tweet_param_path, unsigned int rand_seed = 5489);
+	void init_param(const char *tweet_path, const char *tweet_index_path, const char *user_param_path, const char *tweet_param_path, const char *param_index_path, tweet_param_file_reader::format_version tweet_param_version = tweet_param_file_reader::format_version::varint, bool warm = false, unsigned int rand_seed = 5489);
+	void append_param(const std::vector<buffer_extent> &extents, int word_num, const char *tweet_path, const char *tweet_index_path, const char *user_param_path, const char *tweet_param_path, const char *param_index_path, unsigned int rand_seed = 5489);
 	void load_hyper_param(const char *path);
 	void save_hyper_param(const char *path);
 	void load_topic_param(const char *path);
+	bool load_warm_topic_param(const char *topic_param_path, const char *warm_word_path, const char *word_path);
 	void save_topic_param(const char *path);
-	double iterate(const char *tweet_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path);
+	double iterate(const char *tweet_path, const char *tweet_index_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, const char *output_index_path, double *log_likelihood = nullptr, int iteration = 0);
+
+	// one iteration of models with their own params over the same buffer, the first model reads and decodes every
+	// batch and the others sample it from its memory; models need the same shards and slice count, so the same thread num
+	static void iterate(std::vector<model*> &models, const char *tweet_path, const char *tweet_index_path, size_t batch_size, const std::vector<param_paths> &paths, double *update_ratios, double *log_likelihoods);
+
+	// removes topics whose word count is below threshold times the mean of a topic, returns the number removed;
+	// params keep the old topic numbers until the next iteration renumbers them, so one must follow
+	int prune_topics(double threshold);
+
+	// numbered iterations write a checkpoint at a batch boundary every interval seconds and when they finish;
+	// the first iteration run resumes from a checkpoint of its own or of the previous iteration
+	void set_checkpoint(const char *path, double interval);
+	int checkpoint_iteration(); // first iteration to run from the checkpoint, 0 if there is none
+
+	// the counts of the finished iteration of the checkpoint, for a run that ended before saving its topic params
+	bool restore_finished_iteration();
 
 	int infer(std::vector<int> &words, infer_mode mode, double *probs = nullptr);
 
+	// streaming training resamples a tweet against the current counts and moves its counts in or out with add_tweet,
+	// a topic of -1 is a new tweet with all words in the topic, word tags are packed 8 words a byte as in tweet params;
+	// returns the log-likelihood of the tweet, the counts are only read so threads may sample concurrently
+	double sample_tweet(const std::vector<int> &words, std::vector<char> &word_tags, int *topic, const int *user_topic_counts, int user_all_topic_count, sample_scratch &scratch, std::default_random_engine &random_engine);
+	void add_tweet(const std::vector<int> &words, const std::vector<char> &word_tags, int topic, int count);
+
+	// log probability of the held-out words of a tweet given its observed words and the topic counts of its user,
+	// fills topic_probs with the topic posterior given the observed words, held_log_probs is scratch of topic_num
+	double complete(const std::vector<int> &observed_words, const std::vector<int> &held_words, const double *user_topic_counts, double *topic_probs, double *held_log_probs);
+
 	void save_user_topic_distribution(const char *user_param_path, const char *output_path);
 	void save_topic_word_distribution(const char *output_path);
 
-	void save_user_topic_distribution_text(const char *user_param_path, const char *user_path, const char *output_path);
+	void save_user_topic_distribution_text(const char *user_param_path, const char *user_path, const char *output_path, size_t sort_size = 16 << 20);
 	void save_topic_word_distribution_text(const char *word_path, const char *output_path);
-	void save_tweet_topic_text(const char *tweet_param_path, const char *tweet_path, const char *tweet_id_path, const char *output_path);
+	void save_tweet_topic_text(const char *tweet_param_path, const char *param_index_path, const char *tweet_path, const char *buffer_path, const char *tweet_id_path, const char *tweet_index_path, const char *output_path, long long start = 0, long long count = -1, size_t sort_size = 16 << 20);
 
 	double topic_word_density();
 
 	int topic_num() const;
 	int word_num() const;
+	int shard_num() const;
+	int hash_num() const;
+	bool sorted() const;
+
+	// text_path is the text the buffer was built from, so the text offsets of its tweet index locate lines in it
+	bool same_text(const char *text_path) const;
 
-	static void make_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *tweet_id_path, const char *summary_path, const char *stopword_path = nullptr, int min_user_freq = 0, int min_word_freq = 0);
+	static int append_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path, int min_user_freq, int min_word_freq, bool extend, std::vector<buffer_extent> &extents, size_t thread_num = 1);
+	static void make_buffer(const char *input_path, const char *buffer_path, const char *user_path, const char *word_path, const char *word_index_path, const char *tweet_id_path, const char *tweet_index_path, const char *summary_path, const char *stopword_path = nullptr, int min_user_freq = 0, int min_word_freq = 0, tweet_file_reader::format_version buffer_version = tweet_file_reader::format_version::varint, int shard_num = 0, int pass_num = 2, size_t sketch_size = 0, int hash_num = 0, const char *top_word_path = nullptr, size_t sort_size = 0, bool dedup = false, size_t thread_num = 1);
 
 private:
+	// readers, writers and user parameters of one buffer shard during an iteration
+	struct shard
+	{
+		shard(const char *tweet_path, const char *tweet_index_path, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, int topic_num, size_t batch_size, bool resume = false);
+		~shard();
+
+		tweet_file_reader *tweet_reader;
+		tweet_param_file_reader *tweet_param_reader;
+		user_param_file_reader *user_param_reader;
+		file_writer *user_param_writer, *tweet_param_writer;
+		tweet_index index;
+		param_index_writer *index_writer;
+		bool in_place;
+		long long user_param_size, tweet_param_offset, dirty_tweet_param_size;
+
+		std::vector<char*> tweet_ptrs;
+		std::vector<char*> tweet_param_ptrs;
+
+		// one user parameter record per run of tweets of the same user, a user may have several runs
+		size_t user_count;
+		int prev_user;
+		std::vector<int> tweet_user_indexes;
+		std::vector<int*> user_topic_counts;
+		std::vector<int> user_all_topic_counts;
+		std::vector<int> user_ids;
+		std::vector<int> pruned_topic_counts; // user param of the numbering before a prune
+	};
+
+	// tweets of a slice decoded once, shared by all models of a group
+	struct decoded_slice
+	{
+		std::vector<int> users, weights, words, scratch;
+		std::vector<size_t> word_offsets; // one more than the tweets
+	};
+
+	// a count added by a thread that does not count into the model, one per word of the tweets initialized
+	struct count_delta
+	{
+		int topic;
+		int word;
+		int count;
+	};
+
+	// a few whole index blocks of a shard whose parameters are initialized by one thread
+	struct init_range
+	{
+		tweet_file_reader *tweet_reader;
+		const tweet_index *index;
+		int shard;
+		size_t start_block, end_block;
+		unsigned int rand_seed;
+		bool warm; // topics are inferred from the loaded counts instead of drawn uniformly
+		int **topic_word_counts; // the model counts for the first thread, nullptr when counting into count_deltas
+		std::vector<count_delta> count_deltas; // added to the model by the reading thread after each round
+		utility::write_buffer user_param_buffer, tweet_param_buffer;
+		std::vector<size_t> user_param_sizes, tweet_param_sizes;
+	};
+
+	static const size_t init_round_blocks = 16;
+
 	int _topic_num;
 	int _word_num;
+	int _shard_num;
+	int _hash_num; // trailing words are hash buckets
+	bool _sorted; // buffer tweets are grouped by user instead of in line order
+	long long _text_size; // of the text the buffer was built from, -1 if unknown
+	unsigned long long _text_hash; // fingerprint of that text, 0 if unknown
 	
 	int **_topic_word_counts;
 	long long *_total_word_counts;
 	long long *_topic_all_word_counts;
+	std::vector<int> _topic_map; // topic of the params to its number after a prune, -1 if pruned, empty without a prune
 
 	double _alpha_m1, _beta_m1, _beta_bg_m1, _gamma_m1;
 
+	tweet_file_reader::format_version _tweet_version;
+	bool _tweet_weighted; // identical tweets of a user are collapsed into one with a weight
+	tweet_param_file_reader::format_version _tweet_param_version;
+	int _tweet_param_topic_size;
+
+	// batches are split into slices, each belongs to one shard and is sampled by one thread
+	size_t _slice_num;
+	shard **_slice_shards;
+	size_t *_slice_starts; // index of first tweet of the slice in its shard batch
 	utility::read_buffer *_tweet_read_buffers;
 	utility::write_buffer *_tweet_param_write_buffers;
 	utility::read_buffer *_tweet_param_read_buffers;
 	std::default_random_engine *_random_engines;
-
-	std::unordered_map<int, int> _user_indexes;
-	std::vector<int*> _user_topic_counts;
-	std::vector<int> _user_all_topic_counts;
-	std::vector<int> _user_ids;
+	double *_slice_log_likelihoods; // sum over the tweets of a slice, weighted by copies
+	decoded_slice *_decoded_slices;
+
+	std::vector<shard*> _shards;
+	const char *_checkpoint_path;
+	double _checkpoint_interval;
+	int _resume_iteration; // iteration resuming from the checkpoint when it begins, 0 once resumed or without one
+	bool _reading;
+	bool _encoding_topics, _decoding_topics;
+	utility::write_buffer *_topic_row_buffers; // one per row being encoded
+	const char *_topic_rows; // rows being decoded and their end offsets
+	const long long *_topic_row_ends;
+	const model *_leader; // model of the group whose batches are sampled, nullptr when reading alone
+	int _iteration;
+	bool _checkpointing;
+	long long _process_word_count, _update_word_count;
+	double _log_likelihood_sum;
+	bool _initializing;
+	init_range *_init_ranges;
 
 	void _init();
+	void _init_slices(size_t slice_num);
 	void _update(size_t id);
 
-	void _sample(utility::read_buffer &tweet_read_buffer, utility::read_buffer &tweet_param_read_buffer, utility::write_buffer &tweet_param_write_buffer, std::default_random_engine &random_engine);
-	inline void _inc_topic_word_count(int topic, int word);
-	inline void _dec_topic_word_count(int topic, int word);
+	void _init_range(init_range &range);
+	int _init_tweet(const std::vector<int> &words, int weight, int topic, int **topic_word_counts, std::vector<count_delta> *count_deltas, utility::write_buffer &tweet_param_buffer, tweet_param_file_reader::format_version tweet_param_version, int topic_size, std::default_random_engine &random_engine);
+	void _resize_words(int word_num);
+	void _sum_topic_word_counts();
+	void _encode_topic_rows(size_t start, size_t step);
+	void _decode_topic_rows(size_t start, size_t step);
+
+	double _mixture_log_prob(const std::vector<int> &words, int topic, double pi0, double pi1);
+
+	bool _load_checkpoint(std::vector<char> &data, utility::read_buffer &buffer, int *iteration, bool *complete);
+	bool _read_checkpoint(int iteration, std::vector<char> &data, utility::read_buffer &buffer, bool *complete);
+	bool _restore_checkpoint(utility::read_buffer &buffer, bool complete, long long *process_word_count, long long *update_word_count, double *log_likelihood);
+	void _write_checkpoint(int iteration, bool complete, long long process_word_count, long long update_word_count, double log_likelihood);
+
+	void _begin_iteration(const char *tweet_path, const char *tweet_index_path, size_t batch_size, const char *input_user_path, const char *input_tweet_path, const char *output_user_path, const char *output_tweet_path, int iteration, const model *leader);
+	bool _read_batches();
+	void _decode_slice(size_t i);
+	void _merge_batches();
+	void _read_progress(long long *position, long long *size) const;
+	double _end_iteration(const char *output_index_path, double *log_likelihood);
+
+	void _read_batch(shard &s, const shard *leader);
+	void _sample(shard &s, size_t start, const decoded_slice &slice, utility::read_buffer &tweet_param_read_buffer, utility::write_buffer &tweet_param_write_buffer, std::default_random_engine &random_engine, double &log_likelihood);
+	int _sample_topic(const std::vector<int> &topic_words, const int *user_topic_counts, int user_all_topic_count, int prev_topic, double *topic_probs, int *topic_prob_exps, int *candidate_topics, std::default_random_engine &random_engine);
+	double _sample_word_tags(const int *words, int word_count, int topic, double theta, std::vector<char> &word_tags, std::default_random_engine &random_engine);
+	inline void _inc_topic_word_count(int topic, int word, int count);
+	inline void _dec_topic_word_count(int topic, int word, int count);
 };
 
@@ -8,7 +8,10 @@ static const char *option_names[][2] =
 	{ "thread", "Number of threads (default 1)" },
 	{ "batch", "Batch size in megabyte (default 16)" },
 	{ "iterate", "Number of iterations (default 100)" },
-	{ "input", "Input tweet text file" },
+	{ "stop-when", "Stop before the last iteration, likelihood:<x> once log-likelihood changed less than x relatively over the window, update:<x> once update ratio stayed below x over the window (default never)" },
+	{ "stop-window", "Number of iterations of the stop criterion (default 3)" },
+	{ "prune", "Remove topics whose word count fell below x times the mean of a topic after an iteration, not with checkpoints (default 0, never)" },
+	{ "input", "Input tweet text file, may be gzip compressed" },
 	{ "output", "Output text file" },
 	{ "hyper-param", "Hyperparameter file" },
 	{ "alpha-m1", "Alpha minus one (default 0.5)" },
@@ -22,19 +25,47 @@ static const char *option_names[][2] =
 	{ "stopword", "Stopwords list file" },
 	{ "user-freq", "Minimum user frequency (default 1)" },
 	{ "word-freq", "Minimum word frequency (default 1)" },
+	{ "buffer-version", "Buffer format, 1 varint or 2 stream vbyte (default 1)" },
+	{ "param-version", "Tweet parameter format, 1 varint or 2 fixed size updated in place (default 1)" },
+	{ "start", "First line of input text to process (default 0)" },
+	{ "count", "Number of lines of input text to process (default all)" },
+	{ "io", "File I/O backend, sync, thread or uring (default sync)" },
+	{ "shard", "Number of user disjoint buffer shards (default 0, not sharded)" },
+	{ "pass", "Number of passes over input text, 1 encodes provisional ids and remaps them (default 2)" },
+	{ "sketch", "Memory in MB of frequency sketches that rule out rare users and words before exact counting (default 0, not sketched)" },
+	{ "hash", "Number of hashed word buckets, builds in one pass without frequency thresholds (default 0, exact vocabulary)" },
+	{ "top-word", "Exact top words list file for hashed mode" },
+	{ "sort", "Memory in MB of external sort grouping buffer tweets by user (default 0, line order unless a user's tweets are apart)" },
+	{ "dedup", "Collapse identical tweets of a user into one weighted tweet, 1 or 0, sorts with 16 MB unless sort is given (default 0)" },
+	{ "delimiter", "Characters separating words, \\t for tab, \\\\ for backslash (default space)" },
+	{ "warm-param", "Path prefix of parameter files of a previous model with the same number of topics to initialize from" },
+	{ "warm-buffer", "Path prefix of buffer files of the previous model, mapping its words by string (default buffer)" },
+	{ "held-out", "Held-out tweet text file, its perplexity is reported after every iteration" },
+	{ "fold-in", "Fold in topics of users unseen in training from the observed half of their held-out tweets, 1 or 0 (default 0, uniform topics)" },
+	{ "checkpoint", "Checkpoint file of training in progress, resumed when present and removed when training finishes" },
+	{ "checkpoint-interval", "Seconds between checkpoints within an iteration (default 600)" },
+	{ "config", "File of further models trained in the same pass over the buffer, a line of output-param hyper-param [topic=<n>] [alpha-m1=<x>] [beta-m1=<x>] [beta-bg-m1=<x>] [gamma-m1=<x>] per model, unset values as given for the first" },
+	{ "step", "Number of new tweets sampled into a stream model at a time (default 1000)" },
+	{ "window", "Number of latest tweets whose counts make up a stream model (default 100000)" },
+	{ "sweep", "Number of times the new tweets of a step and as many older ones of the window are resampled (default 2)" },
+	{ "snapshot", "Number of stream tweets between topic parameter snapshots (default 100000)" },
+	{ "extend", "Give new users and words of appended text new ids, 1 or 0 (default 0, their tweets and words are dropped)" },
 	{ nullptr, nullptr }
 };
 
 static const char *command_names[][4] =
 {
-	{ "make-buffer", "Convert text corpus to binary buffer", "[stopword] [user-freq] [word-freq] input", "buffer" },
-	{ "train", "Train the model", "[thread] [batch] [iterate] [alpha-m1] [beta-m1] [beta-bg-m1] [gamma-m1] [topic] buffer", "output-param hyper-param" },
-	{ "train-cont", "Continue training the model", "[thread] [batch] [iterate] input-param buffer hyper-param", "output-param" },
-	{ "infer-prob", "Infer top topic (in terms of probability) from text file", "[thread] [batch] input buffer hyper-param input-param", "output" },
-	{ "infer-score", "Infer top topic (in terms of score) from text file", "[thread] [batch] input buffer hyper-param input-param", "output" },
+	{ "make-buffer", "Convert text corpus to binary buffer", "[thread] [stopword] [user-freq] [word-freq] [buffer-version] [shard] [pass] [sketch] [hash] [top-word] [sort] [dedup] [delimiter] [io] input", "buffer" },
+	{ "append-buffer", "Append text following the corpus of a buffer, and initial parameters of its tweets", "[thread] [stopword] [user-freq] [word-freq] [extend] [input-param] [hyper-param] [delimiter] [io] input buffer", "buffer" },
+	{ "train", "Train the model", "[thread] [batch] [iterate] [alpha-m1] [beta-m1] [beta-bg-m1] [gamma-m1] [topic] [param-version] [warm-param] [warm-buffer] [stop-when] [stop-window] [prune] [held-out] [fold-in] [checkpoint] [checkpoint-interval] [config] [delimiter] [io] buffer", "output-param hyper-param" },
+	{ "train-cont", "Continue training the model", "[thread] [batch] [iterate] [stop-when] [stop-window] [held-out] [fold-in] [checkpoint] [checkpoint-interval] [delimiter] [io] input-param buffer hyper-param", "output-param" },
+	{ "infer-prob", "Infer top topic (in terms of probability) from text file", "[thread] [batch] [start] [count] [delimiter] [io] input buffer hyper-param input-param", "output" },
+	{ "infer-score", "Infer top topic (in terms of score) from text file", "[thread] [batch] [start] [count] [delimiter] [io] input buffer hyper-param input-param", "output" },
+	{ "train-stream", "Train the model online over a sliding window of a text stream, input - reads standard input", "[thread] [step] [window] [sweep] [snapshot] [alpha-m1] [beta-m1] [beta-bg-m1] [gamma-m1] [topic] [warm-param] [warm-buffer] [delimiter] input buffer", "output-param hyper-param" },
+	{ "eval", "Evaluate held-out perplexity of text file by document completion", "[thread] [batch] [fold-in] [delimiter] [io] input buffer hyper-param input-param", "[output]" },
 	{ "dump-topic", "Dump topic-word distribution to text file", "buffer hyper-param input-param", "output" },
 	{ "dump-user", "Dump user-topic distribution to text file", "buffer hyper-param input-param", "output" },
-	{ "dump-tweet", "Dump topic of tweet to text file", "input buffer hyper-param input-param", "output" },
+	{ "dump-tweet", "Dump topic of tweet to text file", "[batch] [start] [count] [io] input buffer hyper-param input-param", "output" },
 	{ nullptr, nullptr, nullptr, nullptr }
 };
 
@@ -46,21 +77,50 @@ static void delete_string(const char *ptr)
 option::option()
 {
 	input_text_path = output_text_path = nullptr;
-	tweet_buffer_path = tweet_id_path = word_path = user_path = summary_path = nullptr;
+	tweet_buffer_path = tweet_id_path = tweet_index_path = word_path = word_index_path = user_path = summary_path = nullptr;
 	input_param_path_prefix = output_param_path_prefix = nullptr;
 	input_tweet_param_path = output_tweet_param_path = nullptr;
 	input_user_param_path = output_user_param_path = nullptr;
 	input_topic_param_path = output_topic_param_path = nullptr;
+	input_param_index_path = output_param_index_path = nullptr;
 	hyper_param_path = nullptr;
+	warm_topic_param_path = warm_word_path = nullptr;
+	held_out_path = nullptr;
+	fold_in = false;
+	checkpoint_path = nullptr;
+	checkpoint_interval = 600.0;
+	config_path = nullptr;
+	step_size = 1000;
+	window_size = 100000;
+	sweep_num = 2;
+	snapshot_size = 100000;
 	command = nullptr;
 	stopword_path = nullptr;
 
 	min_word_freq = 1;
 	min_user_freq = 1;
+	buffer_version = 1;
+	param_version = 1;
+	io_mode = async_io::io_mode::sync;
+	shard_num = 0;
+	pass_num = 2;
+	sketch_size = 0;
+	hash_num = 0;
+	top_word_path = nullptr;
+	sort_size = 0;
+	extend = false;
+	dedup = false;
+	delimiters = nullptr;
 
 	thread_num = 1;
 	batch_size = 16 << 20;
 	iteration_num = 100;
+	stop_when = stop_criterion::never;
+	stop_threshold = 0.0;
+	stop_window = 3;
+	prune_threshold = 0.0;
+	start_line = 0;
+	line_count = -1;
 
 	alpha_m1 = 0.5;
 	beta_m1 = 0.01;
@@ -76,7 +136,9 @@ option::~option()
 	delete_string(output_text_path);
 	delete_string(tweet_buffer_path);
 	delete_string(tweet_id_path);
+	delete_string(tweet_index_path);
 	delete_string(word_path);
+	delete_string(word_index_path);
 	delete_string(user_path);
 	delete_string(summary_path);
 	delete_string(input_param_path_prefix);
@@ -87,9 +149,18 @@ option::~option()
 	delete_string(output_user_param_path);
 	delete_string(input_topic_param_path);
 	delete_string(output_topic_param_path);
+	delete_string(input_param_index_path);
+	delete_string(output_param_index_path);
 	delete_string(hyper_param_path);
+	delete_string(warm_topic_param_path);
+	delete_string(warm_word_path);
+	delete_string(held_out_path);
+	delete_string(checkpoint_path);
+	delete_string(config_path);
 	delete_string(command);
 	delete_string(stopword_path);
+	delete_string(top_word_path);
+	delete_string(delimiters);
 }
 
 bool option::parse(int argc, char *argv[])
@@ -138,6 +209,46 @@ bool option::parse(int argc, char *argv[])
 		{
 			iteration_num = atoi(option_value);
 		}
+		else if (strcmp(option_name + 2, "stop-when") == 0)
+		{
+			const char *threshold = strchr(option_value, ':');
+			size_t len = (threshold == nullptr) ? 0 : threshold - option_value;
+			if (len == strlen("likelihood") && strncmp(option_value, "likelihood", len) == 0)
+			{
+				stop_when = stop_criterion::likelihood;
+			}
+			else if (len == strlen("update") && strncmp(option_value, "update", len) == 0)
+			{
+				stop_when = stop_criterion::update;
+			}
+			else
+			{
+				printf("Invalid stop criterion %s\n", option_value);
+				return false;
+			}
+			stop_threshold = atof(threshold + 1);
+		}
+		else if (strcmp(option_name + 2, "stop-window") == 0)
+		{
+			stop_window = atoi(option_value);
+			if (stop_window < 1)
+			{
+				printf("Invalid stop window %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "prune") == 0)
+		{
+			prune_threshold = atof(option_value);
+		}
+		else if (strcmp(option_name + 2, "start") == 0)
+		{
+			start_line = atoll(option_value);
+		}
+		else if (strcmp(option_name + 2, "count") == 0)
+		{
+			line_count = atoll(option_value);
+		}
 		else if (strcmp(option_name + 2, "input") == 0)
 		{
 			input_text_path = utility::new_string(option_value);
@@ -174,7 +285,9 @@ bool option::parse(int argc, char *argv[])
 		{
 			tweet_buffer_path = utility::new_string(option_value, ".buffer.bin");
 			tweet_id_path = utility::new_string(option_value, ".id.bin");
+			tweet_index_path = utility::new_string(option_value, ".index.bin");
 			word_path = utility::new_string(option_value, ".word.txt");
+			word_index_path = utility::new_string(option_value, ".word.idx");
 			user_path = utility::new_string(option_value, ".user.txt");
 			summary_path = utility::new_string(option_value, ".summary.txt");
 		}
@@ -184,6 +297,7 @@ bool option::parse(int argc, char *argv[])
 			input_tweet_param_path = utility::new_string(option_value, ".tweet-param.bin");
 			input_user_param_path = utility::new_string(option_value, ".user-param.bin");
 			input_topic_param_path = utility::new_string(option_value, ".topic-param.bin");
+			input_param_index_path = utility::new_string(option_value, ".param-index.bin");
 		}
 		else if (strcmp(option_name + 2, "output-param") == 0)
 		{
@@ -191,6 +305,61 @@ bool option::parse(int argc, char *argv[])
 			output_tweet_param_path = utility::new_string(option_value, ".tweet-param.bin");
 			output_user_param_path = utility::new_string(option_value, ".user-param.bin");
 			output_topic_param_path = utility::new_string(option_value, ".topic-param.bin");
+			output_param_index_path = utility::new_string(option_value, ".param-index.bin");
+		}
+		else if (strcmp(option_name + 2, "warm-param") == 0)
+		{
+			warm_topic_param_path = utility::new_string(option_value, ".topic-param.bin");
+		}
+		else if (strcmp(option_name + 2, "warm-buffer") == 0)
+		{
+			warm_word_path = utility::new_string(option_value, ".word.txt");
+		}
+		else if (strcmp(option_name + 2, "held-out") == 0)
+		{
+			held_out_path = utility::new_string(option_value);
+		}
+		else if (strcmp(option_name + 2, "fold-in") == 0)
+		{
+			fold_in = atoi(option_value) != 0;
+		}
+		else if (strcmp(option_name + 2, "checkpoint") == 0)
+		{
+			checkpoint_path = utility::new_string(option_value);
+		}
+		else if (strcmp(option_name + 2, "checkpoint-interval") == 0)
+		{
+			checkpoint_interval = atof(option_value);
+		}
+		else if (strcmp(option_name + 2, "config") == 0)
+		{
+			config_path = utility::new_string(option_value);
+		}
+		else if (strcmp(option_name + 2, "step") == 0)
+		{
+			step_size = atoi(option_value);
+			if (step_size < 1)
+			{
+				printf("Invalid step size %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "window") == 0)
+		{
+			window_size = atoi(option_value);
+			if (window_size < 1)
+			{
+				printf("Invalid window size %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "sweep") == 0)
+		{
+			sweep_num = atoi(option_value);
+		}
+		else if (strcmp(option_name + 2, "snapshot") == 0)
+		{
+			snapshot_size = atoll(option_value);
 		}
 		else if (strcmp(option_name + 2, "stopword") == 0)
 		{
@@ -204,6 +373,114 @@ bool option::parse(int argc, char *argv[])
 		{
 			min_word_freq = atoi(option_value);
 		}
+		else if (strcmp(option_name + 2, "buffer-version") == 0)
+		{
+			buffer_version = atoi(option_value);
+			if (buffer_version != 1 && buffer_version != 2)
+			{
+				printf("Invalid buffer version %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "param-version") == 0)
+		{
+			param_version = atoi(option_value);
+			if (param_version != 1 && param_version != 2)
+			{
+				printf("Invalid parameter version %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "shard") == 0)
+		{
+			shard_num = atoi(option_value);
+			if (shard_num < 0 || shard_num > 100)
+			{
+				printf("Invalid shard number %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "pass") == 0)
+		{
+			pass_num = atoi(option_value);
+			if (pass_num != 1 && pass_num != 2)
+			{
+				printf("Invalid pass number %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "sketch") == 0)
+		{
+			sketch_size = atoi(option_value);
+			if (sketch_size < 0 || sketch_size > (1 << 20))
+			{
+				printf("Invalid sketch size %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "hash") == 0)
+		{
+			hash_num = atoi(option_value);
+			if (hash_num < 0 || hash_num > (1 << 26))
+			{
+				printf("Invalid hash number %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "top-word") == 0)
+		{
+			top_word_path = utility::new_string(option_value);
+		}
+		else if (strcmp(option_name + 2, "sort") == 0)
+		{
+			sort_size = atoi(option_value);
+			if (sort_size < 0 || sort_size > (1 << 20))
+			{
+				printf("Invalid sort size %s\n", option_value);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "delimiter") == 0)
+		{
+			char *value = new char[strlen(option_value) + 1];
+			size_t size = 0;
+			for (const char *ptr = option_value; *ptr != '\0'; ++ptr)
+			{
+				if (ptr[0] == '\\' && (ptr[1] == 't' || ptr[1] == '\\'))
+				{
+					++ptr;
+					value[size++] = (*ptr == 't') ? '\t' : '\\';
+				}
+				else
+				{
+					value[size++] = *ptr;
+				}
+			}
+			value[size] = '\0';
+			delete_string(delimiters);
+			delimiters = value;
+			if (size == 0 || size > utility::tokenizer::max_delimiters)
+			{
+				printf("Invalid delimiters %s, 1 to %d characters are supported\n", option_value, (int)utility::tokenizer::max_delimiters);
+				return false;
+			}
+		}
+		else if (strcmp(option_name + 2, "extend") == 0)
+		{
+			extend = atoi(option_value) != 0;
+		}
+		else if (strcmp(option_name + 2, "dedup") == 0)
+		{
+			dedup = atoi(option_value) != 0;
+		}
+		else if (strcmp(option_name + 2, "io") == 0)
+		{
+			if (!async_io::parse_mode(option_value, &io_mode))
+			{
+				printf("Invalid I/O backend %s\n", option_value);
+				return false;
+			}
+		}
 		else
 		{
 			printf("Invalid option %s\n", option_name);
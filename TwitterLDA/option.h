@@ -1,29 +1,63 @@
 #pragma once
+
+#include "async_io.h"
+
 class option
 {
 public:
+	// training stops early once the log-likelihood or the update ratio settles over a window of iterations
+	enum stop_criterion
+	{
+		never, likelihood, update
+	};
+
 	option();
 	~option();
 	bool parse(int argc, char *argv[]);
 	void print_usage(const char *command = nullptr);
 
 	const char *input_text_path, *output_text_path;
-	const char *tweet_buffer_path, *tweet_id_path, *word_path, *user_path, *summary_path;
+	const char *tweet_buffer_path, *tweet_id_path, *tweet_index_path, *word_path, *word_index_path, *user_path, *summary_path;
 	const char *input_param_path_prefix, *output_param_path_prefix;
 	const char *input_tweet_param_path, *output_tweet_param_path;
 	const char *input_user_param_path, *output_user_param_path;
 	const char *input_topic_param_path, *output_topic_param_path;
+	const char *input_param_index_path, *output_param_index_path;
 	const char *hyper_param_path;
+	const char *warm_topic_param_path, *warm_word_path;
+	const char *held_out_path;
+	const char *checkpoint_path;
+	double checkpoint_interval;
+	const char *config_path;
+	bool fold_in;
+	int step_size, window_size;
+	int sweep_num;
+	long long snapshot_size;
 
 	const char *command;
 	size_t thread_num;
 	size_t batch_size;
 	int iteration_num;
+	stop_criterion stop_when;
+	double stop_threshold;
+	int stop_window;
+	double prune_threshold;
+	long long start_line, line_count;
 
 	double alpha_m1, beta_m1, beta_bg_m1, gamma_m1;
 	int topic_num;
 
-	const char *stopword_path;
+	const char *stopword_path, *top_word_path;
 	int min_user_freq, min_word_freq;
+	int buffer_version, param_version;
+	int shard_num;
+	int pass_num;
+	int sketch_size;
+	int hash_num;
+	int sort_size;
+	bool extend;
+	bool dedup;
+	const char *delimiters;
+	async_io::io_mode io_mode;
 };
 
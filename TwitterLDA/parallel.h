@@ -7,7 +7,7 @@ class parallel
 {
 public:
 	parallel(size_t thread_num);
-	~parallel();
+	virtual ~parallel();
 
 protected:
 	size_t _thread_num;
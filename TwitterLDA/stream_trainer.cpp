@@ -0,0 +1,268 @@
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include "stream_trainer.h"
+#include "model.h"
+#include "parallel.h"
+#include "utility.h"
+
+static const char default_user[] = "*";
+
+// reads a whole line of any length as a null terminated string, blocking until it is complete in a pipe
+static bool read_line(FILE *fp, std::vector<char> &line)
+{
+	char chunk[4096];
+	line.clear();
+	while (fgets(chunk, sizeof(chunk), fp) != nullptr)
+	{
+		line.insert(line.end(), chunk, chunk + strlen(chunk));
+		if (line.back() == '\n') break;
+	}
+	if (line.empty()) return false;
+	while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+	line.push_back('\0');
+	return true;
+}
+
+stream_trainer::stream_trainer(model &m, bool warm, const char *word_path, const char *word_index_path, size_t thread_num) : parallel(thread_num), _m(m)
+{
+	_warm = warm;
+	_encoding = false;
+	_line_count = 0;
+	_random_engines.resize(thread_num);
+	for (size_t i = 0; i < thread_num; ++i)
+	{
+		std::seed_seq seed = { 5489u, (unsigned int)i };
+		_random_engines[i].seed(seed);
+	}
+	_scratches.resize(thread_num);
+	_log_likelihoods.resize(thread_num);
+	_word_counts.resize(thread_num);
+
+	// in hashed mode only the exact top words are indexed, the bucket lines after them are labels
+	_hash_num = m.hash_num();
+	_exact_word_num = m.word_num() - _hash_num;
+	if (_hash_num == 0 || _exact_word_num > 0)
+	{
+		if (word_index_path == nullptr || !_word_index.load(word_index_path)) _word_index.build(word_path, (_hash_num > 0) ? _exact_word_num : -1);
+	}
+}
+
+stream_trainer::~stream_trainer()
+{
+}
+
+void stream_trainer::train(const char *input_path, size_t step_size, size_t window_size, int sweep_num, long long snapshot_size, const char *topic_param_path)
+{
+	FILE *fp = (strcmp(input_path, "-") == 0) ? stdin : fopen(input_path, "rb");
+	if (fp == nullptr)
+	{
+		printf("Failed to open %s\n", input_path);
+		return;
+	}
+
+	std::default_random_engine random_engine; // picks the older tweets resampled with every step
+	auto start_time = std::chrono::high_resolution_clock::now();
+	long long tweet_count = 0, snapshot_count = 0;
+	bool is_end = false;
+	while (!is_end)
+	{
+		for (_line_count = 0; _line_count < step_size; ++_line_count)
+		{
+			if (_lines.size() <= _line_count) _lines.resize(_line_count + 1);
+			if (read_line(fp, _lines[_line_count])) continue;
+			is_end = true;
+			break;
+		}
+		if (_line_count == 0) break;
+
+		_new_tweets.resize(_line_count);
+		_encoding = true;
+		parallel::_update();
+		_encoding = false;
+
+		// new tweets join the window unsampled, the window then drops its oldest tweets
+		size_t new_count = 0;
+		for (size_t i = 0; i < _line_count; ++i)
+		{
+			stream_tweet &tweet = _new_tweets[i];
+			if (tweet.words.empty()) continue;
+			stream_user &user = _users[tweet.user];
+			if (user.topic_counts.empty())
+			{
+				user.topic_counts.assign(_m.topic_num(), 0);
+				user.all_topic_count = 0;
+				user.tweet_count = 0;
+			}
+			++user.tweet_count;
+			_window.push_back(tweet);
+			++new_count;
+		}
+		_evict(window_size);
+		new_count = std::min(new_count, _window.size());
+		size_t old_count = _window.size() - new_count;
+
+		// the first pass samples the new tweets into the counts, the sweeps revisit them with random older ones
+		for (int sweep = 0; sweep <= sweep_num; ++sweep)
+		{
+			_targets.clear();
+			for (size_t i = old_count; i < _window.size(); ++i) _targets.push_back(i);
+			if (sweep > 0 && old_count > 0)
+			{
+				std::uniform_int_distribution<size_t> old_distr(0, old_count - 1);
+				for (size_t i = 0; i < new_count; ++i) _targets.push_back(old_distr(random_engine));
+			}
+			_sampled_topics.resize(_targets.size());
+			if (_sampled_word_tags.size() < _targets.size()) _sampled_word_tags.resize(_targets.size());
+			parallel::_update();
+			_merge();
+		}
+
+		double log_likelihood = 0.0;
+		long long word_count = 0;
+		for (size_t i = 0; i < _thread_num; ++i)
+		{
+			log_likelihood += _log_likelihoods[i];
+			word_count += _word_counts[i];
+		}
+
+		tweet_count += new_count;
+		snapshot_count += new_count;
+		if (snapshot_size > 0 && snapshot_count >= snapshot_size)
+		{
+			_save(topic_param_path);
+			snapshot_count = 0;
+		}
+
+		auto end_time = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+		printf("\r%lld tweets  %lld window  %lld users  %.4f log-likelihood/word  %.2fk tweet/sec  %.1f sec  ", tweet_count, (long long)_window.size(), (long long)_users.size(), log_likelihood / std::max(word_count, 1LL), (double)tweet_count / std::max((long long)duration.count(), 1LL), duration.count() * 0.001);
+		fflush(stdout);
+	}
+	if (fp != stdin) fclose(fp);
+
+	_save(topic_param_path);
+	printf("\n");
+	fflush(stdout);
+}
+
+void stream_trainer::_update(size_t id)
+{
+	if (_encoding)
+	{
+		size_t start = id * _line_count / _thread_num;
+		size_t end = (id + 1) * _line_count / _thread_num;
+		_encode(start, end);
+		return;
+	}
+
+	_resample(id);
+}
+
+void stream_trainer::_encode(size_t start, size_t end)
+{
+	utility::tokenizer tokenizer;
+	for (size_t i = start; i < end; ++i)
+	{
+		stream_tweet &tweet = _new_tweets[i];
+		tweet.topic = -1;
+		tweet.words.clear();
+		tweet.word_tags.clear();
+
+		const char *text = _lines[i].data();
+		size_t size = _lines[i].size() - 1;
+		const char *text_end = text + size;
+		const char *tab = (const char*)memchr(text, '\t', size);
+		tweet.user = (tab == nullptr) ? utility::hash_bytes(default_user, strlen(default_user)) : utility::hash_bytes(text, tab - text);
+		if (tab != nullptr) text = tab + 1;
+		tokenizer.reset(text, text_end - text);
+		const char *token;
+		size_t token_size;
+		while (tokenizer.next(&token, &token_size))
+		{
+			int word = _word_index.find(token, token_size);
+			if (word >= 0) tweet.words.push_back(word);
+			else if (_hash_num > 0) tweet.words.push_back(_exact_word_num + (int)(utility::hash_bytes(token, token_size) % (unsigned long long)_hash_num));
+		}
+	}
+}
+
+void stream_trainer::_resample(size_t id)
+{
+	size_t start = id * _targets.size() / _thread_num;
+	size_t end = (id + 1) * _targets.size() / _thread_num;
+	std::uniform_int_distribution<int> topic_distr(0, _m.topic_num() - 1);
+	std::uniform_int_distribution<int> word_distr(0, 0xff);
+	double log_likelihood = 0.0;
+	long long word_count = 0;
+	for (size_t i = start; i < end; ++i)
+	{
+		const stream_tweet &tweet = _window[_targets[i]];
+		const stream_user &user = _users.find(tweet.user)->second;
+		_sampled_topics[i] = tweet.topic;
+		_sampled_word_tags[i] = tweet.word_tags;
+		if (tweet.topic < 0 && !_warm)
+		{
+			// without a loaded model new tweets start as in cold initialization, the sweeps then sample them
+			_sampled_topics[i] = topic_distr(_random_engines[id]);
+			std::vector<char> &word_tags = _sampled_word_tags[i];
+			for (size_t j = 0; j < tweet.words.size(); j += 8) word_tags.push_back((char)word_distr(_random_engines[id]));
+			continue;
+		}
+		log_likelihood += _m.sample_tweet(tweet.words, _sampled_word_tags[i], &_sampled_topics[i], user.topic_counts.data(), user.all_topic_count, _scratches[id], _random_engines[id]);
+		word_count += tweet.words.size();
+	}
+	_log_likelihoods[id] = log_likelihood;
+	_word_counts[id] = word_count;
+}
+
+void stream_trainer::_merge()
+{
+	// a tweet picked twice in a sweep moves its counts twice, from whatever it was last merged with
+	for (size_t i = 0; i < _targets.size(); ++i)
+	{
+		stream_tweet &tweet = _window[_targets[i]];
+		stream_user &user = _users[tweet.user];
+		if (tweet.topic >= 0)
+		{
+			_m.add_tweet(tweet.words, tweet.word_tags, tweet.topic, -1);
+			--user.topic_counts[tweet.topic];
+			--user.all_topic_count;
+		}
+		tweet.topic = _sampled_topics[i];
+		tweet.word_tags.swap(_sampled_word_tags[i]);
+		_m.add_tweet(tweet.words, tweet.word_tags, tweet.topic, 1);
+		++user.topic_counts[tweet.topic];
+		++user.all_topic_count;
+	}
+}
+
+void stream_trainer::_evict(size_t window_size)
+{
+	while (_window.size() > window_size)
+	{
+		stream_tweet &tweet = _window.front();
+		auto user_itor = _users.find(tweet.user);
+		stream_user &user = user_itor->second;
+		if (tweet.topic >= 0)
+		{
+			_m.add_tweet(tweet.words, tweet.word_tags, tweet.topic, -1);
+			--user.topic_counts[tweet.topic];
+			--user.all_topic_count;
+		}
+		if (--user.tweet_count == 0) _users.erase(user_itor);
+		_window.pop_front();
+	}
+}
+
+void stream_trainer::_save(const char *topic_param_path)
+{
+	// readers of the snapshot never see a partly written file
+	char *temp_path = utility::new_string(topic_param_path, ".temp");
+	_m.save_topic_param(temp_path);
+	if (!utility::replace_file(temp_path, topic_param_path)) printf("Failed to write snapshot %s\n", topic_param_path);
+	delete[] temp_path;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <random>
+#include "model.h"
+#include "parallel.h"
+#include "vocab_index.h"
+
+// Online training over a sliding window of the latest tweets of a text stream, the counts of the model are
+// the counts it started with plus those of the tweets in the window
+class stream_trainer : public parallel
+{
+public:
+	stream_trainer(model &m, bool warm, const char *word_path, const char *word_index_path, size_t thread_num);
+	~stream_trainer();
+
+	// reads lines until the stream ends, - for standard input; every step of new tweets is sampled into the counts,
+	// the oldest tweets beyond the window are evicted, then the new tweets and as many random older ones are resampled
+	// sweep times; topic params are replaced every snapshot tweets and at the end
+	void train(const char *input_path, size_t step_size, size_t window_size, int sweep_num, long long snapshot_size, const char *topic_param_path);
+
+private:
+	struct stream_tweet
+	{
+		unsigned long long user; // hash of the user name
+		int topic; // -1 until sampled into the counts
+		std::vector<int> words;
+		std::vector<char> word_tags;
+	};
+
+	// users with tweets in the window, dropped with their last tweet
+	struct stream_user
+	{
+		std::vector<int> topic_counts;
+		int all_topic_count;
+		int tweet_count;
+	};
+
+	model &_m;
+	bool _warm; // new tweets are sampled from the loaded counts instead of drawn uniformly
+	vocab_index _word_index;
+	int _hash_num;
+	int _exact_word_num;
+
+	std::deque<stream_tweet> _window;
+	std::unordered_map<unsigned long long, stream_user> _users;
+
+	// lines of the step being encoded
+	std::vector<std::vector<char>> _lines;
+	size_t _line_count;
+	std::vector<stream_tweet> _new_tweets;
+
+	// window positions resampled in a sweep and their samples, merged into the counts in this order
+	std::vector<size_t> _targets;
+	std::vector<int> _sampled_topics;
+	std::vector<std::vector<char>> _sampled_word_tags;
+
+	bool _encoding;
+	std::vector<std::default_random_engine> _random_engines;
+	std::vector<model::sample_scratch> _scratches;
+	std::vector<double> _log_likelihoods;
+	std::vector<long long> _word_counts;
+
+	void _update(size_t id);
+	void _encode(size_t start, size_t end);
+	void _resample(size_t id);
+	void _merge();
+	void _evict(size_t window_size);
+	void _save(const char *topic_param_path);
+};
+
@@ -0,0 +1,176 @@
+#include "tweet_index.h"
+#include "utility.h"
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+template <class T>
+static bool load_items(const char *path, std::vector<T> &items)
+{
+	items.clear();
+	if (path == nullptr) return false;
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr) return false;
+	T item;
+	while (utility::fread(&item, 1, fp) == 1) items.push_back(item);
+	fclose(fp);
+	return true;
+}
+
+static bool tweet_less(long long tweet, const tweet_index_item &item)
+{
+	return tweet < item.tweet;
+}
+
+static bool tweet_id_less(long long tweet_id, const tweet_index_item &item)
+{
+	return tweet_id < item.tweet_id;
+}
+
+tweet_index::tweet_index()
+{
+}
+
+bool tweet_index::load(const char *tweet_index_path, const char *param_index_path)
+{
+	_param_items.clear();
+	if (!load_items(tweet_index_path, _items)) return false;
+	if (param_index_path != nullptr && load_items(param_index_path, _param_items) && _param_items.size() != _items.size())
+	{
+		printf("Parameter index file not match\n");
+		_param_items.clear();
+	}
+	return true;
+}
+
+bool tweet_index::empty() const
+{
+	return _items.empty();
+}
+
+bool tweet_index::has_param() const
+{
+	return !_items.empty() && _param_items.size() == _items.size();
+}
+
+size_t tweet_index::size() const
+{
+	return _items.size();
+}
+
+const tweet_index_item &tweet_index::item(size_t i) const
+{
+	return _items[i];
+}
+
+const param_index_item &tweet_index::param_item(size_t i) const
+{
+	return _param_items[i];
+}
+
+size_t tweet_index::find_tweet(long long tweet) const
+{
+	// last block starting at or before the tweet
+	auto itor = std::upper_bound(_items.begin(), _items.end(), tweet, tweet_less);
+	return (itor == _items.begin()) ? 0 : (itor - _items.begin() - 1);
+}
+
+size_t tweet_index::find_tweet_id(long long tweet_id) const
+{
+	auto itor = std::upper_bound(_items.begin(), _items.end(), tweet_id, tweet_id_less);
+	return (itor == _items.begin()) ? 0 : (itor - _items.begin() - 1);
+}
+
+void tweet_index::save(const char *path, const std::vector<tweet_index_item> &items)
+{
+	FILE *fp = fopen(path, "wb");
+	utility::fwrite(items.data(), items.size(), fp);
+	fclose(fp);
+}
+
+param_index_writer::param_index_writer(const tweet_index &index) : _index(index)
+{
+	param_index_item item = { 0, 0 };
+	_items.resize(index.size(), item);
+	_tweet_count = 0;
+	_user_count = 0;
+	_next_tweet_item = 0;
+	_next_user_item = 0;
+}
+
+bool param_index_writer::resume(const char *param_index_path, long long tweet_count, long long user_count)
+{
+	// params of the first tweets and user records are already written, their index items are kept
+	std::vector<param_index_item> items;
+	if (!load_items(param_index_path, items) && tweet_count > 0) return false;
+	_tweet_count = tweet_count;
+	_user_count = user_count;
+	_next_tweet_item = 0;
+	_next_user_item = 0;
+	while (_next_tweet_item < _items.size() && _index.item(_next_tweet_item).tweet < tweet_count) ++_next_tweet_item;
+	while (_next_user_item < _items.size() && _index.item(_next_user_item).user_record < user_count) ++_next_user_item;
+	if (items.size() != _next_tweet_item || items.size() != _next_user_item) return false;
+	std::copy(items.begin(), items.end(), _items.begin());
+	return true;
+}
+
+long long param_index_writer::last_user_param_offset() const
+{
+	return (_next_user_item > 0) ? _items[_next_user_item - 1].user_param_offset : 0;
+}
+
+void param_index_writer::add_tweet(long long tweet_param_offset)
+{
+	if (_next_tweet_item < _items.size() && _index.item(_next_tweet_item).tweet == _tweet_count)
+	{
+		_items[_next_tweet_item++].tweet_param_offset = tweet_param_offset;
+	}
+	++_tweet_count;
+}
+
+void param_index_writer::add_user(long long user_param_offset)
+{
+	if (_next_user_item < _items.size() && _index.item(_next_user_item).user_record == _user_count)
+	{
+		_items[_next_user_item++].user_param_offset = user_param_offset;
+	}
+	++_user_count;
+}
+
+void param_index_writer::write_state(utility::write_buffer &buffer) const
+{
+	int item_count = (int)std::max(_next_tweet_item, _next_user_item);
+	buffer.write(_tweet_count);
+	buffer.write(_user_count);
+	buffer.write(item_count);
+	buffer.write_bytes(_items.data(), item_count * sizeof(param_index_item));
+}
+
+bool param_index_writer::read_state(utility::read_buffer &buffer)
+{
+	long long tweet_count, user_count;
+	int item_count;
+	if (buffer.read(&tweet_count) == 0 || buffer.read(&user_count) == 0 || buffer.read(&item_count) == 0) return false;
+	if (item_count < 0 || (size_t)item_count > _items.size()) return false;
+	if (item_count > 0 && buffer.read_bytes(_items.data(), item_count * sizeof(param_index_item)) == 0) return false;
+	_tweet_count = tweet_count;
+	_user_count = user_count;
+	_next_tweet_item = 0;
+	_next_user_item = 0;
+	while (_next_tweet_item < _items.size() && _index.item(_next_tweet_item).tweet < tweet_count) ++_next_tweet_item;
+	while (_next_user_item < _items.size() && _index.item(_next_user_item).user_record < user_count) ++_next_user_item;
+	return true;
+}
+
+void param_index_writer::save(const char *path)
+{
+	if (path == nullptr || _items.empty()) return;
+	if (_next_tweet_item != _items.size() || _next_user_item != _items.size())
+	{
+		printf("Parameter file not aligned with tweet index, skip saving parameter index\n");
+		return;
+	}
+	FILE *fp = fopen(path, "wb");
+	utility::fwrite(_items.data(), _items.size(), fp);
+	fclose(fp);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+	Index schema
+
+	tweet_index_file: (one item per block of tweets starting at a user boundary)
+		tweet_index_item items[];
+
+	param_index_file: (one item per item of tweet_index_file)
+		param_index_item items[];
+*/
+
+#include <vector>
+#include "utility.h"
+
+struct tweet_index_item
+{
+	long long tweet; // index of first tweet in the block
+	long long tweet_id; // line of first tweet in text file
+	long long user_record; // number of user runs before the block
+	long long tweet_offset; // byte offset in tweet file
+	long long tweet_id_offset; // byte offset in tweet id file
+	long long text_offset; // byte offset in text file
+	int user; // user of first tweet
+	int tweet_count; // number of tweets in the block
+};
+
+// end of a buffer shard before new tweets are appended
+struct buffer_extent
+{
+	long long tweet_count;
+	long long user_record_count;
+	long long buffer_size; // byte offset of the first appended tweet
+	int last_user; // user of the last run, -1 if the shard is empty
+};
+
+struct param_index_item
+{
+	long long tweet_param_offset; // byte offset in tweet param file
+	long long user_param_offset; // byte offset in user param file
+};
+
+class tweet_index
+{
+public:
+	static const int block_size = 1 << 10;
+
+	tweet_index();
+
+	bool load(const char *tweet_index_path, const char *param_index_path = nullptr);
+	bool empty() const;
+	bool has_param() const;
+	size_t size() const;
+	const tweet_index_item &item(size_t i) const;
+	const param_index_item &param_item(size_t i) const;
+
+	size_t find_tweet(long long tweet) const;
+	size_t find_tweet_id(long long tweet_id) const;
+
+	static void save(const char *path, const std::vector<tweet_index_item> &items);
+
+private:
+	std::vector<tweet_index_item> _items;
+	std::vector<param_index_item> _param_items;
+};
+
+// Collects param file offsets at block boundaries while params are written in tweet order
+class param_index_writer
+{
+public:
+	param_index_writer(const tweet_index &index);
+
+	bool resume(const char *param_index_path, long long tweet_count, long long user_count);
+	long long last_user_param_offset() const;
+	void add_tweet(long long tweet_param_offset);
+	void add_user(long long user_param_offset);
+	void save(const char *path);
+
+	// items collected so far, for checkpoints of an iteration in progress
+	void write_state(utility::write_buffer &buffer) const;
+	bool read_state(utility::read_buffer &buffer);
+
+private:
+	const tweet_index &_index;
+	std::vector<param_index_item> _items;
+	long long _tweet_count, _user_count;
+	size_t _next_tweet_item, _next_user_item;
+};
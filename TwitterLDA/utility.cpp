@@ -2,6 +2,33 @@
 #include "file_reader.h"
 #include <cstring>
 #include <cstdio>
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+const utility::stream_vbyte_table utility::stream_vbyte;
+
+utility::stream_vbyte_table::stream_vbyte_table()
+{
+	for (int c = 0; c < 256; ++c)
+	{
+		int offset = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			int len = ((c >> (i * 2)) & 3) + 1;
+			for (int j = 0; j < 4; ++j)
+			{
+				// 0xff makes the shuffle write zero to the byte
+				shuffles[c][i * 4 + j] = (j < len) ? (unsigned char)(offset + j) : 0xff;
+			}
+			offset += len;
+		}
+		lengths[c] = (unsigned char)offset;
+	}
+}
 
 size_t utility::string_hasher::operator()(const char *str) const
 {
@@ -36,6 +63,240 @@ char *utility::new_string(const char *str1, const char *str2)
 	return new_str;
 }
 
+char *utility::shard_path(const char *path, int shard_num, int shard)
+{
+	// "x.buffer.bin" becomes "x.buffer.03.bin", unsharded path is copied as is
+	size_t len = strlen(path);
+	if (shard_num <= 0) return new_string(path, "");
+	size_t ext = len;
+	while (ext > 0 && path[ext - 1] != '.' && path[ext - 1] != '/' && path[ext - 1] != '\\') --ext;
+	ext = (ext > 0 && path[ext - 1] == '.') ? ext - 1 : len;
+	char *new_str = new char[len + 16];
+	memcpy(new_str, path, ext);
+	sprintf(new_str + ext, ".%02d%s", shard, path + ext);
+	return new_str;
+}
+
+unsigned long long utility::hash_string(const char *str)
+{
+	return hash_bytes(str, strlen(str));
+}
+
+unsigned long long utility::hash_bytes(const char *data, size_t size)
+{
+	// 64 bit FNV-1a, then the splitmix64 finalizer to spread short tokens over all bits
+	unsigned long long hash = 14695981039346656037ull;
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebull;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+static inline size_t lowest_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return (size_t)__builtin_ctz(mask);
+#endif
+}
+
+size_t utility::find_line_end(const char *data, size_t size)
+{
+	size_t i = 0;
+#ifdef UTILITY_AVX2
+	const __m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n');
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr32), _mm256_cmpeq_epi8(v, lf32)));
+		if (mask != 0) return i + lowest_bit(mask);
+	}
+#endif
+#ifdef UTILITY_SSSE3
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if (mask != 0) return i + lowest_bit(mask);
+	}
+#endif
+	while (i < size && data[i] != '\r' && data[i] != '\n') ++i;
+	return i;
+}
+
+const size_t utility::tokenizer::max_delimiters;
+char utility::tokenizer::_default_delimiters[max_delimiters + 1] = " ";
+
+utility::tokenizer::tokenizer()
+{
+	_init(_default_delimiters);
+}
+
+utility::tokenizer::tokenizer(const char *delimiters)
+{
+	_init(delimiters);
+}
+
+void utility::tokenizer::_init(const char *delimiters)
+{
+	size_t count = strlen(delimiters);
+	if (count > max_delimiters)
+	{
+		printf("Only the first %d of delimiters %s are used\n", (int)max_delimiters, delimiters);
+		count = max_delimiters;
+	}
+	memcpy(_delimiters, delimiters, count);
+	_delimiters[count] = '\0';
+	std::fill(_classes, _classes + 256, (unsigned char)char_class::text);
+	for (size_t i = 0; i < count; ++i) _classes[(unsigned char)_delimiters[i]] = char_class::delimiter;
+	_classes[0] = char_class::end;
+	_ptr = _end = nullptr;
+}
+
+bool utility::tokenizer::set_default_delimiters(const char *delimiters)
+{
+	size_t count = strlen(delimiters);
+	if (count == 0 || count > max_delimiters) return false;
+	memcpy(_default_delimiters, delimiters, count + 1);
+	return true;
+}
+
+const char *utility::tokenizer::default_delimiters()
+{
+	return _default_delimiters;
+}
+
+void utility::tokenizer::reset(const char *data, size_t size)
+{
+	_ptr = data;
+	_end = data + size;
+}
+
+bool utility::tokenizer::next(const char **token, size_t *size)
+{
+	// tokens are usually separated by a single delimiter, so skipping them needs no vector scan
+	while (_ptr < _end && _classes[(unsigned char)*_ptr] == char_class::delimiter) ++_ptr;
+	if (_ptr >= _end || _classes[(unsigned char)*_ptr] == char_class::end)
+	{
+		_ptr = _end;
+		return false;
+	}
+	*token = _ptr;
+	_ptr = _find_boundary(_ptr + 1);
+	*size = (size_t)(_ptr - *token);
+	return true;
+}
+
+const char *utility::tokenizer::_find_boundary(const char *ptr) const
+{
+	// bytes are compared with every delimiter and '\0' at once, a set bit marks a boundary
+#ifdef UTILITY_AVX2
+	if (ptr + 32 <= _end)
+	{
+		__m256i delimiters32[max_delimiters];
+		size_t count = 0;
+		for (; _delimiters[count] != '\0'; ++count) delimiters32[count] = _mm256_set1_epi8(_delimiters[count]);
+		const __m256i zero32 = _mm256_setzero_si256();
+		for (; ptr + 32 <= _end; ptr += 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+			__m256i m = _mm256_cmpeq_epi8(v, zero32);
+			for (size_t i = 0; i < count; ++i) m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, delimiters32[i]));
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+			if (mask != 0) return ptr + lowest_bit(mask);
+		}
+	}
+#endif
+#ifdef UTILITY_SSSE3
+	if (ptr + 16 <= _end)
+	{
+		__m128i delimiters[max_delimiters];
+		size_t count = 0;
+		for (; _delimiters[count] != '\0'; ++count) delimiters[count] = _mm_set1_epi8(_delimiters[count]);
+		const __m128i zero = _mm_setzero_si128();
+		for (; ptr + 16 <= _end; ptr += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)ptr);
+			__m128i m = _mm_cmpeq_epi8(v, zero);
+			for (size_t i = 0; i < count; ++i) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, delimiters[i]));
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+			if (mask != 0) return ptr + lowest_bit(mask);
+		}
+	}
+#endif
+	while (ptr < _end && _classes[(unsigned char)*ptr] == char_class::text) ++ptr;
+	return ptr;
+}
+
+utility::string_pool::string_pool(size_t block_size)
+{
+	_block_size = block_size;
+	_block = nullptr;
+	_offset = block_size;
+}
+
+utility::string_pool::~string_pool()
+{
+	clear();
+}
+
+char *utility::string_pool::add(const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *new_str;
+	if (size > _block_size / 4)
+	{
+		// long strings get their own blocks, so the current block is not wasted
+		new_str = new char[size];
+		_blocks.push_back(new_str);
+	}
+	else
+	{
+		if (_offset + size > _block_size)
+		{
+			_block = new char[_block_size];
+			_blocks.push_back(_block);
+			_offset = 0;
+		}
+		new_str = _block + _offset;
+		_offset += size;
+	}
+	memcpy(new_str, str, size);
+	_strings.push_back(new_str);
+	return new_str;
+}
+
+char *utility::string_pool::get(size_t id) const
+{
+	return _strings[id];
+}
+
+size_t utility::string_pool::size() const
+{
+	return _strings.size();
+}
+
+void utility::string_pool::clear()
+{
+	for (size_t i = 0; i < _blocks.size(); ++i) delete[] _blocks[i];
+	_blocks.clear();
+	_strings.clear();
+	_block = nullptr;
+	_offset = _block_size;
+}
+
 bool utility::file_exist(const char *path)
 {
 	FILE *fp = fopen(path, "rb");
@@ -49,3 +310,98 @@ bool utility::file_exist(const char *path)
 		return true;
 	}
 }
+
+long long utility::file_size(FILE *fp)
+{
+	if (fp == nullptr) return 0;
+#ifdef  _WIN64
+	long long position = _ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_END);
+	long long size = _ftelli64(fp);
+	_fseeki64(fp, position, SEEK_SET);
+#else
+	long long position = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	long long size = ftell(fp);
+	fseek(fp, (long)position, SEEK_SET);
+#endif
+	return size;
+}
+
+bool utility::seek_file(FILE *fp, long long offset)
+{
+#ifdef  _WIN64
+	return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+	return fseek(fp, (long)offset, SEEK_SET) == 0;
+#endif
+}
+
+bool utility::copy_file(const char *src_path, const char *dst_path)
+{
+	FILE *fp_src = fopen(src_path, "rb");
+	if (fp_src == nullptr) return false;
+	FILE *fp_dst = fopen(dst_path, "wb");
+	if (fp_dst == nullptr)
+	{
+		fclose(fp_src);
+		return false;
+	}
+	const size_t block_size = 16 << 20;
+	char *buffer = new char[block_size];
+	bool succeeded = true;
+	while (true)
+	{
+		size_t got = fread(buffer, 1, block_size, fp_src);
+		if (got == 0) break;
+		if (fwrite(buffer, 1, got, fp_dst) != got)
+		{
+			succeeded = false;
+			break;
+		}
+	}
+	delete[] buffer;
+	fclose(fp_src);
+	fclose(fp_dst);
+	return succeeded;
+}
+
+bool utility::sync_file(FILE *fp)
+{
+	if (fp == nullptr || fflush(fp) != 0) return false;
+#ifdef _MSC_VER
+	return _commit(_fileno(fp)) == 0;
+#else
+	return fsync(fileno(fp)) == 0;
+#endif
+}
+
+bool utility::sync_file(const char *path)
+{
+	// any handle of the file flushes what was written through the others
+	FILE *fp = fopen(path, "r+b");
+	bool succeeded = sync_file(fp);
+	if (fp != nullptr) fclose(fp);
+	return succeeded;
+}
+
+bool utility::truncate_file(const char *path, long long size)
+{
+#ifdef _MSC_VER
+	FILE *fp = fopen(path, "r+b");
+	if (fp == nullptr) return false;
+	bool succeeded = _chsize_s(_fileno(fp), size) == 0;
+	fclose(fp);
+	return succeeded;
+#else
+	return truncate(path, (off_t)size) == 0;
+#endif
+}
+
+bool utility::replace_file(const char *src_path, const char *dst_path)
+{
+#ifdef _MSC_VER
+	remove(dst_path); // rename does not overwrite on Windows
+#endif
+	return rename(src_path, dst_path) == 0;
+}
@@ -1,14 +1,41 @@
 #pragma once
 
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 #include <limits>
+#include <vector>
+
+#if defined(_M_X64) || defined(__SSSE3__)
+#include <tmmintrin.h>
+#define UTILITY_SSSE3
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#define UTILITY_AVX2
+#endif
 
 namespace utility
 {
 	char *new_string(char *str);
 	char *new_string(const char *str1, const char *str2);
+	char *shard_path(const char *path, int shard_num, int shard);
+	unsigned long long hash_string(const char *str);
+	unsigned long long hash_bytes(const char *data, size_t size);
 	bool file_exist(const char *path);
+	long long file_size(FILE *fp);
+	bool seek_file(FILE *fp, long long offset);
+	bool copy_file(const char *src_path, const char *dst_path);
+
+	// durable file updates for checkpoints, replace_file renames over an existing file
+	bool sync_file(FILE *fp);
+	bool sync_file(const char *path);
+	bool truncate_file(const char *path, long long size);
+	bool replace_file(const char *src_path, const char *dst_path);
+
+	// position of the first '\r' or '\n', or size if there is none
+	size_t find_line_end(const char *data, size_t size);
 
 	template <class T> T **new_array(size_t n1, size_t n2)
 	{
@@ -117,6 +144,96 @@ namespace utility
 		return offset;
 	}
 
+	// lookup tables for stream vbyte, indexed by control byte
+	struct stream_vbyte_table
+	{
+		unsigned char lengths[256];
+		unsigned char shuffles[256][16];
+
+		stream_vbyte_table();
+	};
+
+	extern const stream_vbyte_table stream_vbyte;
+
+	// stream vbyte layout: ceil(n / 4) control bytes holding (byte length - 1) of each value in 2 bits,
+	// followed by the little-endian value bytes
+	inline size_t get_stream_vbyte_size(const char *data, size_t count, size_t size = std::numeric_limits<size_t>::max())
+	{
+		size_t control_size = (count + 3) / 4;
+		if (control_size > size) return 0;
+		const unsigned char *control = (const unsigned char *)data;
+		size_t offset = control_size;
+		for (size_t i = 0; i < count / 4; ++i) offset += stream_vbyte.lengths[control[i]];
+		for (size_t i = count / 4 * 4; i < count; ++i) offset += ((control[i / 4] >> ((i % 4) * 2)) & 3) + 1;
+		if (offset > size) return 0;
+		return offset;
+	}
+
+	template <class T> size_t get_stream_vbyte(const char *data, T *values, size_t count, size_t size = std::numeric_limits<size_t>::max())
+	{
+		static_assert(sizeof(T) == 4, "Stream vbyte values must be 32-bit");
+		size_t control_size = (count + 3) / 4;
+		if (control_size > size) return 0;
+		const unsigned char *control = (const unsigned char *)data;
+		const char *ptr = data + control_size;
+		const char *end = data + size;
+		size_t i = 0;
+
+		// whole groups of four values while a full 16-byte load stays inside the buffer
+		for (; i + 4 <= count && (size_t)(end - ptr) >= 16; i += 4)
+		{
+			unsigned char c = control[i / 4];
+#ifdef UTILITY_SSSE3
+			__m128i v = _mm_loadu_si128((const __m128i *)ptr);
+			v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)stream_vbyte.shuffles[c]));
+			_mm_storeu_si128((__m128i *)(values + i), v);
+			ptr += stream_vbyte.lengths[c];
+#else
+			const unsigned int masks[4] = { 0xff, 0xffff, 0xffffff, 0xffffffff };
+			for (size_t j = 0; j < 4; ++j)
+			{
+				unsigned int len = (c >> (j * 2)) & 3;
+				unsigned int v;
+				memcpy(&v, ptr, sizeof(v));
+				values[i + j] = (T)(v & masks[len]);
+				ptr += len + 1;
+			}
+#endif
+		}
+
+		// remaining values near the end of buffer
+		for (; i < count; ++i)
+		{
+			size_t len = ((control[i / 4] >> ((i % 4) * 2)) & 3) + 1;
+			if ((size_t)(end - ptr) < len) return 0;
+			unsigned int v = 0;
+			memcpy(&v, ptr, len);
+			values[i] = (T)v;
+			ptr += len;
+		}
+		return ptr - data;
+	}
+
+	template <class T> size_t set_stream_vbyte(char *data, const T *values, size_t count, size_t size = std::numeric_limits<size_t>::max())
+	{
+		static_assert(sizeof(T) == 4, "Stream vbyte values must be 32-bit");
+		size_t control_size = (count + 3) / 4;
+		if (control_size >= size) return 0;
+		unsigned char *control = (unsigned char *)data;
+		std::fill(control, control + control_size, 0);
+		size_t offset = control_size;
+		for (size_t i = 0; i < count; ++i)
+		{
+			unsigned int v = (unsigned int)values[i];
+			size_t len = (v < (1u << 8)) ? 1 : (v < (1u << 16)) ? 2 : (v < (1u << 24)) ? 3 : 4;
+			if (offset + len > size) return 0;
+			control[i / 4] |= (unsigned char)((len - 1) << ((i % 4) * 2));
+			memcpy(data + offset, &v, len);
+			offset += len;
+		}
+		return offset;
+	}
+
 	class read_buffer
 	{
 	public:
@@ -149,6 +266,30 @@ namespace utility
 			return more;
 		}
 
+		template <class T> size_t read_varints(T *values, size_t count)
+		{
+			if (_offset >= _size) return 0;
+			size_t more = get_stream_vbyte(_buffer + _offset, values, count, _size - _offset);
+			_offset += more;
+			return more;
+		}
+
+		size_t read_bytes(void *data, size_t count)
+		{
+			if (_offset + count > _size) return 0;
+			memcpy(data, _buffer + _offset, count);
+			_offset += count;
+			return count;
+		}
+
+		size_t skip_varints(size_t count)
+		{
+			if (_offset >= _size) return 0;
+			size_t more = get_stream_vbyte_size(_buffer + _offset, count, _size - _offset);
+			_offset += more;
+			return more;
+		}
+
 		template <class T> size_t read(T *value)
 		{
 			if (_offset + sizeof(T) > _size) return 0;
@@ -223,6 +364,31 @@ namespace utility
 			}
 		}
 
+		template <class T> size_t write_varints(const T *values, size_t count)
+		{
+			while (true)
+			{
+				if (_offset < _capacity)
+				{
+					size_t more = set_stream_vbyte(_buffer + _offset, values, count, _capacity - _offset);
+					if (more > 0)
+					{
+						_offset += more;
+						return more;
+					}
+				}
+				expand();
+			}
+		}
+
+		size_t write_bytes(const void *data, size_t count)
+		{
+			while (_offset + count > _capacity) expand();
+			memcpy(_buffer + _offset, data, count);
+			_offset += count;
+			return count;
+		}
+
 		template <class T> size_t write(const T value)
 		{
 			while (true)
@@ -290,6 +456,61 @@ namespace utility
 		}
 	};
 
+	// strings are copied into large blocks and freed together, ids are in order of addition
+	class string_pool
+	{
+	public:
+		string_pool(size_t block_size = 1 << 20);
+		~string_pool();
+
+		char *add(const char *str);
+		char *get(size_t id) const;
+		size_t size() const;
+		void clear();
+
+	private:
+		size_t _block_size;
+		char *_block;
+		size_t _offset;
+		std::vector<char*> _blocks;
+		std::vector<char*> _strings;
+
+		string_pool(const string_pool&);
+		string_pool &operator=(const string_pool&);
+	};
+
+	// Splits text into (ptr, size) token spans at any of the delimiters without modifying it
+	// runs of delimiters give no empty tokens, and text ends at size or at the first '\0'
+	class tokenizer
+	{
+	public:
+		static const size_t max_delimiters = 8;
+
+		tokenizer();
+		tokenizer(const char *delimiters);
+
+		void reset(const char *data, size_t size);
+		bool next(const char **token, size_t *size);
+
+		static bool set_default_delimiters(const char *delimiters);
+		static const char *default_delimiters();
+
+	private:
+		enum char_class
+		{
+			text, delimiter, end
+		};
+
+		char _delimiters[max_delimiters + 1];
+		unsigned char _classes[256];
+		const char *_ptr, *_end;
+
+		static char _default_delimiters[max_delimiters + 1];
+
+		void _init(const char *delimiters);
+		const char *_find_boundary(const char *ptr) const;
+	};
+
 	template <class T>
 	size_t fread(T *data, size_t num, FILE *fp)
 	{
@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstring>
+#include "vocab_index.h"
+#include "utility.h"
+#include "file_reader.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VOCAB_INDEX_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char word_index_header[4] = { 'W', 'I', 'D', 1 };
+static const size_t word_index_header_size = 16;
+
+vocab_index::vocab_index()
+{
+	_data = nullptr;
+	_data_size = 0;
+	_mapped = false;
+	_word_num = 0;
+	_slot_mask = 0;
+	_slots = nullptr;
+	_offsets = nullptr;
+	_chars = nullptr;
+}
+
+vocab_index::~vocab_index()
+{
+	clear();
+}
+
+void vocab_index::build(const std::vector<const char*> &words)
+{
+	clear();
+
+	int word_num = (int)words.size();
+	unsigned int slot_num = 2;
+	while (slot_num < 2 * (unsigned int)word_num) slot_num <<= 1;
+	size_t char_size = 0;
+	for (int i = 0; i < word_num; ++i) char_size += strlen(words[i]) + 1;
+
+	_data_size = word_index_header_size + slot_num * sizeof(vocab_slot) + (word_num + 1) * sizeof(long long) + char_size;
+	_data = new char[_data_size];
+	memcpy(_data, word_index_header, sizeof(word_index_header));
+	int counts[3] = { word_num, (int)slot_num, 0 };
+	memcpy(_data + sizeof(word_index_header), counts, sizeof(counts));
+
+	vocab_slot *slots = (vocab_slot*)(_data + word_index_header_size);
+	long long *offsets = (long long*)(slots + slot_num);
+	char *chars = (char*)(offsets + word_num + 1);
+	for (unsigned int i = 0; i < slot_num; ++i)
+	{
+		slots[i].tag = 0;
+		slots[i].id = -1;
+	}
+
+	long long offset = 0;
+	for (int i = 0; i < word_num; ++i)
+	{
+		size_t size = strlen(words[i]);
+		offsets[i] = offset;
+		memcpy(chars + offset, words[i], size + 1);
+		offset += size + 1;
+
+		unsigned long long hash = utility::hash_bytes(words[i], size);
+		unsigned int slot = (unsigned int)hash & (slot_num - 1);
+		while (slots[slot].id >= 0) slot = (slot + 1) & (slot_num - 1);
+		slots[slot].tag = (unsigned int)(hash >> 32);
+		slots[slot].id = i;
+	}
+	offsets[word_num] = offset;
+
+	_attach();
+}
+
+void vocab_index::build(const char *list_path, int max_num)
+{
+	utility::string_pool strs;
+	text_file_reader reader(list_path);
+	while (max_num < 0 || (int)strs.size() < max_num)
+	{
+		file_item item = reader.get_item(false);
+		if (item.size == 0) break;
+		char *ptr = strchr(item.data, '\t');
+		if (ptr != nullptr) *ptr = '\0';
+		strs.add(item.data);
+	}
+	std::vector<const char*> str_list;
+	for (size_t i = 0; i < strs.size(); ++i) str_list.push_back(strs.get(i));
+	build(str_list);
+}
+
+bool vocab_index::save(const char *path) const
+{
+	FILE *fp = fopen(path, "wb");
+	if (fp == nullptr) return false;
+	bool ok = (_data == nullptr) || fwrite(_data, 1, _data_size, fp) == _data_size;
+	fclose(fp);
+	return ok;
+}
+
+bool vocab_index::load(const char *path)
+{
+	clear();
+
+#ifdef VOCAB_INDEX_MMAP
+	// pages are mapped read only, no parsing is needed beyond the header
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			_data = (char*)data;
+			_data_size = (size_t)st.st_size;
+			_mapped = true;
+		}
+	}
+	::close(fd);
+	if (_data == nullptr) return false;
+#else
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr) return false;
+	long long file_size = utility::file_size(fp);
+	if (file_size > 0)
+	{
+		_data_size = (size_t)file_size;
+		_data = new char[_data_size];
+		if (utility::fread(_data, _data_size, fp) != _data_size)
+		{
+			delete[] _data;
+			_data = nullptr;
+		}
+	}
+	fclose(fp);
+	if (_data == nullptr) return false;
+#endif
+
+	if (!_attach())
+	{
+		clear();
+		return false;
+	}
+	return true;
+}
+
+void vocab_index::clear()
+{
+	if (_data != nullptr)
+	{
+#ifdef VOCAB_INDEX_MMAP
+		if (_mapped) munmap(_data, _data_size);
+		else delete[] _data;
+#else
+		delete[] _data;
+#endif
+	}
+	_data = nullptr;
+	_data_size = 0;
+	_mapped = false;
+	_word_num = 0;
+	_slot_mask = 0;
+	_slots = nullptr;
+	_offsets = nullptr;
+	_chars = nullptr;
+}
+
+int vocab_index::find(const char *str, size_t size) const
+{
+	if (_slots == nullptr) return -1;
+	unsigned long long hash = utility::hash_bytes(str, size);
+	unsigned int tag = (unsigned int)(hash >> 32);
+	unsigned int slot = (unsigned int)hash & _slot_mask;
+	while (true)
+	{
+		const vocab_slot &s = _slots[slot];
+		if (s.id < 0) return -1;
+		if (s.tag == tag && (size_t)(_offsets[s.id + 1] - _offsets[s.id] - 1) == size && memcmp(_chars + _offsets[s.id], str, size) == 0) return s.id;
+		slot = (slot + 1) & _slot_mask;
+	}
+}
+
+int vocab_index::find(const char *str) const
+{
+	return find(str, strlen(str));
+}
+
+const char *vocab_index::word(int id) const
+{
+	return _chars + _offsets[id];
+}
+
+int vocab_index::size() const
+{
+	return _word_num;
+}
+
+bool vocab_index::_attach()
+{
+	if (_data_size < word_index_header_size || memcmp(_data, word_index_header, sizeof(word_index_header)) != 0) return false;
+	int counts[3];
+	memcpy(counts, _data + sizeof(word_index_header), sizeof(counts));
+	int word_num = counts[0];
+	unsigned int slot_num = (unsigned int)counts[1];
+	if (word_num < 0 || slot_num == 0 || (slot_num & (slot_num - 1)) != 0 || slot_num <= (unsigned int)word_num) return false;
+	size_t table_size = word_index_header_size + slot_num * sizeof(vocab_slot) + (word_num + 1) * sizeof(long long);
+	if (_data_size < table_size) return false;
+
+	_word_num = word_num;
+	_slot_mask = slot_num - 1;
+	_slots = (const vocab_slot*)(_data + word_index_header_size);
+	_offsets = (const long long*)(_slots + slot_num);
+	_chars = (const char*)(_offsets + word_num + 1);
+	if (_data_size < table_size + (size_t)_offsets[word_num])
+	{
+		_slots = nullptr;
+		return false;
+	}
+	return true;
+}
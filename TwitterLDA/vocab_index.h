@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+	Index schema
+
+	word_index_file:
+		char header[4] = { 'W', 'I', 'D', 1 };
+		int word_num;
+		int slot_num; (power of two, at least twice word_num)
+		int reserved;
+		vocab_slot slots[slot_num]; (linear probing from hash & (slot_num - 1))
+		long long offsets[word_num + 1]; (byte offset of each word in chars)
+		char chars[]; (words in id order, each followed by '\0')
+*/
+
+#include <cstddef>
+#include <vector>
+
+struct vocab_slot
+{
+	unsigned int tag; // high 32 bits of hash
+	int id; // -1 for empty slot
+};
+
+// Open addressing word to id table, the in memory layout is the file layout
+class vocab_index
+{
+public:
+	vocab_index();
+	~vocab_index();
+
+	void build(const std::vector<const char*> &words);
+	void build(const char *list_path, int max_num = -1); // first field of every line of a word or user file
+	bool save(const char *path) const;
+	bool load(const char *path);
+	void clear();
+
+	int find(const char *str, size_t size) const;
+	int find(const char *str) const;
+	const char *word(int id) const;
+	int size() const;
+
+private:
+	char *_data;
+	size_t _data_size;
+	bool _mapped;
+
+	int _word_num;
+	unsigned int _slot_mask;
+	const vocab_slot *_slots;
+	const long long *_offsets;
+	const char *_chars;
+
+	bool _attach();
+};